@@ -0,0 +1,72 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#ifndef __GUAC_BASE64_H
+#define __GUAC_BASE64_H
+
+#include <stddef.h>
+
+/**
+ * Internal base64 encoding routines used by guac_socket. The encoder used is
+ * chosen at runtime based on the features supported by the CPU. This header
+ * is used only internally within libguac, and is not installed along with
+ * the library.
+ *
+ * @file base64.h
+ */
+
+/**
+ * The 64 characters of the base64 alphabet, in order.
+ */
+extern char __guac_socket_BASE64_CHARACTERS[64];
+
+/**
+ * Encodes the given number of complete three-byte groups (triplets) as
+ * base64, writing exactly four characters per triplet to the given output
+ * buffer. No padding is ever written, and the output is not null-terminated.
+ *
+ * @param in The data to encode. At least (triplets * 3) bytes must be
+ *           readable.
+ * @param triplets The number of complete triplets to encode.
+ * @param out The buffer to write to. At least (triplets * 4) bytes must be
+ *            writable.
+ */
+void __guac_base64_encode_triplets(const unsigned char* in, size_t triplets,
+        char* out);
+
+#endif
+
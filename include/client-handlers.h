@@ -52,24 +52,7 @@
 /**
  * Internal handler for Guacamole instructions.
  */
-typedef int __guac_instruction_handler(guac_client* client, guac_instruction* copied);
-
-/**
- * Structure mapping an instruction opcode to an instruction handler.
- */
-typedef struct __guac_instruction_handler_mapping {
-
-    /**
-     * The instruction opcode which maps to a specific handler.
-     */
-    char* opcode;
-
-    /**
-     * The handler which maps to a specific opcode.
-     */
-    __guac_instruction_handler* handler;
-
-} __guac_instruction_handler_mapping;
+typedef guac_client_instruction_handler __guac_instruction_handler;
 
 /**
  * Internal initial handler for the sync instruction. When a sync instruction
@@ -122,12 +105,11 @@ int __guac_handle_ovdapp(guac_client* client, guac_instruction* instruction);
 int __guac_handle_ukbrdr(guac_client* client, guac_instruction* instruction);
 
 /**
- * Instruction handler mapping table. This is a NULL-terminated array of
- * __guac_instruction_handler_mapping structures, each mapping an opcode
- * to a __guac_instruction_handler. The end of the array must be marked
- * with a __guac_instruction_handler_mapping with the opcode set to
- * NULL (the NULL terminator).
+ * Instruction handler mapping table. This is an array of
+ * __guac_instruction_handler, indexed by guac_opcode, containing the initial
+ * handler of each opcode, or NULL if instructions with that opcode are
+ * ignored. Each guac_client begins with a copy of this table.
  */
-extern __guac_instruction_handler_mapping __guac_instruction_handler_map[];
+extern __guac_instruction_handler* __guac_instruction_handler_map[GUAC_OPCODE_COUNT];
 
 #endif
@@ -51,6 +51,13 @@
  */
 
 typedef struct guac_client guac_client;
+
+/**
+ * The number of hash buckets used to look up the handlers of instructions
+ * whose opcodes are not defined by guac_opcode.
+ */
+#define GUAC_CLIENT_HANDLER_BUCKETS 32
+
 typedef struct guac_client_plugin guac_client_plugin;
 
 /**
@@ -69,6 +76,68 @@ typedef int guac_client_mouse_handler(guac_client* client, int x, int y, int but
  */
 typedef int guac_client_key_handler(guac_client* client, int keysym, int pressed);
 
+/**
+ * The type of a guac_input_event.
+ */
+typedef enum guac_input_event_type {
+
+    /**
+     * A mouse event, as received with the "mouse" instruction.
+     */
+    GUAC_INPUT_EVENT_MOUSE,
+
+    /**
+     * A key event, as received with the "key" instruction.
+     */
+    GUAC_INPUT_EVENT_KEY
+
+} guac_input_event_type;
+
+/**
+ * A single mouse or key event, as passed to a guac_client_input_handler.
+ */
+typedef struct guac_input_event {
+
+    /**
+     * Whether this event is a mouse event or a key event.
+     */
+    guac_input_event_type type;
+
+    /**
+     * The X coordinate of the mouse pointer, if this is a mouse event.
+     */
+    int x;
+
+    /**
+     * The Y coordinate of the mouse pointer, if this is a mouse event.
+     */
+    int y;
+
+    /**
+     * The mask of all mouse buttons currently pressed, if this is a mouse
+     * event.
+     */
+    int button_mask;
+
+    /**
+     * The X11 keysym of the key pressed or released, if this is a key event.
+     */
+    int keysym;
+
+    /**
+     * Whether the key is being pressed (1) or released (0), if this is a key
+     * event.
+     */
+    int pressed;
+
+} guac_input_event;
+
+/**
+ * Handler for batches of Guacamole mouse and key events.
+ */
+typedef int guac_client_input_handler(guac_client* client,
+        guac_input_event* events, int count);
+
 /**
  * Handler for Guacamole seamrdp events.
  */
@@ -89,6 +158,13 @@ typedef int guac_client_ukbrdr_handler(guac_client* client, char* data);
  */
 typedef int guac_client_clipboard_handler(guac_client* client, char* copied);
 
+/**
+ * Handler for arbitrary Guacamole instructions, as registered with
+ * guac_client_register_handler().
+ */
+typedef int guac_client_instruction_handler(guac_client* client,
+        guac_instruction* instruction);
+
 /**
  * Handler for freeing up any extra data allocated by the client
  * implementation.
@@ -193,6 +269,32 @@ struct guac_client_plugin {
 
 };
 
+typedef struct __guac_client_handler_entry __guac_client_handler_entry;
+
+/**
+ * A handler registered for an opcode not defined by guac_opcode, stored
+ * within the hash table of such handlers of a guac_client.
+ */
+struct __guac_client_handler_entry {
+
+    /**
+     * The opcode handled.
+     */
+    char* __opcode;
+
+    /**
+     * The handler to call for instructions with this opcode.
+     */
+    guac_client_instruction_handler* __handler;
+
+    /**
+     * The next handler within the same hash bucket, or NULL if this is the
+     * last handler.
+     */
+    __guac_client_handler_entry* __next;
+
+};
+
 /**
  * Guacamole proxy client.
  *
@@ -482,6 +584,57 @@ struct guac_client {
      */
     guac_layer* __all_layers;
 
+    /**
+     * The handler of each opcode defined by guac_opcode, indexed by
+     * guac_opcode, or NULL if instructions with that opcode are ignored.
+     */
+    guac_client_instruction_handler* __instruction_handlers[GUAC_OPCODE_COUNT];
+
+    /**
+     * Hash table of the handlers registered for opcodes not defined by
+     * guac_opcode, each bucket being a list of handlers.
+     */
+    __guac_client_handler_entry* __custom_handlers[GUAC_CLIENT_HANDLER_BUCKETS];
+
+    /**
+     * Storage for the mouse and key events pending within
+     * guac_client_handle_instructions().
+     */
+    guac_input_event* __input_events;
+
+    /**
+     * The number of events which can be stored within __input_events.
+     */
+    int __input_events_size;
+
+    /**
+     * Handler for batches of mouse and key events sent by the Guacamole
+     * web-client. If set, this handler is called by
+     * guac_client_handle_instructions() in place of mouse_handler and
+     * key_handler, receiving all consecutive mouse and key events handled
+     * in a single call, in the order received.
+     *
+     * Example:
+     * @code
+     *     int input_handler(guac_client* client, guac_input_event* events,
+     *             int count);
+     *
+     *     int guac_client_init(guac_client* client, int argc, char** argv) {
+     *         client->input_handler = input_handler;
+     *     }
+     * @endcode
+     */
+    guac_client_input_handler* input_handler;
+
+    /**
+     * Whether guac_client_handle_instructions() should coalesce mouse events.
+     * If non-zero, each run of consecutive mouse events having the same
+     * button mask is collapsed into its last event. Mouse events are never
+     * reordered with respect to key events or changes in button mask, and
+     * no events are coalesced by guac_client_handle_instruction().
+     */
+    int coalesce_mouse;
+
 };
 
 /**
@@ -533,8 +686,9 @@ void guac_client_free(guac_client* client);
 
 /**
  * Call the appropriate handler defined by the given client for the given
- * instruction. A comparison is made between the instruction opcode and the
- * initial handler lookup table defined in client-handlers.c. The intial
+ * instruction. The handler is looked up by the opcode of the instruction,
+ * using the initial handler lookup table defined in client-handlers.c and
+ * any handlers registered with guac_client_register_handler(). The intial
  * handlers will in turn call the client's handler (if defined).
  *
  * @param client The proxy client whose handlers should be called.
@@ -543,6 +697,50 @@ void guac_client_free(guac_client* client);
  */
 int guac_client_handle_instruction(guac_client* client, guac_instruction* instruction);
 
+/**
+ * Call the appropriate handlers defined by the given client for each of the
+ * given instructions, in order, such as the instructions read by a single
+ * call to guac_protocol_read_instructions(). Consecutive mouse and key
+ * instructions are passed together to the client's input_handler, if
+ * defined, or otherwise to its mouse_handler and key_handler. If the
+ * coalesce_mouse property of the client is set, consecutive mouse
+ * instructions having the same button mask are collapsed into the last such
+ * instruction. All other instructions are handled as by
+ * guac_client_handle_instruction().
+ *
+ * Instructions whose handlers have been replaced with
+ * guac_client_register_handler() are never batched or coalesced.
+ *
+ * If an error occurs while handling the instructions, a non-zero value is
+ * returned, and no further instructions are handled.
+ *
+ * @param client The proxy client whose handlers should be called.
+ * @param instructions The instructions to pass to the proxy client.
+ * @param count The number of instructions to handle.
+ * @return Zero on success, non-zero if an error occurs.
+ */
+int guac_client_handle_instructions(guac_client* client,
+        guac_instruction* instructions, int count);
+
+/**
+ * Registers the given handler for all instructions with the given opcode
+ * received by the given guac_client, replacing any handler previously
+ * registered for that opcode, including the handlers provided by libguac.
+ * Handlers are looked up in constant time, with opcodes defined by
+ * guac_opcode dispatched directly by their guac_opcode value.
+ *
+ * If an error occurs while registering the handler, a non-zero value is
+ * returned, and guac_error is set appropriately.
+ *
+ * @param client The proxy client to register the handler with.
+ * @param opcode The opcode of the instructions to handle.
+ * @param handler The handler to call for each such instruction, or NULL if
+ *                such instructions should be ignored.
+ * @return Zero on success, non-zero if an error occurs.
+ */
+int guac_client_register_handler(guac_client* client, const char* opcode,
+        guac_client_instruction_handler* handler);
+
 /**
  * Allocates a new buffer (invisible layer). An arbitrary index is
  * automatically assigned if no existing buffer is available for use.
@@ -0,0 +1,234 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#ifndef __GUAC_ENCODER_H
+#define __GUAC_ENCODER_H
+
+#include <stddef.h>
+#include <png.h>
+
+#include "palette.h"
+
+/**
+ * Internal workspace reused by each image encoded by libguac, such that a
+ * steady stream of images requires no heap allocation once the workspace
+ * has grown to fit the largest image. This header is used only internally
+ * within libguac, and is not installed along with the library.
+ *
+ * @file encoder.h
+ */
+
+/**
+ * The number of bytes of encoded PNG data stored within each chunk of a
+ * buffered PNG.
+ */
+#define __GUAC_ENCODER_CHUNK_SIZE 16384
+
+/**
+ * The minimum size of each block of the arena from which libpng allocates
+ * memory, in bytes. This is enough for the deflate state of zlib at its
+ * default settings, plus the structures of libpng itself.
+ */
+#define __GUAC_ENCODER_BLOCK_SIZE 393216
+
+/**
+ * A single fixed-size chunk of encoded PNG data.
+ */
+typedef struct __guac_encoder_chunk {
+
+    /**
+     * The next chunk of PNG data, or NULL if this is the last chunk.
+     */
+    struct __guac_encoder_chunk* next;
+
+    /**
+     * The number of bytes of PNG data stored in this chunk.
+     */
+    int length;
+
+    /**
+     * The PNG data stored in this chunk.
+     */
+    unsigned char data[__GUAC_ENCODER_CHUNK_SIZE];
+
+} __guac_encoder_chunk;
+
+/**
+ * A single block of memory within the arena of a workspace.
+ */
+typedef struct __guac_encoder_block {
+
+    /**
+     * The next block of the arena, or NULL if this is the last block.
+     */
+    struct __guac_encoder_block* next;
+
+    /**
+     * The number of bytes which can be allocated from this block.
+     */
+    size_t size;
+
+    /**
+     * The number of bytes already allocated from this block.
+     */
+    size_t used;
+
+} __guac_encoder_block;
+
+/**
+ * Workspace for encoding images, retaining all memory between images.
+ */
+typedef struct __guac_encoder {
+
+    /**
+     * The palette of the image being encoded.
+     */
+    guac_palette* palette;
+
+    /**
+     * Contiguous buffer receiving the palette index of every pixel.
+     */
+    png_byte* indices;
+
+    /**
+     * The number of bytes allocated for indices.
+     */
+    size_t indices_size;
+
+    /**
+     * Pointers to the start of each row within indices.
+     */
+    png_byte** rows;
+
+    /**
+     * The number of pointers allocated for rows.
+     */
+    int rows_size;
+
+    /**
+     * Pool of unused chunks of PNG data.
+     */
+    __guac_encoder_chunk* free_chunks;
+
+    /**
+     * The blocks of the arena from which libpng and zlib allocate all
+     * memory, in order of use.
+     */
+    __guac_encoder_block* blocks;
+
+    /**
+     * The block of the arena currently being allocated from.
+     */
+    __guac_encoder_block* current;
+
+    /**
+     * The total number of bytes allocated from the arena for the image
+     * being encoded, which determines the size of the arena once reset.
+     */
+    size_t arena_used;
+
+} __guac_encoder;
+
+/**
+ * Allocates a new, empty workspace. Returns NULL if memory cannot be
+ * allocated.
+ *
+ * @return A newly allocated workspace, or NULL on error.
+ */
+__guac_encoder* __guac_encoder_alloc();
+
+/**
+ * Frees the given workspace and all memory retained by it.
+ *
+ * @param encoder The workspace to free.
+ */
+void __guac_encoder_free(__guac_encoder* encoder);
+
+/**
+ * Returns the workspace of the current thread, allocating it if necessary.
+ * Returns NULL if memory cannot be allocated, or if libguac was built
+ * without thread support.
+ *
+ * @return The workspace of the current thread, or NULL on error.
+ */
+__guac_encoder* __guac_encoder_get_thread_encoder();
+
+/**
+ * Returns row pointers into a single contiguous buffer of palette indices
+ * large enough for an image of the given dimensions, growing the buffer
+ * only if it is too small. Returns NULL if memory cannot be allocated.
+ *
+ * @param encoder The workspace to use.
+ * @param width The width of the image, in pixels.
+ * @param height The height of the image, in pixels.
+ * @return An array of height row pointers, each to width bytes, or NULL on
+ *         error.
+ */
+png_byte** __guac_encoder_get_rows(__guac_encoder* encoder, int width,
+        int height);
+
+/**
+ * Returns an empty chunk for PNG data, reusing a pooled chunk if possible.
+ * Returns NULL if memory cannot be allocated.
+ *
+ * @param encoder The workspace to use.
+ * @return An empty chunk, or NULL on error.
+ */
+__guac_encoder_chunk* __guac_encoder_get_chunk(__guac_encoder* encoder);
+
+/**
+ * Returns the given list of chunks to the pool of the given workspace.
+ *
+ * @param encoder The workspace to return the chunks to.
+ * @param head The first chunk of the list, or NULL if the list is empty.
+ */
+void __guac_encoder_release_chunks(__guac_encoder* encoder,
+        __guac_encoder_chunk* head);
+
+/**
+ * Creates a libpng write structure whose memory, including the deflate
+ * state of zlib, is allocated from the arena of the given workspace. The
+ * arena is reset first, thus any structure previously created with the
+ * same workspace must have been destroyed.
+ *
+ * @param encoder The workspace to allocate from.
+ * @return A new libpng write structure, or NULL on error.
+ */
+png_structp __guac_encoder_create_png(__guac_encoder* encoder);
+
+#endif
+
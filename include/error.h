@@ -95,7 +95,13 @@ typedef enum guac_status {
      * The state of the associated system prevents an operation from being
      * performed which would otherwise be allowed.
      */
-    GUAC_STATUS_BAD_STATE
+    GUAC_STATUS_BAD_STATE,
+
+    /**
+     * The input stream associated with the operation contained an
+     * instruction larger than allowed.
+     */
+    GUAC_STATUS_INPUT_TOO_LARGE
 
 } guac_status;
 
@@ -0,0 +1,112 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#ifndef __GUAC_FORMAT_H
+#define __GUAC_FORMAT_H
+
+#include <stdint.h>
+
+/**
+ * Internal number formatting routines used to write the elements of
+ * instructions. These produce exactly the same text as the corresponding
+ * printf() conversions, without the overhead of parsing a format string.
+ * This header is used only internally within libguac, and is not installed
+ * along with the library.
+ *
+ * @file format.h
+ */
+
+/**
+ * The maximum number of characters written by __guac_format_int(), which is
+ * the length of INT64_MIN in decimal.
+ */
+#define __GUAC_FORMAT_INT_LENGTH 20
+
+/**
+ * The maximum number of characters written by __guac_format_double().
+ */
+#define __GUAC_FORMAT_DOUBLE_LENGTH 32
+
+/**
+ * Returns the number of decimal digits required to represent the given
+ * value.
+ *
+ * @param value The value to measure.
+ * @return The number of decimal digits in the given value, which is at
+ *         least 1.
+ */
+int __guac_format_count_digits(uint64_t value);
+
+/**
+ * Writes the given number of decimal digits of the given value, such that
+ * the last digit is written just before the given position. The output is
+ * not null-terminated.
+ *
+ * @param end The position just after the last digit to be written.
+ * @param value The value to write, which must have no more than the given
+ *              number of digits.
+ * @param digits The number of digits to write, as returned by
+ *               __guac_format_count_digits().
+ */
+void __guac_format_digits(char* end, uint64_t value, int digits);
+
+/**
+ * Writes the given integer in decimal, exactly as printf("%"PRIi64) would.
+ * The output is not null-terminated.
+ *
+ * @param buffer The buffer to write to, which must be able to hold at least
+ *               __GUAC_FORMAT_INT_LENGTH characters.
+ * @param value The value to write.
+ * @return The number of characters written.
+ */
+int __guac_format_int(char* buffer, int64_t value);
+
+/**
+ * Writes the given floating-point value exactly as printf("%g") would.
+ * Common values are formatted directly, while any value which cannot be
+ * formatted exactly this way is formatted with snprintf(). The output is
+ * not null-terminated.
+ *
+ * @param buffer The buffer to write to, which must be able to hold at least
+ *               __GUAC_FORMAT_DOUBLE_LENGTH characters.
+ * @param value The value to write.
+ * @return The number of characters written.
+ */
+int __guac_format_double(char* buffer, double value);
+
+#endif
+
@@ -55,9 +55,31 @@ typedef struct guac_palette {
     png_color colors[256];
     int size;
 
+    /* Location within entries of each color, such that only used entries
+     * need be cleared when the palette is reset */
+    int slots[256];
+
 } guac_palette;
 
-guac_palette* guac_palette_alloc(cairo_surface_t* surface);
+/* Allocates an empty palette, which can be reused for any number of images
+ * by resetting it with guac_palette_reset() */
+guac_palette* guac_palette_alloc();
+
+/* Removes all colors from the given palette */
+void guac_palette_reset(guac_palette* palette);
+
+/* Builds the palette of the given RGB24 surface while storing the palette
+ * index of each pixel in the given rows, in a single pass. The palette must
+ * be empty. Returns zero on success, or non-zero if the surface has more
+ * than 256 colors. */
+int guac_palette_build(guac_palette* palette, cairo_surface_t* surface,
+        png_byte** rows);
+
+/* Returns non-zero if a sample of the pixels of the given RGB24 surface
+ * alone has more than 256 colors, in which case no palette can be built for
+ * the surface. Returns zero if a palette may be possible. */
+int guac_palette_sample_overflows(cairo_surface_t* surface);
+
 int guac_palette_find(guac_palette* palette, int color);
 void guac_palette_free(guac_palette* palette);
 
@@ -0,0 +1,310 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#ifndef _GUAC_PARSER_H
+#define _GUAC_PARSER_H
+
+#include "protocol.h"
+
+/**
+ * Provides an incremental parser for the Guacamole protocol which is
+ * independent of any particular source of data.
+ *
+ * @file parser.h
+ */
+
+/**
+ * The base size of the buffer of a guac_parser, in bytes. The buffer grows
+ * beyond this size only as needed to hold large instructions, returning to
+ * this size once those instructions have been parsed.
+ */
+#define GUAC_PARSER_BUFFER_SIZE 8192
+
+/**
+ * The default maximum size of any instruction parsed by a guac_parser, in
+ * bytes.
+ */
+#define GUAC_PARSER_MAX_INSTRUCTION_SIZE 4194304
+
+/**
+ * The default maximum size of the buffer of a guac_parser, in bytes.
+ */
+#define GUAC_PARSER_MAX_BUFFER_SIZE 8388608
+
+/**
+ * The maximum number of elements (the opcode plus all arguments) of any
+ * instruction parsed.
+ */
+#define GUAC_INSTRUCTION_MAX_ELEMENTS 64
+
+/**
+ * The possible states of a guac_parser.
+ */
+typedef enum guac_parse_state {
+
+    /**
+     * The parser is reading the length of an element.
+     */
+    GUAC_PARSE_LENGTH,
+
+    /**
+     * The parser is waiting for the entire value of an element, and its
+     * terminator, to be buffered.
+     */
+    GUAC_PARSE_CONTENT,
+
+    /**
+     * The data parsed was not valid. The parser cannot continue.
+     */
+    GUAC_PARSE_ERROR
+
+} guac_parse_state;
+
+typedef struct guac_parser guac_parser;
+
+/**
+ * Handler which is called for each instruction parsed by guac_parser_feed().
+ * The instruction given is a view which remains valid only until the handler
+ * returns. A non-zero return value aborts the feed.
+ */
+typedef int guac_parser_instruction_handler(guac_instruction* instruction,
+        void* data);
+
+/**
+ * An incremental parser for the Guacamole protocol. Data is buffered within
+ * the parser as it is provided, and is parsed exactly once: the parser keeps
+ * its state across partial elements and instructions, resuming where it
+ * left off when more data arrives.
+ */
+struct guac_parser {
+
+    /**
+     * The current state of this parser.
+     */
+    guac_parse_state __state;
+
+    /**
+     * The length of the element currently being parsed, as read so far.
+     */
+    int __element_length;
+
+    /**
+     * The length of the first element (the opcode) of the current
+     * instruction, in bytes.
+     */
+    int __opcode_length;
+
+    /**
+     * The number of elements of the current instruction parsed so far.
+     */
+    int __elementc;
+
+    /**
+     * Pointers to the start of each element of the current instruction
+     * parsed so far, each within the buffer of this parser.
+     */
+    char* __elementv[GUAC_INSTRUCTION_MAX_ELEMENTS];
+
+    /**
+     * The buffer containing all data provided to this parser which has not
+     * yet been discarded.
+     */
+    char* __buffer;
+
+    /**
+     * The size of the buffer, in bytes.
+     */
+    int __size;
+
+    /**
+     * The number of bytes of data currently in the buffer.
+     */
+    int __length;
+
+    /**
+     * The number of bytes at the beginning of the buffer which belong to
+     * instructions already parsed. These bytes are discarded only when more
+     * space is needed.
+     */
+    int __consumed;
+
+    /**
+     * The offset within the buffer of the next byte to parse.
+     */
+    int __position;
+
+    /**
+     * The maximum size of any instruction parsed, in bytes.
+     */
+    int __max_instruction_size;
+
+    /**
+     * The maximum size of the buffer, in bytes.
+     */
+    int __max_buffer_size;
+
+};
+
+/**
+ * Allocates a new guac_parser.
+ *
+ * If an error occurs while allocating the guac_parser, NULL is returned, and
+ * guac_error is set appropriately.
+ *
+ * @return A newly allocated guac_parser, or NULL if an error occurs.
+ */
+guac_parser* guac_parser_alloc();
+
+/**
+ * Frees all memory allocated to the given guac_parser.
+ *
+ * @param parser The guac_parser to free.
+ */
+void guac_parser_free(guac_parser* parser);
+
+/**
+ * Limits the memory used by the given guac_parser. Instructions larger than
+ * the given maximum instruction size are rejected as soon as their size is
+ * known, and the buffer of the guac_parser never grows beyond the given
+ * maximum buffer size. Attempts to exceed either limit fail with guac_error
+ * set to GUAC_STATUS_INPUT_TOO_LARGE.
+ *
+ * @param parser The guac_parser to limit.
+ * @param max_instruction_size The maximum size of any instruction, in bytes,
+ *                             or zero for GUAC_PARSER_MAX_INSTRUCTION_SIZE.
+ * @param max_buffer_size The maximum size of the buffer, in bytes, or zero
+ *                        for GUAC_PARSER_MAX_BUFFER_SIZE. The buffer will
+ *                        never be limited to less than
+ *                        GUAC_PARSER_BUFFER_SIZE.
+ */
+void guac_parser_set_limits(guac_parser* parser, int max_instruction_size,
+        int max_buffer_size);
+
+/**
+ * Reserves space within the buffer of the given guac_parser for data to be
+ * written directly, as by recv(). Once data has been written, the number of
+ * bytes written must be committed with guac_parser_commit(). Any views of
+ * instructions previously parsed are invalidated.
+ *
+ * If an error occurs while reserving space, including if the buffer cannot
+ * grow any further, a negative value is returned, and guac_error is set
+ * appropriately.
+ *
+ * @param parser The guac_parser to reserve space within.
+ * @param length The minimum number of bytes to reserve.
+ * @param buffer A pointer to the char* which should receive the location of
+ *               the reserved space.
+ * @return The number of bytes reserved, which may be greater than requested,
+ *         or negative if an error occurs.
+ */
+int guac_parser_reserve(guac_parser* parser, int length, char** buffer);
+
+/**
+ * Adds the given number of bytes, written to space reserved with
+ * guac_parser_reserve(), to the data buffered by the given guac_parser.
+ *
+ * @param parser The guac_parser which reserved the space written to.
+ * @param length The number of bytes written.
+ */
+void guac_parser_commit(guac_parser* parser, int length);
+
+/**
+ * Copies the given data into the buffer of the given guac_parser, to be
+ * parsed by later calls to guac_parser_next(). Any views of instructions
+ * previously parsed are invalidated.
+ *
+ * If an error occurs while buffering the data, a non-zero value is
+ * returned, and guac_error is set appropriately.
+ *
+ * @param parser The guac_parser to provide data to.
+ * @param buffer The data to copy.
+ * @param length The number of bytes to copy.
+ * @return Zero on success, non-zero if an error occurs.
+ */
+int guac_parser_append(guac_parser* parser, const void* buffer, int length);
+
+/**
+ * Parses the next instruction from the data buffered within the given
+ * guac_parser, storing a view of the instruction in the given
+ * guac_instruction. The argv of the view remains valid only until the next
+ * call to guac_parser_next(), while its opcode and arguments remain valid
+ * until more data is provided to the guac_parser.
+ *
+ * If the data parsed is not valid, a negative value is returned, and
+ * guac_error is set appropriately. All further calls will fail in the same
+ * way.
+ *
+ * @param parser The guac_parser to parse data from.
+ * @param instruction The guac_instruction to store the view within.
+ * @return Positive if an instruction was parsed, zero if no complete
+ *         instruction is buffered, or negative on error.
+ */
+int guac_parser_next(guac_parser* parser, guac_instruction* instruction);
+
+/**
+ * Provides the given data to the given guac_parser, calling the given
+ * handler for each instruction completed by that data, in order.
+ *
+ * If the data parsed is not valid or cannot be buffered, or the handler
+ * returns non-zero, a non-zero value is returned, and all data not yet
+ * parsed, whether buffered or not, is discarded. As parsing cannot resume
+ * with part of its input missing, all further calls to guac_parser_next()
+ * and guac_parser_feed() will then fail. Unless the handler returned
+ * non-zero, guac_error is set appropriately.
+ *
+ * @param parser The guac_parser to provide data to.
+ * @param buffer The data to parse.
+ * @param length The number of bytes of data.
+ * @param handler The handler to call for each instruction parsed.
+ * @param data Arbitrary data to pass to the handler.
+ * @return Zero on success, non-zero if an error occurs.
+ */
+int guac_parser_feed(guac_parser* parser, const void* buffer, int length,
+        guac_parser_instruction_handler* handler, void* data);
+
+/**
+ * Returns the number of bytes buffered within the given guac_parser which do
+ * not belong to any instruction already parsed.
+ *
+ * @param parser The guac_parser to check.
+ * @return The number of bytes buffered but not yet parsed as part of a
+ *         complete instruction.
+ */
+int guac_parser_buffered(guac_parser* parser);
+
+#endif
+
@@ -172,6 +172,122 @@ typedef enum guac_line_join_style {
     GUAC_LINE_JOIN_ROUND = 0x2
 } guac_line_join_style;
 
+/**
+ * The ways in which the PNG data of a png instruction can be produced.
+ */
+typedef enum guac_protocol_png_mode {
+
+    /**
+     * Encode each image once, buffering the encoded image in its entirety
+     * until its length is known. This is the default.
+     */
+    GUAC_PROTOCOL_PNG_BUFFERED = 0,
+
+    /**
+     * Encode each image twice, first only to determine the length of the
+     * encoded image, and then again, writing the encoded data directly to
+     * the socket as it is produced. This doubles the cost of compression,
+     * but the memory required no longer depends on the size of the image.
+     */
+    GUAC_PROTOCOL_PNG_STREAMING
+
+} guac_protocol_png_mode;
+
+/**
+ * Value which may be given for any setting passed to
+ * guac_protocol_set_png_compression(), leaving that setting to libpng.
+ */
+#define GUAC_PROTOCOL_PNG_DEFAULT -1
+
+/**
+ * Predefined tradeoffs between the time taken to compress the images of png
+ * instructions and the size of the compressed images.
+ */
+typedef enum guac_protocol_png_profile {
+
+    /**
+     * Use the defaults of libpng and zlib for all settings. This is the
+     * default.
+     */
+    GUAC_PROTOCOL_PNG_BALANCED = 0,
+
+    /**
+     * Compress as quickly as possible, using zlib level 1 with run-length
+     * encoding and no PNG filtering. This is typically several times faster
+     * than the default for screen content, at a small cost in size.
+     */
+    GUAC_PROTOCOL_PNG_FAST,
+
+    /**
+     * Compress as much as possible, using zlib level 9, for connections on
+     * which bandwidth is scarcer than CPU time.
+     */
+    GUAC_PROTOCOL_PNG_SMALL
+
+} guac_protocol_png_profile;
+
+/**
+ * Identifiers for each opcode of the Guacamole protocol. The statistics of a
+ * guac_socket attribute the output of each instruction written to its
+ * opcode using these values.
+ */
+typedef enum guac_opcode {
+
+    /**
+     * Any opcode not listed here.
+     */
+    GUAC_OPCODE_UNKNOWN = 0,
+
+    GUAC_OPCODE_ARC,
+    GUAC_OPCODE_ARGS,
+    GUAC_OPCODE_CFILL,
+    GUAC_OPCODE_CLIP,
+    GUAC_OPCODE_CLIPBOARD,
+    GUAC_OPCODE_CLOSE,
+    GUAC_OPCODE_CONNECT,
+    GUAC_OPCODE_COPY,
+    GUAC_OPCODE_CSTROKE,
+    GUAC_OPCODE_CURSOR,
+    GUAC_OPCODE_CURVE,
+    GUAC_OPCODE_DISCONNECT,
+    GUAC_OPCODE_DISPOSE,
+    GUAC_OPCODE_DISTORT,
+    GUAC_OPCODE_ERROR,
+    GUAC_OPCODE_IDENTITY,
+    GUAC_OPCODE_IMESTATE,
+    GUAC_OPCODE_KEY,
+    GUAC_OPCODE_LFILL,
+    GUAC_OPCODE_LINE,
+    GUAC_OPCODE_LSTROKE,
+    GUAC_OPCODE_MOUSE,
+    GUAC_OPCODE_MOVE,
+    GUAC_OPCODE_NAME,
+    GUAC_OPCODE_OVDAPP,
+    GUAC_OPCODE_PNG,
+    GUAC_OPCODE_POP,
+    GUAC_OPCODE_PRINTJOB,
+    GUAC_OPCODE_PUSH,
+    GUAC_OPCODE_RECT,
+    GUAC_OPCODE_RESET,
+    GUAC_OPCODE_SEAMRDP,
+    GUAC_OPCODE_SELECT,
+    GUAC_OPCODE_SET,
+    GUAC_OPCODE_SHADE,
+    GUAC_OPCODE_SIZE,
+    GUAC_OPCODE_START,
+    GUAC_OPCODE_SYNC,
+    GUAC_OPCODE_TRANSFER,
+    GUAC_OPCODE_TRANSFORM,
+    GUAC_OPCODE_UKBRDR,
+
+    /**
+     * The number of opcodes defined, including GUAC_OPCODE_UNKNOWN. This
+     * must not exceed GUAC_SOCKET_STATS_OPCODES.
+     */
+    GUAC_OPCODE_COUNT
+
+} guac_opcode;
+
 typedef struct guac_layer guac_layer;
 
 /**
@@ -217,16 +333,128 @@ typedef struct guac_instruction {
      */
     char** argv;
 
+    /**
+     * The guac_opcode identifying the opcode of the instruction, or
+     * GUAC_OPCODE_UNKNOWN if the opcode is not one of those defined by
+     * guac_opcode. This is set for every instruction read, sparing the
+     * lookup of the opcode when the instruction is handled. Instructions
+     * constructed by hand need not set it, as a value which does not match
+     * the opcode is ignored (see guac_instruction_get_opcode()).
+     */
+    guac_opcode opcode_id;
+
 } guac_instruction;
 
+/**
+ * A single argument of a guac_instruction, as parsed by
+ * guac_instruction_decode() according to the type of that argument.
+ */
+typedef union guac_instruction_arg {
+
+    /**
+     * The value of an integer, boolean, layer index or timestamp argument.
+     */
+    int64_t integer;
+
+    /**
+     * The value of a floating-point argument.
+     */
+    double number;
+
+    /**
+     * The value of a string argument, which points into the argv of the
+     * decoded instruction.
+     */
+    const char* string;
+
+} guac_instruction_arg;
+
+/**
+ * Returns the opcode of the Guacamole protocol identified by the given
+ * guac_opcode value, as it would appear within an instruction.
+ *
+ * @param opcode The guac_opcode value to convert.
+ * @return The opcode identified by the given value, or an empty string if
+ *         the value does not identify any known opcode.
+ */
+const char* guac_protocol_opcode_name(guac_opcode opcode);
+
+/**
+ * Returns the guac_opcode value identifying the given opcode. Lookups are
+ * performed in constant time, requiring at most one string comparison.
+ *
+ * @param opcode The opcode to look up, which need not be null-terminated.
+ * @param length The length of the opcode, in bytes.
+ * @return The guac_opcode value identifying the given opcode, or
+ *         GUAC_OPCODE_UNKNOWN if the opcode is not one of those defined by
+ *         guac_opcode.
+ */
+guac_opcode guac_protocol_opcode_lookup(const char* opcode, int length);
+
+/**
+ * Returns the guac_opcode value identifying the opcode of the given
+ * instruction. The opcode_id of the instruction is used if it identifies the
+ * opcode of the instruction, and the opcode is looked up otherwise, thus
+ * opcode_id need not have been set.
+ *
+ * @param instruction The instruction whose opcode should be identified.
+ * @return The guac_opcode value identifying the opcode of the instruction,
+ *         or GUAC_OPCODE_UNKNOWN if the opcode is not one of those defined
+ *         by guac_opcode.
+ */
+guac_opcode guac_instruction_get_opcode(const guac_instruction* instruction);
+
+/**
+ * Parses the arguments of the given instruction according to the types that
+ * the Guacamole protocol defines for the arguments of its opcode, storing one
+ * guac_instruction_arg for each argument. Integer arguments must consist only
+ * of decimal digits, optionally preceded by a minus sign. Arguments beyond
+ * those defined for the opcode are ignored, except for opcodes whose final
+ * argument is a list of strings (such as "args" and "connect"), for which
+ * each remaining argument is stored as a string.
+ *
+ * If the instruction has fewer arguments than its opcode requires, any
+ * argument cannot be parsed, or the opcode is not one of those defined by
+ * guac_opcode, a non-zero value is returned, and guac_error is set to
+ * GUAC_STATUS_BAD_ARGUMENT.
+ *
+ * @param instruction The instruction to decode.
+ * @param args An array of guac_instruction_arg which will receive the parsed
+ *             value of each argument, in order. This array must be able to
+ *             hold one value per argument defined for the opcode or, if the
+ *             final argument is a list of strings, one value per argument
+ *             of the instruction.
+ * @return Zero on success, non-zero if the arguments of the instruction are
+ *         invalid.
+ */
+int guac_instruction_decode(const guac_instruction* instruction,
+        guac_instruction_arg* args);
 
 /**
- * Frees all memory allocated to the given instruction.
+ * Frees all memory allocated to the given instruction. The instruction must
+ * have been returned by guac_protocol_read_instruction(),
+ * guac_protocol_expect_instruction() or guac_instruction_copy(). Views of
+ * instructions are never freed.
  *
  * @param instruction The instruction to free.
  */
 void guac_instruction_free(guac_instruction* instruction);
 
+/**
+ * Allocates a new instruction which is a copy of the given instruction. The
+ * copy shares no memory with the original, and thus remains valid after the
+ * original has been freed or, if the original is a view, after the
+ * guac_socket it was read from has been read again.
+ *
+ * If an error occurs allocating the copy, NULL is returned, and guac_error
+ * is set appropriately.
+ *
+ * @param instruction The instruction to copy.
+ * @return A new instruction which must be freed with guac_instruction_free(),
+ *         or NULL if an error occurs.
+ */
+guac_instruction* guac_instruction_copy(const guac_instruction* instruction);
+
 /**
  * Returns whether new instruction data is available on the given guac_socket
  * connection for parsing.
@@ -258,6 +486,61 @@ int guac_protocol_instructions_waiting(guac_socket* socket, int usec_timeout);
 guac_instruction* guac_protocol_read_instruction(guac_socket* socket,
         int usec_timeout);
 
+/**
+ * Reads a single instruction from the given guac_socket connection without
+ * copying, storing a view of the instruction in the given guac_instruction.
+ * The opcode and arguments of the view point directly into the input buffer
+ * of the guac_socket, and remain valid only until the next time the
+ * guac_socket is read. If the instruction is needed beyond that point, it
+ * must be copied with guac_instruction_copy(). Views must not be freed with
+ * guac_instruction_free().
+ *
+ * If an error occurs reading the instruction, a non-zero value is returned,
+ * and guac_error is set appropriately.
+ *
+ * @param socket The guac_socket connection to use.
+ * @param usec_timeout The maximum number of microseconds to wait before
+ *                     giving up.
+ * @param instruction The guac_instruction to store the view within.
+ * @return Zero if an instruction was successfully read, non-zero on error
+ *         or if the instruction could not be read completely because the
+ *         timeout elapsed, in which case guac_error will be set to
+ *         GUAC_STATUS_INPUT_TIMEOUT and subsequent reads will return the
+ *         parsed instruction once enough data is available.
+ */
+int guac_protocol_read_instruction_view(guac_socket* socket,
+        int usec_timeout, guac_instruction* instruction);
+
+/**
+ * Reads all complete instructions available on the given guac_socket
+ * connection, up to the given maximum, storing views of each instruction in
+ * the given array. Every complete instruction already buffered is returned
+ * without waiting. Only if no complete instruction is buffered does this
+ * function wait for data, and then it waits and reads at most once, returning
+ * all instructions completed by the data read.
+ *
+ * As with guac_protocol_read_instruction_view(), the views returned point
+ * directly into the input buffer of the guac_socket, and remain valid only
+ * until the next time the guac_socket is read.
+ *
+ * If an error occurs reading the instructions, a negative value is returned,
+ * and guac_error is set appropriately. If an error occurs after some
+ * instructions have been read, those instructions are returned, and the
+ * error is reported by the next read.
+ *
+ * @param socket The guac_socket connection to use.
+ * @param instructions An array of at least max guac_instructions to store
+ *                     the views within.
+ * @param max The maximum number of instructions to read.
+ * @param usec_timeout The maximum number of microseconds to wait before
+ *                     giving up.
+ * @return The number of instructions read, zero if no complete instruction
+ *         could be read before the timeout elapsed, in which case guac_error
+ *         will be set to GUAC_STATUS_INPUT_TIMEOUT, or negative on error.
+ */
+int guac_protocol_read_instructions(guac_socket* socket,
+        guac_instruction* instructions, int max, int usec_timeout);
+
 /**
  * Reads a single instruction with the given opcode from the given guac_socket
  * connection.
@@ -611,6 +894,49 @@ int guac_protocol_send_lstroke(guac_socket* socket,
 int guac_protocol_send_png(guac_socket* socket, guac_composite_mode mode,
         const guac_layer* layer, int x, int y, cairo_surface_t* surface);
 
+/**
+ * Sets the way in which PNG data is produced by all subsequent calls to
+ * guac_protocol_send_png() for the given guac_socket connection. By default,
+ * GUAC_PROTOCOL_PNG_BUFFERED is used.
+ *
+ * @param socket The guac_socket connection to set the PNG mode of.
+ * @param mode The PNG mode to use.
+ */
+void guac_protocol_set_png_mode(guac_socket* socket,
+        guac_protocol_png_mode mode);
+
+/**
+ * Sets the compression used by all subsequent calls to
+ * guac_protocol_send_png() for the given guac_socket connection to one of
+ * the predefined profiles. By default, GUAC_PROTOCOL_PNG_BALANCED is used.
+ * The compression of a guac_client is that of its socket.
+ *
+ * @param socket The guac_socket connection to set the compression of.
+ * @param profile The compression profile to use.
+ */
+void guac_protocol_set_png_profile(guac_socket* socket,
+        guac_protocol_png_profile profile);
+
+/**
+ * Sets the compression used by all subsequent calls to
+ * guac_protocol_send_png() for the given guac_socket connection explicitly.
+ * Each setting may be GUAC_PROTOCOL_PNG_DEFAULT, in which case the default
+ * of libpng is used. As images are compressed with Cairo unless all
+ * settings are GUAC_PROTOCOL_PNG_DEFAULT or the image has a palette, only
+ * RGB24 and ARGB32 surfaces honor these settings.
+ *
+ * @param socket The guac_socket connection to set the compression of.
+ * @param level The zlib compression level, from 0 (none) to 9 (smallest).
+ * @param strategy The zlib compression strategy, such as Z_RLE or
+ *                 Z_FILTERED.
+ * @param filters The PNG filters to choose between for each row, as a
+ *                bitwise OR of PNG_FILTER_NONE, PNG_FILTER_SUB, etc.
+ * @return Zero on success, non-zero if any setting is invalid, in which
+ *         case the compression is unchanged.
+ */
+int guac_protocol_set_png_compression(guac_socket* socket,
+        int level, int strategy, int filters);
+
 /**
  * Sends a pop instruction over the given guac_socket connection.
  *
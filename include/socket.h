@@ -48,16 +48,353 @@
  */
 
 
+/**
+ * The number of bytes of output which can be stored within each segment of
+ * a guac_socket's output chain.
+ */
+#define GUAC_SOCKET_SEGMENT_SIZE 8192
+
+/**
+ * The maximum number of segments which may be buffered within the output
+ * chain of a guac_socket. Once this many segments are full, the chain is
+ * flushed automatically.
+ */
+#define GUAC_SOCKET_MAX_SEGMENTS 16
+
+/**
+ * The maximum number of segments which may be buffered within the output
+ * chain of a non-blocking guac_socket whose file descriptor is not ready for
+ * writing. Once this many segments are buffered, further writes will block
+ * until the backlog can be written.
+ */
+#define GUAC_SOCKET_MAX_BACKLOG_SEGMENTS 512
+
+/**
+ * The number of distinct opcodes for which output statistics are kept. See
+ * guac_opcode within protocol.h.
+ */
+#define GUAC_SOCKET_STATS_OPCODES 64
+
+/**
+ * Statistics describing the I/O performed by a guac_socket since it was
+ * opened. All times are in microseconds.
+ */
+typedef struct guac_socket_stats {
+
+    /**
+     * The number of bytes written to the transport.
+     */
+    int64_t bytes_written;
+
+    /**
+     * The number of bytes read from the transport.
+     */
+    int64_t bytes_read;
+
+    /**
+     * The number of bytes of output buffered, including any output not yet
+     * written.
+     */
+    int64_t bytes_buffered;
+
+    /**
+     * The number of calls made to the transport to write output.
+     */
+    int64_t write_calls;
+
+    /**
+     * The number of calls made to the transport to read input.
+     */
+    int64_t read_calls;
+
+    /**
+     * The number of times buffered output was flushed.
+     */
+    int64_t flushes;
+
+    /**
+     * The time spent waiting for input to become available.
+     */
+    int64_t wait_usec;
+
+    /**
+     * The time spent writing output, including any time spent waiting for
+     * the file descriptor to become ready for writing.
+     */
+    int64_t write_usec;
+
+    /**
+     * The time spent waiting due to rate limiting.
+     */
+    int64_t throttled_usec;
+
+    /**
+     * The number of complete instructions read.
+     */
+    int64_t instructions_read;
+
+    /**
+     * The number of PNG images whose palette was built successfully.
+     */
+    int64_t palette_hits;
+
+    /**
+     * The number of PNG images whose palette was attempted but could not be
+     * built, as the image had too many colors. The work of each such
+     * attempt is wasted.
+     */
+    int64_t palette_misses;
+
+    /**
+     * The number of PNG images for which no palette was attempted, as a
+     * sample of the image alone had too many colors.
+     */
+    int64_t palette_skipped;
+
+    /**
+     * The number of instructions written, by opcode.
+     */
+    int64_t instructions_written[GUAC_SOCKET_STATS_OPCODES];
+
+    /**
+     * The number of bytes of output buffered for instructions, by opcode.
+     */
+    int64_t opcode_bytes[GUAC_SOCKET_STATS_OPCODES];
+
+} guac_socket_stats;
+
+/**
+ * The minimum amount of space, in bytes, which must be free within the input
+ * buffer of a guac_socket before more data is read. If less space is free,
+ * instructions already read are first discarded from the buffer, and the
+ * buffer is grown only if this still does not free enough space. See
+ * guac_parser_reserve().
+ */
+#define GUAC_SOCKET_INPUT_MIN_READ 4096
+
+/**
+ * The number of layers for which the outcome of the last palette attempt is
+ * remembered by each guac_socket.
+ */
+#define GUAC_SOCKET_PALETTE_HISTORY 64
+
+/**
+ * The outcome of the last palette attempt for the PNG images of a single
+ * layer.
+ */
+typedef struct __guac_socket_palette_history {
+
+    /**
+     * Non-zero if this entry records an outcome, zero if it is unused.
+     */
+    int __valid;
+
+    /**
+     * The index of the layer whose outcome is recorded.
+     */
+    int __layer;
+
+    /**
+     * Non-zero if the last PNG image of the layer had too many colors for a
+     * palette, zero otherwise.
+     */
+    int __truecolor;
+
+} __guac_socket_palette_history;
+
+typedef struct __guac_socket_segment __guac_socket_segment;
+
+/**
+ * A single segment of buffered output. Segments are linked together to form
+ * the output chain of a guac_socket, and are written together using a single
+ * call to writev() when flushed. Unused segments are pooled for reuse.
+ */
+struct __guac_socket_segment {
+
+    /**
+     * The next segment in the chain, or NULL if this is the last segment.
+     */
+    __guac_socket_segment* __next;
+
+    /**
+     * The number of bytes of output currently stored in this segment.
+     */
+    int __length;
+
+    /**
+     * The last segment of the instruction beginning with this segment, if
+     * this segment begins an instruction submitted to a thread-safe
+     * guac_socket and not yet written.
+     */
+    __guac_socket_segment* __last;
+
+    /**
+     * The output data stored in this segment.
+     */
+    char __data[GUAC_SOCKET_SEGMENT_SIZE];
+
+};
+
+/**
+ * A token bucket limiting the rate at which output is written. Each byte
+ * written consumes one token, and tokens are added continuously at a fixed
+ * rate, up to a maximum burst size.
+ */
+typedef struct __guac_socket_bucket {
+
+    /**
+     * The rate at which tokens are added, in bytes per second, or zero if
+     * output is not limited.
+     */
+    int64_t __rate;
+
+    /**
+     * The maximum number of tokens which may accumulate.
+     */
+    int64_t __burst;
+
+    /**
+     * The number of tokens currently available. This may be negative if
+     * more output was written than tokens were available.
+     */
+    int64_t __tokens;
+
+    /**
+     * The time at which tokens were last added, in microseconds.
+     */
+    int64_t __last_refill;
+
+} __guac_socket_bucket;
+
+typedef struct guac_socket guac_socket;
+
+struct iovec;
+
+/**
+ * Flag given to a guac_socket_wait_handler to wait until input is available.
+ */
+#define GUAC_SOCKET_WAIT_READABLE 1
+
+/**
+ * Flag given to a guac_socket_wait_handler to wait until output can be
+ * written without blocking.
+ */
+#define GUAC_SOCKET_WAIT_WRITABLE 2
+
+/**
+ * The policies determining when output buffered by a guac_socket is written
+ * to its transport.
+ */
+typedef enum guac_socket_flush_policy {
+
+    /**
+     * Output is written only when guac_socket_flush() is called, or when
+     * too much output is buffered. This is the default.
+     */
+    GUAC_SOCKET_FLUSH_MANUAL = 0,
+
+    /**
+     * Output is grouped into frames, each ending with a sync instruction or
+     * a call to guac_socket_end_frame(). While a frame is being written,
+     * the transport is corked (using TCP_CORK or TCP_NOPUSH, if supported),
+     * such that any output written before the frame ends is sent only in
+     * full packets. Each frame is flushed and uncorked when it ends, or once
+     * the latency deadline of the guac_socket elapses, whichever is first.
+     * The deadline is checked as each instruction is written, so output
+     * written just before a period of inactivity still requires a sync or
+     * explicit flush.
+     */
+    GUAC_SOCKET_FLUSH_FRAME
+
+} guac_socket_flush_policy;
+
+/**
+ * Handler which reads up to the given number of bytes from the transport of
+ * a guac_socket, as read() would. Returns the number of bytes read, zero at
+ * end of stream, or negative with errno set on error.
+ */
+typedef ssize_t guac_socket_read_handler(guac_socket* socket, void* buf,
+        size_t count);
+
+/**
+ * Handler which writes up to the given number of bytes to the transport of a
+ * guac_socket, as write() would. Returns the number of bytes written, or
+ * negative with errno set on error (EAGAIN if the write would block).
+ */
+typedef ssize_t guac_socket_write_handler(guac_socket* socket,
+        const void* buf, size_t count);
+
+/**
+ * Handler which writes the given buffers to the transport of a guac_socket,
+ * as writev() would, with the same return value as a
+ * guac_socket_write_handler.
+ */
+typedef ssize_t guac_socket_writev_handler(guac_socket* socket,
+        const struct iovec* iov, int iovcnt);
+
+/**
+ * Handler which waits until the transport of a guac_socket is ready for the
+ * given GUAC_SOCKET_WAIT_READABLE or GUAC_SOCKET_WAIT_WRITABLE event, as
+ * select() would. A negative timeout waits forever. Returns positive if
+ * ready, zero if the timeout elapsed, or negative with errno set on error.
+ */
+typedef int guac_socket_wait_handler(guac_socket* socket, int event,
+        int usec_timeout);
+
+/**
+ * Handler which frees any data associated with the transport of a
+ * guac_socket, called when the guac_socket is closed.
+ */
+typedef int guac_socket_close_handler(guac_socket* socket);
+
 /**
  * The core I/O object of Guacamole. guac_socket provides buffered input and
  * output as well as convenience methods for efficiently writing base64 data.
+ * All I/O is performed through the handlers of the guac_socket, which
+ * implement its transport (a file descriptor, memory, or anything else).
  */
-typedef struct guac_socket {
+struct guac_socket {
 
     /**
-     * The file descriptor to be read from / written to.
+     * The file descriptor to be read from / written to, or -1 if this
+     * guac_socket does not use a file descriptor.
      */
     int fd; 
+
+    /**
+     * Arbitrary data associated with the transport of this guac_socket.
+     */
+    void* data;
+
+    /**
+     * Handler which reads input from the transport. This handler is
+     * required.
+     */
+    guac_socket_read_handler* read_handler;
+
+    /**
+     * Handler which writes output to the transport. This handler is
+     * required.
+     */
+    guac_socket_write_handler* write_handler;
+
+    /**
+     * Handler which writes several buffers of output to the transport at
+     * once. If NULL, output is written using write_handler alone.
+     */
+    guac_socket_writev_handler* writev_handler;
+
+    /**
+     * Handler which waits for the transport to become ready for reading or
+     * writing. This handler is required.
+     */
+    guac_socket_wait_handler* wait_handler;
+
+    /**
+     * Handler which frees the transport when this guac_socket is closed, or
+     * NULL if there is nothing to free.
+     */
+    guac_socket_close_handler* close_handler;
     
     /**
      * The number of bytes present in the base64 "ready" buffer.
@@ -71,50 +408,204 @@ typedef struct guac_socket {
     int __ready_buf[3];
 
     /**
-     * The number of bytes currently in the main write buffer.
+     * The first segment of the output chain. Bytes written are stored in the
+     * segments of the output chain before being flushed to the open file
+     * descriptor. If no output is buffered, this will be NULL.
+     */
+    __guac_socket_segment* __out_head;
+
+    /**
+     * The last segment of the output chain, which is the segment currently
+     * being written to. If no output is buffered, this will be NULL.
+     */
+    __guac_socket_segment* __out_tail;
+
+    /**
+     * The number of segments currently in the output chain.
+     */
+    int __out_segments;
+
+    /**
+     * The number of bytes at the beginning of the first segment of the
+     * output chain which have already been written.
+     */
+    int __out_offset;
+
+    /**
+     * Whether the file descriptor of this guac_socket is non-blocking, as
+     * set by guac_socket_set_nonblocking().
      */
-    int __written;
+    int __nonblocking;
 
     /**
-     * The main write buffer. Bytes written go here before being flushed
-     * to the open file descriptor.
+     * The token bucket limiting the rate of output of this guac_socket.
      */
-    char __out_buf[8192];
+    __guac_socket_bucket __bucket;
 
     /**
-     * The current location of parsing within the instruction buffer.
+     * The I/O statistics of this guac_socket.
      */
-    int __instructionbuf_parse_start;
+    guac_socket_stats __stats;
 
     /**
-     * The current size of the instruction buffer.
+     * The opcode of the instruction currently being written, as given to
+     * guac_socket_instruction_begin().
      */
-    int __instructionbuf_size;
+    int __opcode;
 
     /**
-     * The number of bytes currently in the instruction buffer.
+     * The total number of bytes buffered when the instruction currently
+     * being written was begun.
      */
-    int __instructionbuf_used_length;
+    int64_t __opcode_start;
 
     /**
-     * The instruction buffer. This is essentially the input buffer,
-     * provided as a convenience to be used to buffer instructions until
-     * those instructions are complete and ready to be parsed.
+     * Pool of unused segments, linked through their __next pointers, which
+     * will be reused before any new segments are allocated.
      */
-    char* __instructionbuf;
+    __guac_socket_segment* __out_free;
 
     /**
-     * The number of elements parsed so far.
+     * The parser which buffers and parses all input read from the file
+     * descriptor.
      */
-    int __instructionbuf_elementc;
+    struct guac_parser* __parser;
 
     /**
-     * Array of pointers into the instruction buffer, where each pointer
-     * points to the start of the corresponding element.
+     * Pool of argument pointers for instructions read together with
+     * guac_protocol_read_instructions(), as the arguments of each such
+     * instruction cannot share the elements of the parser.
      */
-    char* __instructionbuf_elementv[64];
+    char** __instructionbuf_argv;
 
-} guac_socket;
+    /**
+     * The number of argument pointers which can be stored within
+     * __instructionbuf_argv.
+     */
+    int __instructionbuf_argv_size;
+
+    /**
+     * The way in which PNG data is produced for png instructions, as set
+     * by guac_protocol_set_png_mode().
+     */
+    int __png_mode;
+
+    /**
+     * The zlib compression level of png instructions, as set by
+     * guac_protocol_set_png_compression(), or GUAC_PROTOCOL_PNG_DEFAULT.
+     */
+    int __png_level;
+
+    /**
+     * The zlib compression strategy of png instructions, as set by
+     * guac_protocol_set_png_compression(), or GUAC_PROTOCOL_PNG_DEFAULT.
+     */
+    int __png_strategy;
+
+    /**
+     * The PNG filters used by png instructions, as set by
+     * guac_protocol_set_png_compression(), or GUAC_PROTOCOL_PNG_DEFAULT.
+     */
+    int __png_filters;
+
+    /**
+     * The workspace reused for each png instruction written to this
+     * guac_socket, or NULL if not yet allocated.
+     */
+    struct __guac_encoder* __encoder;
+
+    /**
+     * The outcome of the last palette attempt of recently-drawn layers,
+     * indexed by layer. Layers whose last image had too many colors are
+     * sampled before another palette is attempted.
+     */
+    __guac_socket_palette_history
+        __palette_history[GUAC_SOCKET_PALETTE_HISTORY];
+
+    /**
+     * The policy determining when output is written, as set by
+     * guac_socket_set_flush_policy().
+     */
+    guac_socket_flush_policy __flush_policy;
+
+    /**
+     * The maximum amount of time output may remain buffered before being
+     * flushed, in microseconds, if the flush policy is
+     * GUAC_SOCKET_FLUSH_FRAME.
+     */
+    int64_t __flush_deadline;
+
+    /**
+     * The time at which the first instruction of the current frame was
+     * begun, in microseconds, or zero if no frame is in progress. While
+     * thread-safe, this is accessed atomically.
+     */
+    int64_t __frame_start;
+
+    /**
+     * Whether the transport is currently corked: non-zero if corked, zero
+     * if not, or negative if the transport cannot be corked.
+     */
+    int __corked;
+
+    /**
+     * Whether this guac_socket may be written to by several threads at
+     * once, as set by guac_socket_set_threadsafe().
+     */
+    int __threadsafe;
+
+    /**
+     * Stack of complete instructions submitted by any thread but not yet
+     * moved into the output chain, newest first. Each instruction is a list
+     * of segments, the first of which points to the last through its
+     * __last pointer. Instructions are pushed without locking.
+     */
+    __guac_socket_segment* __queue;
+
+    /**
+     * The number of segments within __queue.
+     */
+    int __queued;
+
+    /**
+     * Non-zero while a thread is writing the output chain. Only the thread
+     * which set this flag may touch the output chain.
+     */
+    int __writing;
+
+    /**
+     * The number of threads blocked until the writing thread has reduced
+     * __queued below GUAC_SOCKET_MAX_BACKLOG_SEGMENTS or stopped writing.
+     */
+    int __backlog_waiters;
+
+    /**
+     * Non-zero if a thread has requested that the current frame end. The
+     * writing thread clears this flag as it ends the frame.
+     */
+    int __end_frame;
+
+    /**
+     * Pool of unused segments returned by the writing thread, which threads
+     * submitting instructions take in their entirety.
+     */
+    __guac_socket_segment* __shared_free;
+
+};
+
+/**
+ * Allocates and initializes a new guac_socket object having no transport.
+ * The caller must set the data and handlers of the guac_socket before it
+ * is used. If a close_handler is set, it will be called when the
+ * guac_socket is closed.
+ *
+ * If an error occurs while allocating the guac_socket object, NULL is returned,
+ * and guac_error is set appropriately.
+ *
+ * @return A newly allocated guac_socket object, or NULL if an error occurs
+ *         while allocating the guac_socket object.
+ */
+guac_socket* guac_socket_alloc();
 
 /**
  * Allocates and initializes a new guac_socket object with the given open
@@ -130,6 +621,48 @@ typedef struct guac_socket {
  */
 guac_socket* guac_socket_open(int fd);
 
+/**
+ * Allocates and initializes a new guac_socket object with the given open
+ * file descriptor, performing all I/O through io_uring. While waiting for
+ * input, input is received at the same time, such that waiting for and
+ * reading input requires only a single system call, and each flush of
+ * output is submitted as a single writev.
+ *
+ * Input and output are each submitted through their own io_uring, such that
+ * one thread may read from or wait for input on the guac_socket while
+ * another writes to it. Reading and waiting for input must still be done
+ * by only one thread at a time, as must writing.
+ *
+ * If libguac was built without io_uring support (see HAVE_LIBURING), or if
+ * io_uring is unavailable at runtime, this is identical to
+ * guac_socket_open().
+ *
+ * If an error occurs while allocating the guac_socket object, NULL is returned,
+ * and guac_error is set appropriately.
+ *
+ * @param fd An open file descriptor that this guac_socket object should manage.
+ * @return A newly allocated guac_socket object associated with the given
+ *         file descriptor, or NULL if an error occurs while allocating
+ *         the guac_socket object.
+ */
+guac_socket* guac_socket_open_uring(int fd);
+
+/**
+ * Allocates and initializes a pair of connected guac_socket objects which
+ * exchange data through memory alone, without a file descriptor. Anything
+ * written to and flushed from either guac_socket can be read from the
+ * other, and writes never block. Once either guac_socket is closed, the
+ * other reaches end of stream after reading any remaining data.
+ *
+ * If an error occurs while allocating the guac_socket objects, a non-zero
+ * value is returned, and guac_error is set appropriately.
+ *
+ * @param first Storage for the first guac_socket of the pair.
+ * @param second Storage for the second guac_socket of the pair.
+ * @return Zero on success, or non-zero if an error occurs.
+ */
+int guac_socket_open_memory_pair(guac_socket** first, guac_socket** second);
+
 /**
  * Writes the given unsigned int to the given guac_socket object. The data
  * written may be buffered until the buffer is flushed automatically or
@@ -144,6 +677,22 @@ guac_socket* guac_socket_open(int fd);
  */
 ssize_t guac_socket_write_int(guac_socket* socket, int64_t i);
 
+/**
+ * Writes the given bytes to the given guac_socket object. The data
+ * written may be buffered until the buffer is flushed automatically or
+ * manually. As with guac_socket_write_string(), any characters used
+ * internally by the Guacamole protocol will need to be escaped.
+ *
+ * If an error occurs while writing, a non-zero value is returned, and
+ * guac_error is set appropriately.
+ *
+ * @param socket The guac_socket object to write to.
+ * @param buf A buffer containing the data to write.
+ * @param count The number of bytes to write.
+ * @return Zero on success, or non-zero if an error occurs while writing.
+ */
+ssize_t guac_socket_write(guac_socket* socket, const void* buf, size_t count);
+
 /**
  * Writes the given string to the given guac_socket object. The data
  * written may be buffered until the buffer is flushed automatically or
@@ -190,7 +739,14 @@ ssize_t guac_socket_write_base64(guac_socket* socket, const void* buf, size_t co
 ssize_t guac_socket_flush_base64(guac_socket* socket);
 
 /**
- * Flushes the write buffer.
+ * Flushes the write buffer. All buffered output is written using as few
+ * system calls as possible. As output is otherwise only written once the
+ * output chain is full, this marks the explicit end of a frame.
+ *
+ * If the guac_socket is non-blocking, only as much output as can be written
+ * without blocking is written, and the remainder is kept as a backlog. Such
+ * a backlog is written by subsequent flushes, which should be performed once
+ * the file descriptor is ready for writing.
  *
  * If an error occurs while writing, a non-zero value is returned, and
  * guac_error is set appropriately.
@@ -201,6 +757,194 @@ ssize_t guac_socket_flush_base64(guac_socket* socket);
 ssize_t guac_socket_flush(guac_socket* socket);
 
 
+/**
+ * Sets whether the given guac_socket object should avoid blocking on writes,
+ * setting or clearing O_NONBLOCK on its file descriptor, if any. While non-blocking,
+ * output which cannot be written immediately is kept as a backlog and
+ * written by later flushes (see guac_socket_flush()).
+ *
+ * If an error occurs while changing the mode of the file descriptor, a
+ * non-zero value is returned, and guac_error is set appropriately.
+ *
+ * @param socket The guac_socket object to modify.
+ * @param nonblocking Non-zero if the guac_socket should not block on writes,
+ *                    zero otherwise.
+ * @return Zero on success, or non-zero if an error occurs.
+ */
+int guac_socket_set_nonblocking(guac_socket* socket, int nonblocking);
+
+/**
+ * Sets whether the given guac_socket object may be written to by several
+ * threads at once. While thread-safe, each thread builds each instruction in
+ * a buffer of its own, submitting the complete instruction to the
+ * guac_socket without locking when the instruction ends. Instructions are
+ * therefore never interleaved, and are written in the order they were
+ * submitted by a single writing thread: whichever thread flushes while no
+ * other thread is writing. A flush while another thread is writing returns
+ * immediately, leaving the instructions submitted to that thread, unless
+ * GUAC_SOCKET_MAX_BACKLOG_SEGMENTS segments are already waiting to be
+ * written, in which case the flush blocks until the writing thread has
+ * caught up.
+ *
+ * While thread-safe, all output must be written within
+ * guac_socket_instruction_begin() and guac_socket_instruction_end(), as is
+ * done by all guac_protocol_send_*() functions, and a thread may write only
+ * one instruction at a time. The latency deadline of the
+ * GUAC_SOCKET_FLUSH_FRAME policy is checked as each instruction is
+ * submitted, and a frame ended by any thread is ended by the writing
+ * thread, even if that thread is still writing an earlier part of the
+ * frame.
+ *
+ * This mode must be changed only while no other thread is using the
+ * guac_socket. If an error occurs while changing the mode (including if
+ * libguac was built without thread support), a non-zero value is returned,
+ * and guac_error is set appropriately.
+ *
+ * @param socket The guac_socket object to modify.
+ * @param threadsafe Non-zero if the guac_socket should be safe to write to
+ *                   from several threads at once, zero otherwise.
+ * @return Zero on success, or non-zero if an error occurs.
+ */
+int guac_socket_set_threadsafe(guac_socket* socket, int threadsafe);
+
+/**
+ * Sets the policy determining when output buffered by the given guac_socket
+ * object is written. By default, GUAC_SOCKET_FLUSH_MANUAL is used.
+ *
+ * @param socket The guac_socket object to modify.
+ * @param policy The flush policy to use.
+ * @param usec_deadline The maximum number of microseconds a frame may remain
+ *                      buffered before being flushed, if the policy is
+ *                      GUAC_SOCKET_FLUSH_FRAME.
+ */
+void guac_socket_set_flush_policy(guac_socket* socket,
+        guac_socket_flush_policy policy, int usec_deadline);
+
+/**
+ * Ends the frame currently being written to the given guac_socket object,
+ * flushing and uncorking all output if the flush policy is
+ * GUAC_SOCKET_FLUSH_FRAME. This is done automatically by
+ * guac_protocol_send_sync(). If the flush policy is GUAC_SOCKET_FLUSH_MANUAL,
+ * this function has no effect.
+ *
+ * If an error occurs while flushing, a non-zero value is returned, and
+ * guac_error is set appropriately.
+ *
+ * @param socket The guac_socket object whose frame should end.
+ * @return Zero on success, or non-zero if an error occurs during flush.
+ */
+int guac_socket_end_frame(guac_socket* socket);
+
+/**
+ * Returns the number of bytes buffered within the given guac_socket object
+ * which have not yet been written. For a non-blocking guac_socket, a
+ * non-zero value after a flush indicates a backlog which should be written
+ * once the file descriptor is ready for writing.
+ *
+ * @param socket The guac_socket object to check.
+ * @return The number of buffered bytes not yet written.
+ */
+size_t guac_socket_pending(guac_socket* socket);
+
+/**
+ * Limits the rate at which output is written to the given guac_socket object.
+ * Output exceeding the limit is delayed rather than dropped: flushes wait
+ * until enough of the limit is available, or, if the guac_socket is
+ * non-blocking, leave the remaining output as a backlog.
+ *
+ * @param socket The guac_socket object to limit.
+ * @param bytes_per_second The maximum sustained rate of output, in bytes per
+ *                         second, or zero to remove any limit.
+ * @param burst The maximum number of bytes which may be written at once
+ *              after a period of inactivity, or zero to allow one second of
+ *              output.
+ */
+void guac_socket_set_rate_limit(guac_socket* socket, int64_t bytes_per_second,
+        int64_t burst);
+
+/**
+ * Limits the combined rate at which output is written to all guac_socket
+ * objects within the current process. This limit applies in addition to the
+ * limit of each guac_socket (see guac_socket_set_rate_limit()).
+ *
+ * @param bytes_per_second The maximum sustained rate of output, in bytes per
+ *                         second, or zero to remove any limit.
+ * @param burst The maximum number of bytes which may be written at once
+ *              after a period of inactivity, or zero to allow one second of
+ *              output.
+ */
+void guac_socket_set_global_rate_limit(int64_t bytes_per_second,
+        int64_t burst);
+
+/**
+ * Limits the memory used to buffer input read from the given guac_socket
+ * object, as with guac_parser_set_limits(). Reading an instruction larger
+ * than allowed fails with guac_error set to GUAC_STATUS_INPUT_TOO_LARGE.
+ *
+ * @param socket The guac_socket object to limit.
+ * @param max_instruction_size The maximum size of any instruction read, in
+ *                             bytes, or zero for the default.
+ * @param max_buffer_size The maximum size of the input buffer, in bytes, or
+ *                        zero for the default. This should exceed the
+ *                        maximum instruction size by at least
+ *                        GUAC_SOCKET_INPUT_MIN_READ.
+ */
+void guac_socket_set_input_limits(guac_socket* socket,
+        int max_instruction_size, int max_buffer_size);
+
+/**
+ * Returns the total amount of time that writes to the given guac_socket
+ * object have been delayed due to rate limiting.
+ *
+ * @param socket The guac_socket object to check.
+ * @return The number of microseconds spent waiting due to rate limiting.
+ */
+int64_t guac_socket_get_throttled_usec(guac_socket* socket);
+
+/**
+ * Stores a snapshot of the I/O statistics of the given guac_socket object
+ * within the given guac_socket_stats structure. This function may safely be
+ * called from any thread, even while the guac_socket is in use. Each value
+ * is read atomically, though the snapshot as a whole is not: values may
+ * reflect slightly different points in time.
+ *
+ * @param socket The guac_socket object to retrieve the statistics of.
+ * @param stats The guac_socket_stats structure to store the statistics in.
+ */
+void guac_socket_get_stats(guac_socket* socket, guac_socket_stats* stats);
+
+/**
+ * Marks the beginning of an instruction with the given opcode. All output
+ * written until the matching call to guac_socket_instruction_end() is
+ * attributed to that opcode within the statistics of the guac_socket.
+ *
+ * @param socket The guac_socket object which will be written to.
+ * @param opcode The opcode of the instruction being written, as defined by
+ *               guac_opcode within protocol.h.
+ */
+void guac_socket_instruction_begin(guac_socket* socket, int opcode);
+
+/**
+ * Marks the end of the instruction begun with the last call to
+ * guac_socket_instruction_begin().
+ *
+ * @param socket The guac_socket object which was written to.
+ * @return Zero on success, or non-zero if an error occurs.
+ */
+int guac_socket_instruction_end(guac_socket* socket);
+
+/**
+ * Abandons the instruction begun with the last call to
+ * guac_socket_instruction_begin(), in place of guac_socket_instruction_end(),
+ * after an error prevented the instruction from being written completely.
+ * For a thread-safe guac_socket, nothing of the instruction is written.
+ * Otherwise, the part already written remains buffered, and the
+ * guac_socket should no longer be used.
+ *
+ * @param socket The guac_socket object which was written to.
+ */
+void guac_socket_instruction_abort(guac_socket* socket);
+
 /**
  * Waits for input to be available on the given guac_socket object until the
  * specified timeout elapses.
@@ -220,9 +964,94 @@ ssize_t guac_socket_flush(guac_socket* socket);
 int guac_socket_select(guac_socket* socket, int usec_timeout);
 
 /**
- * Frees resources allocated to the given guac_socket object. Note that this
- * implicitly flush all buffers, but will NOT close the associated file
- * descriptor.
+ * A set of guac_socket objects which may be waited on together, such that a
+ * single thread can wait for input on many guac_sockets at once. Where
+ * available, the set is backed by a single epoll instance, and waiting
+ * takes time proportional to the number of ready guac_sockets rather than
+ * the number of guac_sockets in the set.
+ */
+typedef struct guac_socket_set guac_socket_set;
+
+/**
+ * Allocates a new, empty guac_socket_set.
+ *
+ * If an error occurs while allocating the guac_socket_set, NULL is
+ * returned, and guac_error is set appropriately.
+ *
+ * @return A newly allocated guac_socket_set, or NULL if an error occurs.
+ */
+guac_socket_set* guac_socket_set_alloc();
+
+/**
+ * Frees the given guac_socket_set. The guac_socket objects within the set
+ * are not closed.
+ *
+ * @param set The guac_socket_set to free.
+ */
+void guac_socket_set_free(guac_socket_set* set);
+
+/**
+ * Adds the given guac_socket to the given guac_socket_set. Only guac_socket
+ * objects managing a file descriptor which is read directly (those returned
+ * by guac_socket_open()) may be added. Any other guac_socket, including
+ * those returned by guac_socket_open_uring(), is rejected with
+ * GUAC_STATUS_BAD_ARGUMENT.
+ *
+ * If an error occurs while adding the guac_socket, non-zero is returned,
+ * and guac_error is set appropriately.
+ *
+ * @param set The guac_socket_set to add the given guac_socket to.
+ * @param socket The guac_socket to add.
+ * @return Zero on success, or non-zero if an error occurs.
+ */
+int guac_socket_set_add(guac_socket_set* set, guac_socket* socket);
+
+/**
+ * Removes the given guac_socket from the given guac_socket_set. This must
+ * be done before the guac_socket is closed.
+ *
+ * If an error occurs while removing the guac_socket, non-zero is returned,
+ * and guac_error is set appropriately.
+ *
+ * @param set The guac_socket_set to remove the given guac_socket from.
+ * @param socket The guac_socket to remove.
+ * @return Zero on success, or non-zero if an error occurs.
+ */
+int guac_socket_set_remove(guac_socket_set* set, guac_socket* socket);
+
+/**
+ * Waits for input to be available on any guac_socket within the given
+ * guac_socket_set until the specified timeout elapses, storing up to the
+ * given number of ready guac_sockets in the given array.
+ *
+ * Only input which has not yet been read from the file descriptor is
+ * considered. Once a guac_socket is reported ready, instructions should be
+ * read from it while guac_protocol_instructions_waiting() with a zero
+ * timeout returns positive, as input already buffered by the guac_socket
+ * will not cause it to be reported ready again.
+ *
+ * If an error occurs while waiting, a negative value is returned, and
+ * guac_error is set appropriately.
+ *
+ * If a timeout occurs while waiting, zero value is returned, and
+ * guac_error is set to GUAC_STATUS_INPUT_TIMEOUT.
+ *
+ * @param set The guac_socket_set to wait for.
+ * @param ready An array of at least max entries which will receive the
+ *              guac_sockets having input available.
+ * @param max The maximum number of guac_sockets to store in ready.
+ * @param usec_timeout The maximum number of microseconds to wait for data, or
+ *                     -1 to potentially wait forever.
+ * @return The number of guac_sockets stored in ready, zero if the timeout
+ *         elapsed and no data is available, negative on error.
+ */
+int guac_socket_set_wait(guac_socket_set* set, guac_socket** ready, int max,
+        int usec_timeout);
+
+/**
+ * Frees resources allocated to the given guac_socket object, including its
+ * transport. Note that this implicitly flush all buffers, but will NOT close
+ * the associated file descriptor.
  *
  * @param socket The guac_socket object to close.
  */
@@ -0,0 +1,84 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#ifndef __GUAC_STATS_H
+#define __GUAC_STATS_H
+
+/**
+ * Internal macros for maintaining the statistics of a guac_socket. Each
+ * statistic is updated only by the thread using the guac_socket, but may be
+ * read at any time by any other thread. Updates are therefore plain relaxed
+ * stores, which cost no more than an ordinary increment, while reads are
+ * relaxed loads which can never observe a partially-written value. This
+ * header is used only internally within libguac, and is not installed along
+ * with the library.
+ *
+ * @file stats.h
+ */
+
+#ifdef __GNUC__
+
+/**
+ * Adds the given value to the given statistic.
+ */
+#define __GUAC_STAT_ADD(stat, value)                                        \
+    __atomic_store_n(&(stat),                                               \
+            __atomic_load_n(&(stat), __ATOMIC_RELAXED) + (value),           \
+            __ATOMIC_RELAXED)
+
+/**
+ * Adds the given value to the given statistic, which may be updated by
+ * several threads at once (see guac_socket_set_threadsafe()).
+ */
+#define __GUAC_STAT_ADD_SHARED(stat, value)                                 \
+    __atomic_fetch_add(&(stat), (value), __ATOMIC_RELAXED)
+
+/**
+ * Returns the current value of the given statistic.
+ */
+#define __GUAC_STAT_LOAD(stat) __atomic_load_n(&(stat), __ATOMIC_RELAXED)
+
+#else
+
+#define __GUAC_STAT_ADD(stat, value) ((stat) += (value))
+#define __GUAC_STAT_ADD_SHARED(stat, value) ((stat) += (value))
+#define __GUAC_STAT_LOAD(stat) (stat)
+
+#endif
+
+#endif
+
@@ -0,0 +1,248 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && defined(HAVE_IMMINTRIN_H) \
+    && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define __GUAC_BASE64_X86
+#endif
+
+#include "base64.h"
+
+/**
+ * Signature shared by all base64 triplet encoders.
+ */
+typedef void __guac_base64_encoder(const unsigned char* in, size_t triplets,
+        char* out);
+
+/* Portable encoder */
+
+static void __guac_base64_encode_scalar(const unsigned char* in,
+        size_t triplets, char* out) {
+
+    const char* characters = __guac_socket_BASE64_CHARACTERS;
+
+    while (triplets-- > 0) {
+
+        /* Read entire triplet at once */
+        uint32_t value = ((uint32_t) in[0] << 16)
+                       | ((uint32_t) in[1] <<  8)
+                       |  (uint32_t) in[2];
+
+        /* Write four characters, six bits each */
+        out[0] = characters[ value >> 18        ]; /* [AAAAAA]AABBBB BBBBCC CCCCCC */
+        out[1] = characters[(value >> 12) & 0x3F]; /* AAAAAA[AABBBB]BBBBCC CCCCCC */
+        out[2] = characters[(value >>  6) & 0x3F]; /* AAAAAA AABBBB[BBBBCC]CCCCCC */
+        out[3] = characters[ value        & 0x3F]; /* AAAAAA AABBBB BBBBCC[CCCCCC] */
+
+        in  += 3;
+        out += 4;
+
+    }
+
+}
+
+#ifdef __GUAC_BASE64_X86
+
+/*
+ * The vectorized encoders below split each triplet into four 6-bit indices
+ * using a byte shuffle and two 16-bit multiplies, then translate each index
+ * into its character by adding an offset chosen from a 16-entry table. Each
+ * index is first reduced to a table position: 13 for 'A'-'Z', 0 for 'a'-'z',
+ * 1 through 10 for '0'-'9', 11 for '+' and 12 for '/'.
+ */
+
+__attribute__((target("ssse3")))
+static void __guac_base64_encode_ssse3(const unsigned char* in,
+        size_t triplets, char* out) {
+
+    const unsigned char* end = in + triplets * 3;
+
+    const __m128i shuffle = _mm_setr_epi8(
+            1, 0, 2, 1,  4, 3, 5, 4,  7, 6, 8, 7,  10, 9, 11, 10);
+
+    const __m128i offsets = _mm_setr_epi8(
+            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+            '/' - 63, 'A', 0, 0);
+
+    /* Encode 12 bytes at a time, reading 16 */
+    while (end - in >= 16) {
+
+        __m128i data = _mm_loadu_si128((const __m128i*) in);
+        __m128i indices, position;
+
+        /* Split into 6-bit indices, one per byte */
+        data = _mm_shuffle_epi8(data, shuffle);
+        indices = _mm_or_si128(
+            _mm_mulhi_epu16(
+                _mm_and_si128(data, _mm_set1_epi32(0x0FC0FC00)),
+                _mm_set1_epi32(0x04000040)),
+            _mm_mullo_epi16(
+                _mm_and_si128(data, _mm_set1_epi32(0x003F03F0)),
+                _mm_set1_epi32(0x01000010)));
+
+        /* Translate indices to characters */
+        position = _mm_or_si128(
+            _mm_subs_epu8(indices, _mm_set1_epi8(51)),
+            _mm_and_si128(
+                _mm_cmpgt_epi8(_mm_set1_epi8(26), indices),
+                _mm_set1_epi8(13)));
+
+        _mm_storeu_si128((__m128i*) out,
+            _mm_add_epi8(_mm_shuffle_epi8(offsets, position), indices));
+
+        in  += 12;
+        out += 16;
+
+    }
+
+    /* Encode remaining triplets */
+    __guac_base64_encode_scalar(in, (end - in) / 3, out);
+
+}
+
+__attribute__((target("avx2")))
+static void __guac_base64_encode_avx2(const unsigned char* in,
+        size_t triplets, char* out) {
+
+    const unsigned char* end = in + triplets * 3;
+
+    const __m256i shuffle = _mm256_setr_epi8(
+            1, 0, 2, 1,  4, 3, 5, 4,  7, 6, 8, 7,  10, 9, 11, 10,
+            1, 0, 2, 1,  4, 3, 5, 4,  7, 6, 8, 7,  10, 9, 11, 10);
+
+    const __m256i offsets = _mm256_setr_epi8(
+            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+            '/' - 63, 'A', 0, 0,
+            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+            '/' - 63, 'A', 0, 0);
+
+    /* Encode 24 bytes at a time, reading 28 (12 per 128-bit lane) */
+    while (end - in >= 28) {
+
+        __m256i data = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*) in)),
+            _mm_loadu_si128((const __m128i*) (in + 12)), 1);
+        __m256i indices, position;
+
+        /* Split into 6-bit indices, one per byte */
+        data = _mm256_shuffle_epi8(data, shuffle);
+        indices = _mm256_or_si256(
+            _mm256_mulhi_epu16(
+                _mm256_and_si256(data, _mm256_set1_epi32(0x0FC0FC00)),
+                _mm256_set1_epi32(0x04000040)),
+            _mm256_mullo_epi16(
+                _mm256_and_si256(data, _mm256_set1_epi32(0x003F03F0)),
+                _mm256_set1_epi32(0x01000010)));
+
+        /* Translate indices to characters */
+        position = _mm256_or_si256(
+            _mm256_subs_epu8(indices, _mm256_set1_epi8(51)),
+            _mm256_and_si256(
+                _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices),
+                _mm256_set1_epi8(13)));
+
+        _mm256_storeu_si256((__m256i*) out,
+            _mm256_add_epi8(_mm256_shuffle_epi8(offsets, position), indices));
+
+        in  += 24;
+        out += 32;
+
+    }
+
+    /* Encode remaining triplets */
+    __guac_base64_encode_ssse3(in, (end - in) / 3, out);
+
+}
+
+#endif
+
+/* Runtime dispatch */
+
+static void __guac_base64_encode_resolve(const unsigned char* in,
+        size_t triplets, char* out);
+
+/**
+ * The encoder currently in use. Initially, this is a resolver which selects
+ * the best encoder for the current CPU, replaces itself, and then forwards
+ * the call. Concurrent resolution is harmless, as every thread will select
+ * and store the same encoder, but the pointer is still accessed atomically
+ * where possible, as sockets may be written by several threads at once.
+ */
+static __guac_base64_encoder* __guac_base64_encode_impl =
+    __guac_base64_encode_resolve;
+
+static void __guac_base64_encode_resolve(const unsigned char* in,
+        size_t triplets, char* out) {
+
+    __guac_base64_encoder* encoder = __guac_base64_encode_scalar;
+
+#ifdef __GUAC_BASE64_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        encoder = __guac_base64_encode_avx2;
+    else if (__builtin_cpu_supports("ssse3"))
+        encoder = __guac_base64_encode_ssse3;
+#endif
+
+#ifdef __GNUC__
+    __atomic_store_n(&__guac_base64_encode_impl, encoder, __ATOMIC_RELAXED);
+#else
+    __guac_base64_encode_impl = encoder;
+#endif
+
+    encoder(in, triplets, out);
+
+}
+
+void __guac_base64_encode_triplets(const unsigned char* in, size_t triplets,
+        char* out) {
+#ifdef __GNUC__
+    __atomic_load_n(&__guac_base64_encode_impl, __ATOMIC_RELAXED)(in,
+            triplets, out);
+#else
+    __guac_base64_encode_impl(in, triplets, out);
+#endif
+}
+
@@ -44,41 +44,28 @@
 
 /* Guacamole instruction handler map */
 
-__guac_instruction_handler_mapping __guac_instruction_handler_map[] = {
-   {"sync",       __guac_handle_sync},
-   {"mouse",      __guac_handle_mouse},
-   {"key",        __guac_handle_key},
-   {"clipboard",  __guac_handle_clipboard},
-   {"disconnect", __guac_handle_disconnect},
-   {"seamrdp",    __guac_handle_seamrdp},
-   {"ovdapp",     __guac_handle_ovdapp},
-   {"ukbrdr",     __guac_handle_ukbrdr},
-   {NULL,         NULL}
+__guac_instruction_handler* __guac_instruction_handler_map[GUAC_OPCODE_COUNT] = {
+   [GUAC_OPCODE_SYNC]       = __guac_handle_sync,
+   [GUAC_OPCODE_MOUSE]      = __guac_handle_mouse,
+   [GUAC_OPCODE_KEY]        = __guac_handle_key,
+   [GUAC_OPCODE_CLIPBOARD]  = __guac_handle_clipboard,
+   [GUAC_OPCODE_DISCONNECT] = __guac_handle_disconnect,
+   [GUAC_OPCODE_SEAMRDP]    = __guac_handle_seamrdp,
+   [GUAC_OPCODE_OVDAPP]     = __guac_handle_ovdapp,
+   [GUAC_OPCODE_UKBRDR]     = __guac_handle_ukbrdr
 };
 
-int64_t __guac_parse_int(const char* str) {
-
-    int sign = 1;
-    int64_t num = 0;
-
-    for (; *str != '\0'; str++) {
-
-        if (*str == '-')
-            sign = -sign;
-        else
-            num = num * 10 + (*str - '0');
-
-    }
-
-    return num * sign;
+/* Guacamole instruction handlers */
 
-}
+int __guac_handle_sync(guac_client* client, guac_instruction* instruction) {
 
+    guac_instruction_arg args[1];
+    guac_timestamp timestamp;
 
-/* Guacamole instruction handlers */
+    if (guac_instruction_decode(instruction, args))
+        return -1;
 
-int __guac_handle_sync(guac_client* client, guac_instruction* instruction) {
-    guac_timestamp timestamp = __guac_parse_int(instruction->argv[0]);
+    timestamp = args[0].integer;
 
     /* Error if timestamp is in future */
     if (timestamp > client->last_sent_timestamp)
@@ -89,27 +76,46 @@ int __guac_handle_sync(guac_client* client, guac_instruction* instruction) {
 }
 
 int __guac_handle_mouse(guac_client* client, guac_instruction* instruction) {
+
+    guac_instruction_arg args[3];
+
+    if (guac_instruction_decode(instruction, args))
+        return -1;
+
     if (client->mouse_handler)
         return client->mouse_handler(
             client,
-            atoi(instruction->argv[0]), /* x */
-            atoi(instruction->argv[1]), /* y */
-            atoi(instruction->argv[2])  /* mask */
+            args[0].integer, /* x */
+            args[1].integer, /* y */
+            args[2].integer  /* mask */
         );
     return 0;
 }
 
 int __guac_handle_key(guac_client* client, guac_instruction* instruction) {
+
+    guac_instruction_arg args[2];
+
+    if (guac_instruction_decode(instruction, args))
+        return -1;
+
     if (client->key_handler)
         return client->key_handler(
             client,
-            atoi(instruction->argv[0]), /* keysym */
-            atoi(instruction->argv[1])  /* pressed */
+            args[0].integer, /* keysym */
+            args[1].integer  /* pressed */
         );
     return 0;
 }
 
 int __guac_handle_clipboard(guac_client* client, guac_instruction* instruction) {
+
+    guac_instruction_arg args[1];
+
+    /* Validate argument count */
+    if (guac_instruction_decode(instruction, args))
+        return -1;
+
     if (client->clipboard_handler)
         return client->clipboard_handler(
             client,
@@ -119,6 +125,13 @@ int __guac_handle_clipboard(guac_client* client, guac_instruction* instruction)
 }
 
 int __guac_handle_seamrdp(guac_client* client, guac_instruction* instruction) {
+
+    guac_instruction_arg args[1];
+
+    /* Validate argument count */
+    if (guac_instruction_decode(instruction, args))
+        return -1;
+
     if (client->seamrdp_handler)
         return client->seamrdp_handler(
             client,
@@ -128,6 +141,13 @@ int __guac_handle_seamrdp(guac_client* client, guac_instruction* instruction) {
 }
 
 int __guac_handle_ovdapp(guac_client* client, guac_instruction* instruction) {
+
+    guac_instruction_arg args[1];
+
+    /* Validate argument count */
+    if (guac_instruction_decode(instruction, args))
+        return -1;
+
     if (client->ovdapp_handler)
         return client->ovdapp_handler(
             client,
@@ -137,6 +157,13 @@ int __guac_handle_ovdapp(guac_client* client, guac_instruction* instruction) {
 }
 
 int __guac_handle_ukbrdr(guac_client* client, guac_instruction* instruction) {
+
+    guac_instruction_arg args[1];
+
+    /* Validate argument count */
+    if (guac_instruction_decode(instruction, args))
+        return -1;
+
     if (client->ukbrdr_handler)
         return client->ukbrdr_handler(
             client,
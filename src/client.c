@@ -37,6 +37,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <dlfcn.h>
 
@@ -265,6 +266,10 @@ guac_client* guac_client_plugin_get_client(guac_client_plugin* plugin,
     client->__next_buffer_index = -1;
     client->__next_layer_index  =  1;
 
+    /* Begin with default instruction handlers */
+    memcpy(client->__instruction_handlers, __guac_instruction_handler_map,
+            sizeof(client->__instruction_handlers));
+
     /* Set up logging in client */
     client->log_info_handler  = log_info_handler;
     client->log_error_handler = log_error_handler;
@@ -280,6 +285,8 @@ guac_client* guac_client_plugin_get_client(guac_client_plugin* plugin,
 
 void guac_client_free(guac_client* client) {
 
+    int i;
+
     if (client->free_handler) {
 
         /* FIXME: Errors currently ignored... */
@@ -299,27 +306,253 @@ void guac_client_free(guac_client* client) {
 
     }
 
+    /* Free pending input event storage */
+    free(client->__input_events);
+
+    /* Free all registered handlers */
+    for (i=0; i<GUAC_CLIENT_HANDLER_BUCKETS; i++) {
+
+        __guac_client_handler_entry* entry = client->__custom_handlers[i];
+        while (entry != NULL) {
+            __guac_client_handler_entry* next = entry->__next;
+            free(entry->__opcode);
+            free(entry);
+            entry = next;
+        }
+
+    }
+
     free(client);
 }
 
+/* Returns the hash bucket of handlers for the given opcode */
+int __guac_client_hash_opcode(const char* opcode) {
+
+    /* FNV-1a */
+    uint32_t hash = 2166136261U;
+    for (; *opcode != '\0'; opcode++)
+        hash = (hash ^ (unsigned char) *opcode) * 16777619U;
+
+    return hash % GUAC_CLIENT_HANDLER_BUCKETS;
+
+}
+
+/* Returns the registered handler entry for the given opcode, if any */
+__guac_client_handler_entry* __guac_client_find_handler(guac_client* client,
+        const char* opcode) {
+
+    __guac_client_handler_entry* entry =
+        client->__custom_handlers[__guac_client_hash_opcode(opcode)];
+
+    for (; entry != NULL; entry = entry->__next) {
+        if (strcmp(entry->__opcode, opcode) == 0)
+            return entry;
+    }
+
+    return NULL;
+
+}
+
+int guac_client_register_handler(guac_client* client, const char* opcode,
+        guac_client_instruction_handler* handler) {
+
+    __guac_client_handler_entry* entry;
+    int bucket;
+
+    /* Opcodes defined by guac_opcode are dispatched directly */
+    guac_opcode opcode_id = guac_protocol_opcode_lookup(opcode, strlen(opcode));
+    if (opcode_id != GUAC_OPCODE_UNKNOWN) {
+        client->__instruction_handlers[opcode_id] = handler;
+        return 0;
+    }
+
+    /* Replace handler if already registered */
+    entry = __guac_client_find_handler(client, opcode);
+    if (entry != NULL) {
+        entry->__handler = handler;
+        return 0;
+    }
+
+    /* Otherwise, add new handler */
+    entry = malloc(sizeof(__guac_client_handler_entry));
+    if (entry == NULL) {
+        guac_error = GUAC_STATUS_NO_MEMORY;
+        guac_error_message = "Could not allocate memory for instruction handler";
+        return -1;
+    }
+
+    entry->__opcode = strdup(opcode);
+    if (entry->__opcode == NULL) {
+        guac_error = GUAC_STATUS_NO_MEMORY;
+        guac_error_message = "Could not allocate memory for opcode of instruction handler";
+        free(entry);
+        return -1;
+    }
+
+    entry->__handler = handler;
+
+    /* Add to head of bucket */
+    bucket = __guac_client_hash_opcode(opcode);
+    entry->__next = client->__custom_handlers[bucket];
+    client->__custom_handlers[bucket] = entry;
+
+    return 0;
+
+}
+
 int guac_client_handle_instruction(guac_client* client, guac_instruction* instruction) {
 
-    /* For each defined instruction */
-    __guac_instruction_handler_mapping* current = __guac_instruction_handler_map;
-    while (current->opcode != NULL) {
+    guac_client_instruction_handler* handler = NULL;
+    guac_opcode opcode = guac_instruction_get_opcode(instruction);
 
-        /* If recognized, call handler */
-        if (strcmp(instruction->opcode, current->opcode) == 0)
-            return current->handler(client, instruction);
+    /* Dispatch defined opcodes by their guac_opcode value */
+    if (opcode != GUAC_OPCODE_UNKNOWN)
+        handler = client->__instruction_handlers[opcode];
 
-        current++;
+    /* Look up handlers of any other opcode by name */
+    else {
+        __guac_client_handler_entry* entry =
+            __guac_client_find_handler(client, instruction->opcode);
+
+        if (entry != NULL)
+            handler = entry->__handler;
     }
 
+    /* If recognized, call handler */
+    if (handler != NULL)
+        return handler(client, instruction);
+
     /* If unrecognized, ignore */
     return 0;
 
 }
 
+/* Passes all pending input events to the handlers of the given client */
+int __guac_client_flush_input(guac_client* client, int count) {
+
+    int i;
+    guac_input_event* event = client->__input_events;
+
+    if (count == 0)
+        return 0;
+
+    /* Use batch handler if defined */
+    if (client->input_handler)
+        return client->input_handler(client, event, count);
+
+    /* Otherwise, pass events individually */
+    for (i=0; i<count; i++, event++) {
+
+        int retval = 0;
+
+        if (event->type == GUAC_INPUT_EVENT_MOUSE) {
+            if (client->mouse_handler)
+                retval = client->mouse_handler(client,
+                        event->x, event->y, event->button_mask);
+        }
+        else if (client->key_handler)
+            retval = client->key_handler(client,
+                    event->keysym, event->pressed);
+
+        if (retval)
+            return retval;
+
+    }
+
+    return 0;
+
+}
+
+int guac_client_handle_instructions(guac_client* client,
+        guac_instruction* instructions, int count) {
+
+    int i;
+    int pending = 0;
+
+    /* Ensure there is room for every instruction to become an event */
+    if (count > client->__input_events_size) {
+
+        guac_input_event* events = realloc(client->__input_events,
+                sizeof(guac_input_event) * count);
+
+        if (events == NULL) {
+            guac_error = GUAC_STATUS_NO_MEMORY;
+            guac_error_message = "Could not allocate memory for input events";
+            return -1;
+        }
+
+        client->__input_events = events;
+        client->__input_events_size = count;
+
+    }
+
+    for (i=0; i<count; i++) {
+
+        guac_instruction* instruction = &(instructions[i]);
+        guac_input_event* event = &(client->__input_events[pending]);
+        guac_instruction_arg args[3];
+        guac_opcode opcode = guac_instruction_get_opcode(instruction);
+        int retval;
+
+        /* Convert mouse instructions to events, unless handled elsewhere */
+        if (opcode == GUAC_OPCODE_MOUSE
+                && client->__instruction_handlers[GUAC_OPCODE_MOUSE]
+                    == __guac_handle_mouse
+                && guac_instruction_decode(instruction, args) == 0) {
+
+            int x           = args[0].integer;
+            int y           = args[1].integer;
+            int button_mask = args[2].integer;
+
+            /* Collapse into previous mouse event if buttons unchanged */
+            if (client->coalesce_mouse && pending > 0
+                    && event[-1].type == GUAC_INPUT_EVENT_MOUSE
+                    && event[-1].button_mask == button_mask) {
+                event[-1].x = x;
+                event[-1].y = y;
+                continue;
+            }
+
+            event->type = GUAC_INPUT_EVENT_MOUSE;
+            event->x = x;
+            event->y = y;
+            event->button_mask = button_mask;
+            pending++;
+            continue;
+
+        }
+
+        /* Convert key instructions to events, unless handled elsewhere */
+        if (opcode == GUAC_OPCODE_KEY
+                && client->__instruction_handlers[GUAC_OPCODE_KEY]
+                    == __guac_handle_key
+                && guac_instruction_decode(instruction, args) == 0) {
+
+            event->type = GUAC_INPUT_EVENT_KEY;
+            event->keysym = args[0].integer;
+            event->pressed = args[1].integer;
+            pending++;
+            continue;
+
+        }
+
+        /* Pass pending events before any other instruction */
+        retval = __guac_client_flush_input(client, pending);
+        pending = 0;
+        if (retval)
+            return retval;
+
+        retval = guac_client_handle_instruction(client, instruction);
+        if (retval)
+            return retval;
+
+    }
+
+    /* Pass any remaining events */
+    return __guac_client_flush_input(client, pending);
+
+}
+
 void vguac_client_log_info(guac_client* client, const char* format,
         va_list ap) {
 
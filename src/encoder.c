@@ -0,0 +1,342 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include <png.h>
+
+#include "encoder.h"
+#include "palette.h"
+
+/* The size of the header of each arena block, keeping data aligned */
+#define __GUAC_ENCODER_BLOCK_HEADER \
+    ((sizeof(__guac_encoder_block) + 15) & ~((size_t) 15))
+
+__guac_encoder* __guac_encoder_alloc() {
+
+    __guac_encoder* encoder = malloc(sizeof(__guac_encoder));
+    if (encoder == NULL)
+        return NULL;
+
+    encoder->palette = guac_palette_alloc();
+    if (encoder->palette == NULL) {
+        free(encoder);
+        return NULL;
+    }
+
+    /* Everything else is allocated on first use */
+    encoder->indices = NULL;
+    encoder->indices_size = 0;
+    encoder->rows = NULL;
+    encoder->rows_size = 0;
+    encoder->free_chunks = NULL;
+    encoder->blocks = NULL;
+    encoder->current = NULL;
+    encoder->arena_used = 0;
+
+    return encoder;
+
+}
+
+/* Frees the given list of arena blocks */
+static void __guac_encoder_free_blocks(__guac_encoder_block* block) {
+
+    while (block != NULL) {
+        __guac_encoder_block* next = block->next;
+        free(block);
+        block = next;
+    }
+
+}
+
+void __guac_encoder_free(__guac_encoder* encoder) {
+
+    /* Free all pooled chunks */
+    while (encoder->free_chunks != NULL) {
+        __guac_encoder_chunk* next = encoder->free_chunks->next;
+        free(encoder->free_chunks);
+        encoder->free_chunks = next;
+    }
+
+    __guac_encoder_free_blocks(encoder->blocks);
+    guac_palette_free(encoder->palette);
+    free(encoder->indices);
+    free(encoder->rows);
+    free(encoder);
+
+}
+
+#ifdef HAVE_LIBPTHREAD
+
+/* Key of the workspace of each thread */
+static pthread_key_t __guac_encoder_key;
+static pthread_once_t __guac_encoder_key_init = PTHREAD_ONCE_INIT;
+
+/* Frees the workspace of an exiting thread */
+static void __guac_encoder_thread_free(void* data) {
+    __guac_encoder_free((__guac_encoder*) data);
+}
+
+static void __guac_encoder_key_alloc() {
+    pthread_key_create(&__guac_encoder_key, __guac_encoder_thread_free);
+}
+
+__guac_encoder* __guac_encoder_get_thread_encoder() {
+
+    __guac_encoder* encoder;
+
+    pthread_once(&__guac_encoder_key_init, __guac_encoder_key_alloc);
+
+    encoder = pthread_getspecific(__guac_encoder_key);
+    if (encoder != NULL)
+        return encoder;
+
+    encoder = __guac_encoder_alloc();
+    if (encoder != NULL)
+        pthread_setspecific(__guac_encoder_key, encoder);
+
+    return encoder;
+
+}
+
+#else
+
+__guac_encoder* __guac_encoder_get_thread_encoder() {
+    return NULL;
+}
+
+#endif
+
+png_byte** __guac_encoder_get_rows(__guac_encoder* encoder, int width,
+        int height) {
+
+    int y;
+    size_t size = (size_t) width * height;
+
+    /* Grow index buffer only if too small */
+    if (size > encoder->indices_size) {
+
+        free(encoder->indices);
+        encoder->indices = malloc(size);
+
+        if (encoder->indices == NULL) {
+            encoder->indices_size = 0;
+            return NULL;
+        }
+
+        encoder->indices_size = size;
+
+    }
+
+    /* Likewise for row pointers */
+    if (height > encoder->rows_size) {
+
+        free(encoder->rows);
+        encoder->rows = malloc(sizeof(png_byte*) * height);
+
+        if (encoder->rows == NULL) {
+            encoder->rows_size = 0;
+            return NULL;
+        }
+
+        encoder->rows_size = height;
+
+    }
+
+    for (y=0; y<height; y++)
+        encoder->rows[y] = encoder->indices + (size_t) y * width;
+
+    return encoder->rows;
+
+}
+
+__guac_encoder_chunk* __guac_encoder_get_chunk(__guac_encoder* encoder) {
+
+    /* Reuse pooled chunk if available */
+    __guac_encoder_chunk* chunk = encoder->free_chunks;
+    if (chunk != NULL)
+        encoder->free_chunks = chunk->next;
+
+    /* Otherwise, allocate new chunk */
+    else {
+        chunk = malloc(sizeof(__guac_encoder_chunk));
+        if (chunk == NULL)
+            return NULL;
+    }
+
+    chunk->next = NULL;
+    chunk->length = 0;
+    return chunk;
+
+}
+
+void __guac_encoder_release_chunks(__guac_encoder* encoder,
+        __guac_encoder_chunk* head) {
+
+    __guac_encoder_chunk* tail = head;
+
+    if (head == NULL)
+        return;
+
+    while (tail->next != NULL)
+        tail = tail->next;
+
+    tail->next = encoder->free_chunks;
+    encoder->free_chunks = head;
+
+}
+
+/* Allocates memory from the arena of the given workspace. Memory is never
+ * freed individually, but is all reused once the arena is reset. */
+static void* __guac_encoder_arena_alloc(__guac_encoder* encoder,
+        size_t size) {
+
+    __guac_encoder_block* block = encoder->current;
+    void* allocated;
+
+    /* Keep all allocations aligned */
+    size = (size + 15) & ~((size_t) 15);
+    encoder->arena_used += size;
+
+    /* Move on to later (empty) blocks if current block is full */
+    while (block != NULL && block->size - block->used < size) {
+
+        /* Add new block if no existing block is large enough */
+        if (block->next == NULL) {
+
+            size_t block_size = size > __GUAC_ENCODER_BLOCK_SIZE
+                ? size : __GUAC_ENCODER_BLOCK_SIZE;
+
+            block->next = malloc(__GUAC_ENCODER_BLOCK_HEADER + block_size);
+            if (block->next == NULL)
+                return NULL;
+
+            block->next->next = NULL;
+            block->next->size = block_size;
+            block->next->used = 0;
+
+        }
+
+        block = block->next;
+
+    }
+
+    /* Allocate first block if arena is empty */
+    if (block == NULL) {
+
+        size_t block_size = size > __GUAC_ENCODER_BLOCK_SIZE
+            ? size : __GUAC_ENCODER_BLOCK_SIZE;
+
+        block = malloc(__GUAC_ENCODER_BLOCK_HEADER + block_size);
+        if (block == NULL)
+            return NULL;
+
+        block->next = NULL;
+        block->size = block_size;
+        block->used = 0;
+        encoder->blocks = block;
+
+    }
+
+    allocated = (char*) block + __GUAC_ENCODER_BLOCK_HEADER + block->used;
+    block->used += size;
+    encoder->current = block;
+
+    return allocated;
+
+}
+
+/* Empties the arena of the given workspace, merging its blocks into a single
+ * block if the last image required several */
+static void __guac_encoder_arena_reset(__guac_encoder* encoder) {
+
+    __guac_encoder_block* block = encoder->blocks;
+
+    if (block != NULL && block->next != NULL) {
+
+        size_t block_size = encoder->arena_used;
+
+        __guac_encoder_free_blocks(block);
+
+        /* If allocation fails, blocks will be allocated as needed */
+        block = malloc(__GUAC_ENCODER_BLOCK_HEADER + block_size);
+        if (block != NULL) {
+            block->next = NULL;
+            block->size = block_size;
+        }
+
+        encoder->blocks = block;
+
+    }
+
+    for (; block != NULL; block = block->next)
+        block->used = 0;
+
+    encoder->current = encoder->blocks;
+    encoder->arena_used = 0;
+
+}
+
+#ifdef PNG_USER_MEM_SUPPORTED
+static png_voidp __guac_encoder_png_malloc(png_structp png,
+        png_alloc_size_t size) {
+    return __guac_encoder_arena_alloc(
+            (__guac_encoder*) png_get_mem_ptr(png), size);
+}
+
+static void __guac_encoder_png_free(png_structp png, png_voidp ptr) {
+    /* Arena memory is reused once the arena is reset */
+}
+#endif
+
+png_structp __guac_encoder_create_png(__guac_encoder* encoder) {
+
+#ifdef PNG_USER_MEM_SUPPORTED
+    __guac_encoder_arena_reset(encoder);
+    return png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
+            encoder, __guac_encoder_png_malloc, __guac_encoder_png_free);
+#else
+    return png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+#endif
+
+}
+
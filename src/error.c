@@ -54,6 +54,7 @@ const char* __GUAC_STATUS_INPUT_TIMEOUT_STR  = "Read timeout";
 const char* __GUAC_STATUS_OUTPUT_ERROR_STR   = "Output error";
 const char* __GUAC_STATUS_BAD_ARGUMENT_STR   = "Invalid argument";
 const char* __GUAC_STATUS_BAD_STATE_STR      = "Illegal state";
+const char* __GUAC_STATUS_INPUT_TOO_LARGE_STR = "Input too large";
 const char* __GUAC_STATUS_INVALID_STATUS_STR = "UNKNOWN STATUS CODE";
 
 
@@ -93,6 +94,10 @@ const char* guac_status_string(guac_status status) {
 		case GUAC_STATUS_BAD_STATE:
             return __GUAC_STATUS_BAD_STATE_STR;
 
+        /* Oversized input */
+		case GUAC_STATUS_INPUT_TOO_LARGE:
+            return __GUAC_STATUS_INPUT_TOO_LARGE_STR;
+
         default:
             return __GUAC_STATUS_INVALID_STATUS_STR;
 
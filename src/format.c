@@ -0,0 +1,254 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "format.h"
+
+/* All two-digit decimal numbers, in order, two characters each */
+static const char __guac_format_digit_pairs[200] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+/* All powers of ten representable as uint64_t, indexed by exponent */
+static const uint64_t __guac_format_powers[20] = {
+    1ULL,
+    10ULL,
+    100ULL,
+    1000ULL,
+    10000ULL,
+    100000ULL,
+    1000000ULL,
+    10000000ULL,
+    100000000ULL,
+    1000000000ULL,
+    10000000000ULL,
+    100000000000ULL,
+    1000000000000ULL,
+    10000000000000ULL,
+    100000000000000ULL,
+    1000000000000000ULL,
+    10000000000000000ULL,
+    100000000000000000ULL,
+    1000000000000000000ULL,
+    10000000000000000000ULL
+};
+
+/* The powers of ten from 1e-4 through 1e5, as compared against by the
+ * %g fast path, indexed by exponent plus 4 */
+static const double __guac_format_double_powers[10] = {
+    1e-4, 1e-3, 1e-2, 1e-1, 1e0, 1e1, 1e2, 1e3, 1e4, 1e5
+};
+
+int __guac_format_count_digits(uint64_t value) {
+
+#ifdef __GNUC__
+
+    /* Setting the lowest bit never changes the number of digits, but avoids
+     * the undefined result of __builtin_clzll(0) */
+    uint64_t nonzero = value | 1;
+
+    /* Estimate log10 from log2 (1233/4096 ~= log10(2)), then correct */
+    int bits = 64 - __builtin_clzll(nonzero);
+    int estimate = (bits * 1233) >> 12;
+
+    return estimate + 1 - (nonzero < __guac_format_powers[estimate]);
+
+#else
+
+    int digits = 1;
+
+    while (digits < 20 && value >= __guac_format_powers[digits])
+        digits++;
+
+    return digits;
+
+#endif
+
+}
+
+void __guac_format_digits(char* end, uint64_t value, int digits) {
+
+    /* Two digits at a time */
+    while (digits >= 2) {
+        end -= 2;
+        memcpy(end, &(__guac_format_digit_pairs[(value % 100) * 2]), 2);
+        value /= 100;
+        digits -= 2;
+    }
+
+    /* Remaining digit, if any */
+    if (digits > 0)
+        *(--end) = '0' + value;
+
+}
+
+int __guac_format_int(char* buffer, int64_t value) {
+
+    /* Magnitude, computed without overflow for INT64_MIN */
+    uint64_t magnitude = value < 0 ? -((uint64_t) value) : (uint64_t) value;
+    int digits = __guac_format_count_digits(magnitude);
+    int length = digits;
+
+    if (value < 0) {
+        *(buffer++) = '-';
+        length++;
+    }
+
+    __guac_format_digits(buffer + digits, magnitude, digits);
+    return length;
+
+}
+
+/* Formats the given value with snprintf(), for values outside the fast
+ * path */
+int __guac_format_double_slow(char* buffer, double value) {
+
+    char formatted[__GUAC_FORMAT_DOUBLE_LENGTH + 1];
+    int length = snprintf(formatted, sizeof(formatted), "%g", value);
+
+    memcpy(buffer, formatted, length);
+    return length;
+
+}
+
+int __guac_format_double(char* buffer, double value) {
+
+    uint64_t bits;
+    double magnitude;
+    double scaled;
+    double fraction;
+
+    uint64_t significand;
+    int exponent;
+
+    char digits[6];
+    char* current = buffer;
+    int integer_digits;
+    int i;
+
+    /* Sign is taken from the sign bit, such that -0 is "-0" */
+    memcpy(&bits, &value, sizeof(bits));
+    if (bits >> 63) {
+        *(current++) = '-';
+        magnitude = -value;
+    }
+    else
+        magnitude = value;
+
+    if (magnitude == 0) {
+        *(current++) = '0';
+        return current - buffer;
+    }
+
+    /* Only values which %g writes without an exponent are handled directly
+     * (this also excludes infinity and NaN) */
+    if (!(magnitude >= 1e-4 && magnitude < 1e6))
+        return __guac_format_double_slow(buffer, value);
+
+    /* Find decimal exponent */
+    exponent = 5;
+    while (exponent > -4
+            && magnitude < __guac_format_double_powers[exponent + 4])
+        exponent--;
+
+    /* Scale to six significant digits. The scale factor is an exact power
+     * of ten, so the result is within one rounding of the exact product. */
+    scaled = magnitude * (double) __guac_format_powers[5 - exponent];
+    significand = (uint64_t) scaled;
+    fraction = scaled - (double) significand;
+
+    /* Leave values too close to a rounding boundary to snprintf(), which
+     * rounds the exact binary value */
+    if (fraction > 0.5 - 1e-6 && fraction < 0.5 + 1e-6)
+        return __guac_format_double_slow(buffer, value);
+
+    if (fraction > 0.5)
+        significand++;
+
+    /* Leave values whose exponent was misjudged, or which round up to the
+     * next power of ten, to snprintf() */
+    if (significand < 100000 || significand > 999999)
+        return __guac_format_double_slow(buffer, value);
+
+    __guac_format_digits(digits + 6, significand, 6);
+
+    /* Integer part */
+    if (exponent >= 0) {
+        integer_digits = exponent + 1;
+        memcpy(current, digits, integer_digits);
+        current += integer_digits;
+    }
+    else {
+        integer_digits = 0;
+        *(current++) = '0';
+    }
+
+    /* Fractional part, without trailing zeroes */
+    i = 6;
+    while (i > integer_digits && digits[i - 1] == '0')
+        i--;
+
+    if (i > integer_digits) {
+
+        *(current++) = '.';
+
+        /* Leading zeroes of values less than one */
+        if (exponent < 0) {
+            memset(current, '0', -exponent - 1);
+            current += -exponent - 1;
+        }
+
+        memcpy(current, digits + integer_digits, i - integer_digits);
+        current += i - integer_digits;
+
+    }
+
+    return current - buffer;
+
+}
+
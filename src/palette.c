@@ -41,74 +41,228 @@
 #include <string.h>
 #include <inttypes.h>
 
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define __GUAC_PALETTE_SSE2
+#endif
+
 #include <cairo/cairo.h>
 
 #include <sys/types.h>
 
 #include "palette.h"
 
-guac_palette* guac_palette_alloc(cairo_surface_t* surface) {
+guac_palette* guac_palette_alloc() {
+
+    /* Allocate palette */
+    guac_palette* palette = (guac_palette*) malloc(sizeof(guac_palette));
+    if (palette == NULL)
+        return NULL;
+
+    /* Only the map need be cleared, and only this once */
+    memset(palette->entries, 0, sizeof(palette->entries));
+    palette->size = 0;
+
+    return palette;
+
+}
+
+void guac_palette_reset(guac_palette* palette) {
+
+    int i;
+
+    /* Clear only those entries in use */
+    for (i=0; i<palette->size; i++)
+        palette->entries[palette->slots[i]].index = 0;
+
+    palette->size = 0;
+
+}
+
+/* Returns the index of the given color, adding the color to the palette if
+ * not yet present, or -1 if the palette is full */
+static int __guac_palette_add(guac_palette* palette, int color) {
+
+    /* Calculate hash code */
+    int hash = ((color & 0xFFF000) >> 12) ^ (color & 0xFFF);
+
+    guac_palette_entry* entry;
+
+    /* Search for open palette entry */
+    for (;;) {
+
+        entry = &(palette->entries[hash]);
+
+        /* If we've found a free space, use it */
+        if (entry->index == 0) {
+
+            png_color* c;
+
+            /* Stop if already at capacity */
+            if (palette->size == 256)
+                return -1;
+
+            /* Store in palette */
+            c = &(palette->colors[palette->size]);
+            c->blue  = (color      ) & 0xFF;
+            c->green = (color >> 8 ) & 0xFF;
+            c->red   = (color >> 16) & 0xFF;
+
+            /* Add color to map */
+            palette->slots[palette->size] = hash;
+            entry->index = ++palette->size;
+            entry->color = color;
+
+            return entry->index - 1;
+
+        }
+
+        /* Otherwise, if already stored here, done */
+        if (entry->color == color)
+            return entry->index - 1;
+
+        /* Otherwise, collision. Move on to another bucket */
+        hash = (hash+1) & 0xFFF;
+
+    }
+
+}
+
+/* Returns the length of the run of pixels having the given color which
+ * begins at the start of the given row */
+static int __guac_palette_run_length(const uint32_t* row, int width,
+        int color) {
+
+    int x = 0;
+
+#ifdef __GUAC_PALETTE_SSE2
+    /* Compare four pixels at once, ignoring the unused byte */
+    const __m128i mask = _mm_set1_epi32(0xFFFFFF);
+    const __m128i match = _mm_set1_epi32(color);
+
+    for (; x + 4 <= width; x += 4) {
+
+        __m128i pixels = _mm_loadu_si128((const __m128i*) (row + x));
+        int equal = _mm_movemask_epi8(_mm_cmpeq_epi32(
+                    _mm_and_si128(pixels, mask), match));
+
+        /* Stop at first differing pixel */
+        if (equal != 0xFFFF)
+            return x + __builtin_ctz(~equal) / 4;
+
+    }
+#endif
+
+    for (; x < width; x++) {
+        if ((row[x] & 0xFFFFFF) != (uint32_t) color)
+            break;
+    }
+
+    return x;
+
+}
+
+/* The number of rows and columns of pixels sampled by
+ * guac_palette_sample_overflows(), and the size of its set of colors seen */
+#define __GUAC_PALETTE_SAMPLE_ROWS    32
+#define __GUAC_PALETTE_SAMPLE_COLUMNS 64
+#define __GUAC_PALETTE_SAMPLE_SET     0x400
+
+int guac_palette_sample_overflows(cairo_surface_t* surface) {
 
     int x, y;
+    int colors = 0;
 
     int width = cairo_image_surface_get_width(surface);
     int height = cairo_image_surface_get_height(surface);
     int stride = cairo_image_surface_get_stride(surface);
     unsigned char* data = cairo_image_surface_get_data(surface);
 
-    /* Allocate palette */
-    guac_palette* palette = (guac_palette*) malloc(sizeof(guac_palette));
-    memset(palette, 0, sizeof(guac_palette));
+    /* Sample evenly spaced pixels */
+    int step_x = width  / __GUAC_PALETTE_SAMPLE_COLUMNS + 1;
+    int step_y = height / __GUAC_PALETTE_SAMPLE_ROWS + 1;
 
-    for (y=0; y<height; y++) {
-        for (x=0; x<width; x++) {
+    /* Set of colors seen, each stored plus one such that zero is empty */
+    uint32_t seen[__GUAC_PALETTE_SAMPLE_SET];
 
-            /* Get pixel color */
-            int color = ((uint32_t*) data)[x] & 0xFFFFFF;
+    /* Images this small cannot have too many colors */
+    if (width * height <= 256)
+        return 0;
 
-            /* Calculate hash code */
-            int hash = ((color & 0xFFF000) >> 12) ^ (color & 0xFFF);
+    memset(seen, 0, sizeof(seen));
 
-            guac_palette_entry* entry;
+    for (y=0; y<height; y+=step_y) {
 
-            /* Search for open palette entry */
-            for (;;) {
-                
-                entry = &(palette->entries[hash]);
+        const uint32_t* pixels = (const uint32_t*) (data + y * stride);
 
-                /* If we've found a free space, use it */
-                if (entry->index == 0) {
+        for (x=0; x<width; x+=step_x) {
 
-                    png_color* c;
+            uint32_t color = (pixels[x] & 0xFFFFFF) + 1;
+            int hash = ((color >> 12) ^ color)
+                & (__GUAC_PALETTE_SAMPLE_SET - 1);
 
-                    /* Stop if already at capacity */
-                    if (palette->size == 256) {
-                        guac_palette_free(palette);
-                        return NULL;
-                    }
+            /* Find color, or free space for color */
+            while (seen[hash] != 0 && seen[hash] != color)
+                hash = (hash+1) & (__GUAC_PALETTE_SAMPLE_SET - 1);
 
-                    /* Store in palette */
-                    c = &(palette->colors[palette->size]);
-                    c->blue  = (color      ) & 0xFF;
-                    c->green = (color >> 8 ) & 0xFF;
-                    c->red   = (color >> 16) & 0xFF;
+            /* Stop as soon as too many colors are seen */
+            if (seen[hash] == 0) {
 
-                    /* Add color to map */
-                    entry->index = ++palette->size;
-                    entry->color = color;
+                if (++colors > 256)
+                    return 1;
 
-                    break;
+                seen[hash] = color;
 
-                }
+            }
 
-                /* Otherwise, if already stored here, done */
-                if (entry->color == color)
-                    break;
+        }
 
-                /* Otherwise, collision. Move on to another bucket */
-                hash = (hash+1) & 0xFFF;
+    }
 
+    return 0;
+
+}
+
+int guac_palette_build(guac_palette* palette, cairo_surface_t* surface,
+        png_byte** rows) {
+
+    int x, y;
+
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    unsigned char* data = cairo_image_surface_get_data(surface);
+
+    /* The most recent color and its index, which most pixels will share */
+    int last_color = -1;
+    int last_index = 0;
+
+    for (y=0; y<height; y++) {
+
+        const uint32_t* pixels = (const uint32_t*) data;
+        png_byte* row = rows[y];
+
+        x = 0;
+        while (x < width) {
+
+            /* Fill entire run of most recent color at once */
+            int run = __guac_palette_run_length(pixels + x, width - x,
+                    last_color);
+
+            if (run > 0) {
+                memset(row + x, last_index, run);
+                x += run;
+                continue;
             }
+
+            /* Otherwise, look up (or add) new color */
+            last_color = pixels[x] & 0xFFFFFF;
+            last_index = __guac_palette_add(palette, last_color);
+
+            /* Stop if too many colors */
+            if (last_index < 0)
+                return -1;
+
         }
 
         /* Advance to next data row */
@@ -116,7 +270,7 @@ guac_palette* guac_palette_alloc(cairo_surface_t* surface) {
 
     }
 
-    return palette;
+    return 0;
 
 }
 
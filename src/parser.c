@@ -0,0 +1,475 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "parser.h"
+#include "protocol.h"
+#include "error.h"
+
+/* Element lengths can be read eight bytes at a time only where the layout of
+ * those bytes within a 64-bit integer is known */
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) \
+    && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define __GUAC_PARSER_SWAR
+#endif
+
+guac_parser* guac_parser_alloc() {
+
+    guac_parser* parser = malloc(sizeof(guac_parser));
+
+    /* If no memory available, return with error */
+    if (parser == NULL) {
+        guac_error = GUAC_STATUS_NO_MEMORY;
+        guac_error_message = "Could not allocate memory for parser";
+        return NULL;
+    }
+
+    /* Allocate buffer */
+    parser->__size = GUAC_PARSER_BUFFER_SIZE;
+    parser->__buffer = malloc(parser->__size);
+
+    /* If no memory available, return with error */
+    if (parser->__buffer == NULL) {
+        guac_error = GUAC_STATUS_NO_MEMORY;
+        guac_error_message = "Could not allocate memory for parser buffer";
+        free(parser);
+        return NULL;
+    }
+
+    /* Init members */
+    parser->__state = GUAC_PARSE_LENGTH;
+    parser->__element_length = 0;
+    parser->__opcode_length = 0;
+    parser->__elementc = 0;
+    parser->__length = 0;
+    parser->__consumed = 0;
+    parser->__position = 0;
+
+    /* Use default limits */
+    guac_parser_set_limits(parser, 0, 0);
+
+    return parser;
+
+}
+
+void guac_parser_free(guac_parser* parser) {
+    free(parser->__buffer);
+    free(parser);
+}
+
+void guac_parser_set_limits(guac_parser* parser, int max_instruction_size,
+        int max_buffer_size) {
+
+    if (max_instruction_size <= 0)
+        max_instruction_size = GUAC_PARSER_MAX_INSTRUCTION_SIZE;
+
+    if (max_buffer_size <= 0)
+        max_buffer_size = GUAC_PARSER_MAX_BUFFER_SIZE;
+
+    /* Buffer must always be allowed its base size */
+    if (max_buffer_size < GUAC_PARSER_BUFFER_SIZE)
+        max_buffer_size = GUAC_PARSER_BUFFER_SIZE;
+
+    parser->__max_instruction_size = max_instruction_size;
+    parser->__max_buffer_size = max_buffer_size;
+
+}
+
+/* Fails parsing due to an instruction exceeding the maximum size */
+int __guac_parser_too_large(guac_parser* parser) {
+
+    guac_error = GUAC_STATUS_INPUT_TOO_LARGE;
+    guac_error_message = "Instruction exceeds maximum size";
+    parser->__state = GUAC_PARSE_ERROR;
+
+    return -1;
+
+}
+
+/* Discards all data buffered but not yet parsed, such that parsing cannot
+ * resume with a gap in its input. Returns -1, for convenience. */
+int __guac_parser_discard(guac_parser* parser) {
+
+    parser->__consumed = parser->__length;
+    parser->__state = GUAC_PARSE_ERROR;
+
+    return -1;
+
+}
+
+/* Discards all instructions already parsed, moving any remaining data into a
+ * buffer of the given size (which may be the current buffer). Returns zero
+ * on success, non-zero on error. */
+int __guac_parser_compact(guac_parser* parser, int size) {
+
+    char* start = parser->__buffer + parser->__consumed;
+    int length = parser->__length - parser->__consumed;
+
+    char* buffer = parser->__buffer;
+    int i;
+
+    /* Allocate new buffer if resizing */
+    if (size != parser->__size) {
+        buffer = malloc(size);
+        if (buffer == NULL) {
+            guac_error = GUAC_STATUS_NO_MEMORY;
+            guac_error_message = "Could not allocate memory for parser buffer";
+            return -1;
+        }
+    }
+
+    /* Move only unparsed data, and only once */
+    memmove(buffer, start, length);
+
+    /* Update any elements of the partially-parsed instruction */
+    for (i=0; i<parser->__elementc; i++)
+        parser->__elementv[i] = buffer + (parser->__elementv[i] - start);
+
+    if (buffer != parser->__buffer) {
+        free(parser->__buffer);
+        parser->__buffer = buffer;
+        parser->__size = size;
+    }
+
+    parser->__position -= parser->__consumed;
+    parser->__length = length;
+    parser->__consumed = 0;
+
+    return 0;
+
+}
+
+int guac_parser_reserve(guac_parser* parser, int length, char** buffer) {
+
+    /* If everything buffered has been parsed, reuse buffer from beginning */
+    if (parser->__consumed == parser->__length) {
+        parser->__length = 0;
+        parser->__consumed = 0;
+        parser->__position = 0;
+    }
+
+    /* Return to base size once large instructions have been parsed */
+    if (parser->__size > GUAC_PARSER_BUFFER_SIZE
+            && parser->__length - parser->__consumed + length
+                <= GUAC_PARSER_BUFFER_SIZE) {
+
+        if (__guac_parser_compact(parser, GUAC_PARSER_BUFFER_SIZE))
+            return -1;
+
+    }
+
+    /* Otherwise, make room if necessary */
+    else if (parser->__size - parser->__length < length) {
+
+        int size = parser->__size;
+        int required = parser->__length - parser->__consumed + length;
+
+        /* Fail if data cannot fit within largest buffer */
+        if (required > parser->__max_buffer_size) {
+            guac_error = GUAC_STATUS_INPUT_TOO_LARGE;
+            guac_error_message = "Input exceeds maximum size of parser buffer";
+            return -1;
+        }
+
+        /* Grow only if discarding parsed instructions is insufficient */
+        while (size < required)
+            size *= 2;
+
+        if (size > parser->__max_buffer_size)
+            size = parser->__max_buffer_size;
+
+        if (__guac_parser_compact(parser, size))
+            return -1;
+
+    }
+
+    *buffer = parser->__buffer + parser->__length;
+    return parser->__size - parser->__length;
+
+}
+
+void guac_parser_commit(guac_parser* parser, int length) {
+    parser->__length += length;
+}
+
+int guac_parser_append(guac_parser* parser, const void* buffer, int length) {
+
+    char* space;
+
+    /* Reserve space for data, return on error */
+    if (guac_parser_reserve(parser, length, &space) < 0)
+        return -1;
+
+    memcpy(space, buffer, length);
+    guac_parser_commit(parser, length);
+
+    return 0;
+
+}
+
+#ifdef __GUAC_PARSER_SWAR
+/* Reads the decimal digits at the beginning of the given eight bytes, storing
+ * their value and returning the number of digits read. If all eight bytes
+ * are digits, 8 is returned and no value is stored. */
+int __guac_parser_scan_length(const char* data, int* value) {
+
+    uint64_t v, nondigit;
+    int digits;
+
+    memcpy(&v, data, sizeof(v));
+
+    /* Flag every byte which is not an ASCII digit. Adding 6 to a byte can
+     * only carry out of non-digits, corrupting the flags of later bytes but
+     * never those of the digits before the first non-digit. */
+    nondigit = ((v & 0xF0F0F0F0F0F0F0F0ULL) ^ 0x3030303030303030ULL)
+             | (((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL)
+                    ^ 0x3030303030303030ULL);
+
+    if (nondigit == 0)
+        return 8;
+
+    digits = __builtin_ctzll(nondigit) / 8;
+    if (digits == 0) {
+        *value = 0;
+        return 0;
+    }
+
+    /* Keep only digit values, padded with leading zeroes to eight digits */
+    v = (v & 0x0F0F0F0F0F0F0F0FULL) << (8 * (8 - digits));
+
+    /* Combine pairs of digits, then pairs of pairs, and so on */
+    v = (v * 10 + (v >> 8)) & 0x00FF00FF00FF00FFULL;
+    v = (v * 100 + (v >> 16)) & 0x0000FFFF0000FFFFULL;
+    v = (v * 10000 + (v >> 32)) & 0xFFFFFFFFULL;
+
+    *value = (int) v;
+    return digits;
+
+}
+#endif
+
+int guac_parser_next(guac_parser* parser, guac_instruction* instruction) {
+
+    char* buffer = parser->__buffer;
+
+    /* No further parsing is possible after an error */
+    if (parser->__state == GUAC_PARSE_ERROR) {
+        guac_error = GUAC_STATUS_BAD_ARGUMENT;
+        guac_error_message = "Parser cannot continue after invalid data";
+        return -1;
+    }
+
+    /* Parse until end of buffered data */
+    while (parser->__position < parser->__length) {
+
+        /* Read length of element */
+        if (parser->__state == GUAC_PARSE_LENGTH) {
+
+            char c;
+
+#ifdef __GUAC_PARSER_SWAR
+            /* Read all digits of a new length at once, if enough data is
+             * buffered and the length is short enough to be valid */
+            if (parser->__element_length == 0
+                    && parser->__length - parser->__position >= 8) {
+
+                int value;
+                int digits = __guac_parser_scan_length(
+                        &(buffer[parser->__position]), &value);
+
+                if (digits < 8) {
+                    parser->__element_length = value;
+                    parser->__position += digits;
+                }
+
+            }
+#endif
+
+            /* Read remaining characters one at a time */
+            c = buffer[parser->__position++];
+
+            /* If digit, calculate element length */
+            if (c >= '0' && c <= '9') {
+
+                parser->__element_length =
+                    parser->__element_length * 10 + c - '0';
+
+                /* Fail before length can overflow, or the length alone
+                 * can exceed the maximum instruction size */
+                if (parser->__element_length > parser->__max_instruction_size
+                        || parser->__position - parser->__consumed
+                            > parser->__max_instruction_size)
+                    return __guac_parser_too_large(parser);
+
+            }
+
+            /* Otherwise, if end of length, begin reading value */
+            else if (c == '.') {
+
+                /* Fail if instruction, including the value and terminator
+                 * of this element, would be too large */
+                if (parser->__element_length >= parser->__max_instruction_size
+                        - (parser->__position - parser->__consumed))
+                    return __guac_parser_too_large(parser);
+
+                /* Fail if element would not fit within instruction */
+                if (parser->__elementc == GUAC_INSTRUCTION_MAX_ELEMENTS) {
+                    guac_error = GUAC_STATUS_BAD_ARGUMENT;
+                    guac_error_message = "Instruction has too many elements";
+                    parser->__state = GUAC_PARSE_ERROR;
+                    return -1;
+                }
+
+                parser->__state = GUAC_PARSE_CONTENT;
+
+            }
+
+            /* Error if length is non-numeric or does not end in a period */
+            else {
+                guac_error = GUAC_STATUS_BAD_ARGUMENT;
+                guac_error_message = "Non-numeric character in element length";
+                parser->__state = GUAC_PARSE_ERROR;
+                return -1;
+            }
+
+        }
+
+        /* Read value of element, all at once */
+        else {
+
+            char* element = &(buffer[parser->__position]);
+            char terminator;
+
+            /* Wait until element and terminator are fully buffered */
+            if (parser->__length - parser->__position
+                    <= parser->__element_length)
+                return 0;
+
+            /* Get terminator, set null terminator of element */
+            terminator = element[parser->__element_length];
+            element[parser->__element_length] = '\0';
+
+            /* Save element, move to char after terminator */
+            if (parser->__elementc == 0)
+                parser->__opcode_length = parser->__element_length;
+
+            parser->__elementv[parser->__elementc++] = element;
+            parser->__position += parser->__element_length + 1;
+
+            /* Begin next element */
+            parser->__element_length = 0;
+            parser->__state = GUAC_PARSE_LENGTH;
+
+            /* Finish parse if terminator is a semicolon */
+            if (terminator == ';') {
+
+                /* Point view at elements within buffer */
+                instruction->opcode = parser->__elementv[0];
+                instruction->opcode_id = guac_protocol_opcode_lookup(
+                        instruction->opcode, parser->__opcode_length);
+                instruction->argc = parser->__elementc - 1;
+                instruction->argv = &(parser->__elementv[1]);
+
+                /* Instruction may be discarded once data is next needed */
+                parser->__consumed = parser->__position;
+                parser->__elementc = 0;
+
+                return 1;
+
+            }
+
+            /* Error if expected comma is not present */
+            else if (terminator != ',') {
+                guac_error = GUAC_STATUS_BAD_ARGUMENT;
+                guac_error_message = "Element terminator of instruction was not ';' nor ','";
+                parser->__state = GUAC_PARSE_ERROR;
+                return -1;
+            }
+
+        }
+
+    }
+
+    /* Instruction is incomplete */
+    return 0;
+
+}
+
+int guac_parser_feed(guac_parser* parser, const void* buffer, int length,
+        guac_parser_instruction_handler* handler, void* data) {
+
+    const char* char_buf = (const char*) buffer;
+
+    while (length > 0) {
+
+        guac_instruction instruction;
+        int retval;
+
+        /* Buffer data in pieces, such that the buffer need only hold a
+         * single instruction */
+        int piece = length;
+        if (piece > GUAC_PARSER_BUFFER_SIZE)
+            piece = GUAC_PARSER_BUFFER_SIZE;
+
+        if (guac_parser_append(parser, char_buf, piece))
+            return __guac_parser_discard(parser);
+
+        char_buf += piece;
+        length -= piece;
+
+        /* Handle every instruction completed by data */
+        while ((retval = guac_parser_next(parser, &instruction)) > 0) {
+            if (handler(&instruction, data))
+                return __guac_parser_discard(parser);
+        }
+
+        if (retval < 0)
+            return __guac_parser_discard(parser);
+
+    }
+
+    return 0;
+
+}
+
+int guac_parser_buffered(guac_parser* parser) {
+    return parser->__length - parser->__consumed;
+}
+
@@ -47,6 +47,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
@@ -57,126 +58,279 @@
 #endif
 
 #include <png.h>
+#include <zlib.h>
 
 #include <cairo/cairo.h>
 
 #include <sys/types.h>
 
-#ifdef __MINGW32__
-#include <winsock2.h>
-#else
-#include <sys/socket.h>
-#endif
-
 #include "socket.h"
 #include "protocol.h"
+#include "parser.h"
 #include "error.h"
+#include "format.h"
+#include "encoder.h"
 #include "palette.h"
+#include "stats.h"
 
 /* Output formatting functions */
 
-ssize_t __guac_socket_write_length_string(guac_socket* socket, const char* str) {
+/* Defined within socket.c */
+__guac_socket_segment* __guac_socket_reserve(guac_socket* socket,
+        int length);
+void __guac_socket_commit(guac_socket* socket, __guac_socket_segment* segment,
+        int length);
 
-    return
-           guac_socket_write_int(socket, strlen(str))
-        || guac_socket_write_string(socket, ".")
-        || guac_socket_write_string(socket, str);
+/* Writes a single element of the given length, preceded by the given
+ * separator and by its length, directly into the output buffer */
+ssize_t __guac_socket_write_element(guac_socket* socket, char separator,
+        const char* value, int length) {
 
-}
+    __guac_socket_segment* segment;
+    char* buffer;
+
+    /* Separator, length and period, plus value */
+    int length_digits = __guac_format_count_digits(length);
+    int total = length_digits + 2 + length;
+
+    /* Write in pieces if element cannot fit within a single segment */
+    if (total > GUAC_SOCKET_SEGMENT_SIZE) {
+
+        char prefix[24];
+        int prefix_length = length_digits + 2;
+
+        prefix[0] = separator;
+        __guac_format_digits(prefix + length_digits + 1, length, length_digits);
+        prefix[length_digits + 1] = '.';
+
+        return
+               guac_socket_write(socket, prefix, prefix_length)
+            || guac_socket_write(socket, value, length);
+
+    }
+
+    segment = __guac_socket_reserve(socket, total);
+    if (segment == NULL)
+        return -1;
 
+    buffer = segment->__data + segment->__length;
 
-ssize_t __guac_socket_write_length_int(guac_socket* socket, int64_t i) {
+    *(buffer++) = separator;
+    __guac_format_digits(buffer + length_digits, length, length_digits);
+    buffer += length_digits;
+    *(buffer++) = '.';
+    memcpy(buffer, value, length);
 
-    char buffer[128];
-    snprintf(buffer, sizeof(buffer), "%"PRIi64, i);
-    return __guac_socket_write_length_string(socket, buffer);
+    __guac_socket_commit(socket, segment, total);
+
+    return 0;
 
 }
 
+/* Writes a single integer element, preceded by the given separator and by
+ * its length, directly into the output buffer */
+ssize_t __guac_socket_write_element_int(guac_socket* socket, char separator,
+        int64_t i) {
+
+    __guac_socket_segment* segment;
+    char* buffer;
+
+    /* Magnitude, computed without overflow for INT64_MIN */
+    uint64_t magnitude = i < 0 ? -((uint64_t) i) : (uint64_t) i;
+    int digits = __guac_format_count_digits(magnitude);
+
+    /* Element length, including any sign (at most 20, thus two digits) */
+    int length = digits + (i < 0);
+    int length_digits = length < 10 ? 1 : 2;
+    int total = length_digits + 2 + length;
+
+    segment = __guac_socket_reserve(socket, total);
+    if (segment == NULL)
+        return -1;
+
+    buffer = segment->__data + segment->__length;
+
+    *(buffer++) = separator;
+    __guac_format_digits(buffer + length_digits, length, length_digits);
+    buffer += length_digits;
+    *(buffer++) = '.';
+
+    if (i < 0)
+        *(buffer++) = '-';
 
-ssize_t __guac_socket_write_length_double(guac_socket* socket, double d) {
+    __guac_format_digits(buffer + digits, magnitude, digits);
 
-    char buffer[128];
-    snprintf(buffer, sizeof(buffer), "%g", d);
-    return __guac_socket_write_length_string(socket, buffer);
+    __guac_socket_commit(socket, segment, total);
+
+    return 0;
+
+}
+
+/* Writes a single floating-point element, preceded by the given separator
+ * and by its length */
+ssize_t __guac_socket_write_element_double(guac_socket* socket,
+        char separator, double d) {
+
+    char buffer[__GUAC_FORMAT_DOUBLE_LENGTH];
+    int length = __guac_format_double(buffer, d);
+    return __guac_socket_write_element(socket, separator, buffer, length);
 
 }
 
 
 /* PNG output formatting */
 
+/**
+ * What should be done with PNG data as it is produced by the encoder.
+ */
+typedef enum __guac_png_output {
+
+    /**
+     * Store all data in a chain of chunks, to be written once the final
+     * length is known.
+     */
+    __GUAC_PNG_OUTPUT_BUFFER,
+
+    /**
+     * Only count the number of bytes produced, discarding the data.
+     */
+    __GUAC_PNG_OUTPUT_MEASURE,
+
+    /**
+     * Base64-encode all data directly to the socket.
+     */
+    __GUAC_PNG_OUTPUT_STREAM
+
+} __guac_png_output;
+
 typedef struct __guac_socket_write_png_data {
 
     guac_socket* socket;
 
-    char* buffer;
-    int buffer_size;
+    __guac_encoder* encoder;
+
+    __guac_png_output output;
+
+    __guac_encoder_chunk* head;
+    __guac_encoder_chunk* tail;
+
     int data_size;
 
+    int output_failed;
+
 } __guac_socket_write_png_data;
 
-cairo_status_t __guac_socket_write_png_cairo(void* closure, const unsigned char* data, unsigned int length) {
+void __guac_socket_png_data_init(__guac_socket_write_png_data* png_data,
+        guac_socket* socket, __guac_encoder* encoder,
+        __guac_png_output output) {
 
-    __guac_socket_write_png_data* png_data = (__guac_socket_write_png_data*) closure;
+    png_data->socket = socket;
+    png_data->encoder = encoder;
+    png_data->output = output;
+    png_data->head = NULL;
+    png_data->tail = NULL;
+    png_data->data_size = 0;
+    png_data->output_failed = 0;
+
+}
 
-    /* Calculate next buffer size */
-    int next_size = png_data->data_size + length;
+void __guac_socket_png_data_free(__guac_socket_write_png_data* png_data) {
 
-    /* If need resizing, double buffer size until big enough */
-    if (next_size > png_data->buffer_size) {
+    /* Return all chunks to workspace */
+    __guac_encoder_release_chunks(png_data->encoder, png_data->head);
 
-        char* new_buffer;
+    png_data->head = NULL;
+    png_data->tail = NULL;
 
-        do {
-            png_data->buffer_size <<= 1;
-        } while (next_size > png_data->buffer_size);
+}
 
-        /* Resize buffer */
-        new_buffer = realloc(png_data->buffer, png_data->buffer_size);
-        png_data->buffer = new_buffer;
+/* Handles data produced by either PNG encoder. Returns non-zero on error. */
+int __guac_socket_png_data_append(__guac_socket_write_png_data* png_data,
+        const unsigned char* data, size_t length) {
 
+    /* Stream directly to socket if requested */
+    if (png_data->output == __GUAC_PNG_OUTPUT_STREAM) {
+        if (guac_socket_write_base64(png_data->socket, data, length))
+            return -1;
     }
 
-    /* Append data to buffer */
-    memcpy(png_data->buffer + png_data->data_size, data, length);
-    png_data->data_size += length;
+    /* Otherwise, append to chunks unless only measuring */
+    else if (png_data->output == __GUAC_PNG_OUTPUT_BUFFER) {
 
-    return CAIRO_STATUS_SUCCESS;
+        while (length > 0) {
 
-}
+            __guac_encoder_chunk* chunk = png_data->tail;
+            size_t available;
 
+            /* Add new chunk if last chunk is full */
+            if (chunk == NULL || chunk->length == __GUAC_ENCODER_CHUNK_SIZE) {
 
-int __guac_socket_write_length_png_cairo(guac_socket* socket, cairo_surface_t* surface) {
+                chunk = __guac_encoder_get_chunk(png_data->encoder);
+                if (chunk == NULL) {
+                    guac_error = GUAC_STATUS_NO_MEMORY;
+                    guac_error_message = "Could not allocate memory for PNG data";
+                    return -1;
+                }
 
-    __guac_socket_write_png_data png_data;
-    int base64_length;
+                if (png_data->tail != NULL)
+                    png_data->tail->next = chunk;
+                else
+                    png_data->head = chunk;
 
-    /* Write surface */
+                png_data->tail = chunk;
 
-    png_data.socket = socket;
-    png_data.buffer_size = 8192;
-    png_data.buffer = malloc(png_data.buffer_size);
-    png_data.data_size = 0;
+            }
+
+            /* Copy as much as fits */
+            available = __GUAC_ENCODER_CHUNK_SIZE - chunk->length;
+            if (available > length)
+                available = length;
+
+            memcpy(chunk->data + chunk->length, data, available);
+            chunk->length += available;
+
+            data += available;
+            length -= available;
+            png_data->data_size += available;
+
+        }
+
+        return 0;
 
-    if (cairo_surface_write_to_png_stream(surface, __guac_socket_write_png_cairo, &png_data) != CAIRO_STATUS_SUCCESS) {
-        guac_error = GUAC_STATUS_OUTPUT_ERROR;
-        guac_error_message = "Cairo PNG backend failed";
-        return -1;
     }
 
-    base64_length = (png_data.data_size + 2) / 3 * 4;
+    png_data->data_size += length;
+    return 0;
+
+}
+
+cairo_status_t __guac_socket_write_png_cairo(void* closure, const unsigned char* data, unsigned int length) {
+
+    __guac_socket_write_png_data* png_data = (__guac_socket_write_png_data*) closure;
+
+    if (__guac_socket_png_data_append(png_data, data, length)) {
+        png_data->output_failed = 1;
+        return CAIRO_STATUS_WRITE_ERROR;
+    }
+
+    return CAIRO_STATUS_SUCCESS;
+
+}
+
+int __guac_png_encode_cairo(cairo_surface_t* surface,
+        __guac_socket_write_png_data* png_data) {
+
+    if (cairo_surface_write_to_png_stream(surface, __guac_socket_write_png_cairo, png_data) != CAIRO_STATUS_SUCCESS) {
+
+        /* Do not overwrite error from output */
+        if (!png_data->output_failed) {
+            guac_error = GUAC_STATUS_OUTPUT_ERROR;
+            guac_error_message = "Cairo PNG backend failed";
+        }
 
-    /* Write length and data */
-    if (
-           guac_socket_write_int(socket, base64_length)
-        || guac_socket_write_string(socket, ".")
-        || guac_socket_write_base64(socket, png_data.buffer, png_data.data_size)
-        || guac_socket_flush_base64(socket)) {
-        free(png_data.buffer);
         return -1;
     }
 
-    free(png_data.buffer);
     return 0;
 
 }
@@ -192,176 +346,808 @@ void __guac_socket_write_png(png_structp png,
     png_data = (__guac_socket_write_png_data*) png->io_ptr;
 #endif
 
-    /* Calculate next buffer size */
-    int next_size = png_data->data_size + length;
+    /* Abort encoding if data cannot be handled */
+    if (__guac_socket_png_data_append(png_data, data, length)) {
+        png_data->output_failed = 1;
+        png_error(png, "Unable to write PNG data");
+    }
 
-    /* If need resizing, double buffer size until big enough */
-    if (next_size > png_data->buffer_size) {
+}
 
-        char* new_buffer;
+void __guac_socket_flush_png(png_structp png) {
+    /* Dummy function */
+}
 
-        do {
-            png_data->buffer_size <<= 1;
-        } while (next_size > png_data->buffer_size);
+/* Applies the compression settings of the given socket to a PNG writer */
+void __guac_png_set_compression(png_structp png, guac_socket* socket) {
 
-        /* Resize buffer */
-        new_buffer = realloc(png_data->buffer, png_data->buffer_size);
-        png_data->buffer = new_buffer;
+    if (socket->__png_level != GUAC_PROTOCOL_PNG_DEFAULT)
+        png_set_compression_level(png, socket->__png_level);
 
-    }
+    if (socket->__png_strategy != GUAC_PROTOCOL_PNG_DEFAULT)
+        png_set_compression_strategy(png, socket->__png_strategy);
 
-    /* Append data to buffer */
-    memcpy(png_data->buffer + png_data->data_size, data, length);
-    png_data->data_size += length;
+    if (socket->__png_filters != GUAC_PROTOCOL_PNG_DEFAULT)
+        png_set_filter(png, PNG_FILTER_TYPE_BASE, socket->__png_filters);
 
 }
 
-void __guac_socket_flush_png(png_structp png) {
-    /* Dummy function */
+/* Returns whether the given socket leaves all PNG compression to libpng, in
+ * which case the Cairo PNG writer produces the same result */
+int __guac_png_compression_is_default(guac_socket* socket) {
+    return socket->__png_level    == GUAC_PROTOCOL_PNG_DEFAULT
+        && socket->__png_strategy == GUAC_PROTOCOL_PNG_DEFAULT
+        && socket->__png_filters  == GUAC_PROTOCOL_PNG_DEFAULT;
 }
 
-int __guac_socket_write_length_png(guac_socket* socket, cairo_surface_t* surface) {
+int __guac_png_encode_palette(png_byte** png_rows, int width, int height,
+        guac_palette* palette, __guac_socket_write_png_data* png_data) {
 
     png_structp png;
     png_infop png_info;
-    png_byte** png_rows;
     int bpp;
 
+    /* Calculate BPP from palette size */
+    if      (palette->size <= 2)  bpp = 1;
+    else if (palette->size <= 4)  bpp = 2;
+    else if (palette->size <= 16) bpp = 4;
+    else                          bpp = 8;
+
+    /* Set up PNG writer */
+    png = __guac_encoder_create_png(png_data->encoder);
+    if (!png) {
+        guac_error = GUAC_STATUS_OUTPUT_ERROR;
+        guac_error_message = "libpng failed to create write structure";
+        return -1;
+    }
+
+    png_info = png_create_info_struct(png);
+    if (!png_info) {
+        png_destroy_write_struct(&png, NULL);
+        guac_error = GUAC_STATUS_OUTPUT_ERROR;
+        guac_error_message = "libpng failed to create info structure";
+        return -1;
+    }
+
+    /* Set error handler */
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &png_info);
+
+        /* Do not overwrite error from output */
+        if (!png_data->output_failed) {
+            guac_error = GUAC_STATUS_OUTPUT_ERROR;
+            guac_error_message = "libpng output error";
+        }
+
+        return -1;
+    }
+
+    /* Set up writer */
+    png_set_write_fn(png, png_data,
+            __guac_socket_write_png,
+            __guac_socket_flush_png);
+
+    /* Write image info */
+    png_set_IHDR(
+        png,
+        png_info,
+        width,
+        height,
+        bpp,
+        PNG_COLOR_TYPE_PALETTE,
+        PNG_INTERLACE_NONE,
+        PNG_COMPRESSION_TYPE_DEFAULT,
+        PNG_FILTER_TYPE_DEFAULT
+    );
+
+    __guac_png_set_compression(png, png_data->socket);
+
+    /* Write palette */
+    png_set_PLTE(png, png_info, palette->colors, palette->size);
+
+    /* Write image */
+    png_set_rows(png, png_info, png_rows);
+    png_write_png(png, png_info, PNG_TRANSFORM_PACKING, NULL);
+
+    /* Finish write */
+    png_destroy_write_struct(&png, &png_info);
+    return 0;
+
+}
+
+int __guac_png_encode_truecolor(cairo_surface_t* surface,
+        __guac_socket_write_png_data* png_data) {
+
+    png_structp png;
+    png_infop png_info;
+    png_byte** png_row;
     int x, y;
 
+    /* Get image surface properties and data */
+    int alpha = cairo_image_surface_get_format(surface) == CAIRO_FORMAT_ARGB32;
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    unsigned char* data = cairo_image_surface_get_data(surface);
+
+    /* Flush pending operations to surface */
+    cairo_surface_flush(surface);
+
+    /* Convert one row at a time into the workspace */
+    png_row = __guac_encoder_get_rows(png_data->encoder, width * 4, 1);
+    if (png_row == NULL) {
+        guac_error = GUAC_STATUS_NO_MEMORY;
+        guac_error_message = "Could not allocate memory for PNG rows";
+        return -1;
+    }
+
+    /* Set up PNG writer */
+    png = __guac_encoder_create_png(png_data->encoder);
+    if (!png) {
+        guac_error = GUAC_STATUS_OUTPUT_ERROR;
+        guac_error_message = "libpng failed to create write structure";
+        return -1;
+    }
+
+    png_info = png_create_info_struct(png);
+    if (!png_info) {
+        png_destroy_write_struct(&png, NULL);
+        guac_error = GUAC_STATUS_OUTPUT_ERROR;
+        guac_error_message = "libpng failed to create info structure";
+        return -1;
+    }
+
+    /* Set error handler */
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &png_info);
+
+        /* Do not overwrite error from output */
+        if (!png_data->output_failed) {
+            guac_error = GUAC_STATUS_OUTPUT_ERROR;
+            guac_error_message = "libpng output error";
+        }
+
+        return -1;
+    }
+
+    /* Set up writer */
+    png_set_write_fn(png, png_data,
+            __guac_socket_write_png,
+            __guac_socket_flush_png);
+
+    /* Write image info */
+    png_set_IHDR(
+        png,
+        png_info,
+        width,
+        height,
+        8,
+        alpha ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB,
+        PNG_INTERLACE_NONE,
+        PNG_COMPRESSION_TYPE_DEFAULT,
+        PNG_FILTER_TYPE_DEFAULT
+    );
+
+    __guac_png_set_compression(png, png_data->socket);
+    png_write_info(png, png_info);
+
+    /* Write image, converting native-endian pixels to bytes */
+    for (y=0; y<height; y++) {
+
+        uint32_t* current = (uint32_t*) (data + y*stride);
+        png_byte* out = png_row[0];
+
+        for (x=0; x<width; x++) {
+
+            uint32_t color = *(current++);
+            unsigned int a = color >> 24;
+            unsigned int r = (color >> 16) & 0xFF;
+            unsigned int g = (color >> 8)  & 0xFF;
+            unsigned int b =  color        & 0xFF;
+
+            /* Without alpha, write RGB as-is */
+            if (!alpha) {
+                *(out++) = r;
+                *(out++) = g;
+                *(out++) = b;
+                continue;
+            }
+
+            /* Otherwise, undo premultiplication as Cairo does */
+            if (a != 0 && a != 0xFF) {
+                r = (r * 0xFF + a/2) / a;
+                g = (g * 0xFF + a/2) / a;
+                b = (b * 0xFF + a/2) / a;
+            }
+
+            *(out++) = r;
+            *(out++) = g;
+            *(out++) = b;
+            *(out++) = a;
+
+        }
+
+        png_write_row(png, png_row[0]);
+
+    }
+
+    png_write_end(png, NULL);
+
+    /* Finish write */
+    png_destroy_write_struct(&png, &png_info);
+    return 0;
+
+}
+
+/* Runs one pass of the appropriate PNG encoder. Palette data is optional. */
+int __guac_png_encode(cairo_surface_t* surface, png_byte** png_rows,
+        guac_palette* palette, __guac_socket_write_png_data* png_data) {
+
+    cairo_format_t format;
+
+    if (palette == NULL) {
+
+        /* Use Cairo unless compression settings must be honored */
+        format = cairo_image_surface_get_format(surface);
+        if (__guac_png_compression_is_default(png_data->socket)
+                || (format != CAIRO_FORMAT_RGB24
+                    && format != CAIRO_FORMAT_ARGB32)
+                || cairo_image_surface_get_data(surface) == NULL)
+            return __guac_png_encode_cairo(surface, png_data);
+
+        return __guac_png_encode_truecolor(surface, png_data);
+
+    }
+
+    return __guac_png_encode_palette(png_rows,
+            cairo_image_surface_get_width(surface),
+            cairo_image_surface_get_height(surface),
+            palette, png_data);
+
+}
+
+int __guac_socket_write_length_png_encoded(guac_socket* socket,
+        __guac_encoder* encoder, cairo_surface_t* surface,
+        png_byte** png_rows, guac_palette* palette) {
+
     __guac_socket_write_png_data png_data;
-    int base64_length;
+    __guac_encoder_chunk* chunk;
+    int data_size;
+
+    /* If streaming, measure first, then encode straight to socket */
+    if (socket->__png_mode == GUAC_PROTOCOL_PNG_STREAMING) {
+
+        __guac_socket_png_data_init(&png_data, socket, encoder,
+                __GUAC_PNG_OUTPUT_MEASURE);
+        if (__guac_png_encode(surface, png_rows, palette, &png_data))
+            return -1;
+
+        data_size = png_data.data_size;
+        __guac_socket_png_data_init(&png_data, socket, encoder,
+                __GUAC_PNG_OUTPUT_STREAM);
+
+        if (
+               guac_socket_write_int(socket, (data_size + 2) / 3 * 4)
+            || guac_socket_write_string(socket, ".")
+            || __guac_png_encode(surface, png_rows, palette, &png_data)
+            || guac_socket_flush_base64(socket))
+            return -1;
+
+        /* Length already sent is wrong if encoder output differs */
+        if (png_data.data_size != data_size) {
+            guac_error = GUAC_STATUS_OUTPUT_ERROR;
+            guac_error_message = "PNG encoder output changed between passes";
+            return -1;
+        }
+
+        return 0;
+
+    }
+
+    /* Otherwise, buffer entire image */
+    __guac_socket_png_data_init(&png_data, socket, encoder,
+            __GUAC_PNG_OUTPUT_BUFFER);
+    if (__guac_png_encode(surface, png_rows, palette, &png_data)) {
+        __guac_socket_png_data_free(&png_data);
+        return -1;
+    }
+
+    /* Write length */
+    if (
+           guac_socket_write_int(socket, (png_data.data_size + 2) / 3 * 4)
+        || guac_socket_write_string(socket, ".")) {
+        __guac_socket_png_data_free(&png_data);
+        return -1;
+    }
+
+    /* Write data, one chunk at a time */
+    for (chunk = png_data.head; chunk != NULL; chunk = chunk->next) {
+        if (guac_socket_write_base64(socket, chunk->data, chunk->length)) {
+            __guac_socket_png_data_free(&png_data);
+            return -1;
+        }
+    }
+
+    __guac_socket_png_data_free(&png_data);
+    return guac_socket_flush_base64(socket);
+
+}
+
+/* Returns the workspace for the next png instruction written to the given
+ * socket, which is the workspace of the socket unless several threads may be
+ * writing to the socket at once */
+__guac_encoder* __guac_socket_get_encoder(guac_socket* socket) {
+
+    if (socket->__threadsafe)
+        return __guac_encoder_get_thread_encoder();
+
+    /* Allocate workspace on first use */
+    if (socket->__encoder == NULL)
+        socket->__encoder = __guac_encoder_alloc();
+
+    return socket->__encoder;
+
+}
+
+/* Returns the remembered outcome of the last palette attempt for the given
+ * layer, or NULL if outcomes are not remembered for the given socket */
+__guac_socket_palette_history* __guac_socket_get_palette_history(
+        guac_socket* socket, const guac_layer* layer) {
+
+    /* Remembered outcomes cannot be shared by several threads */
+    if (layer == NULL || socket->__threadsafe)
+        return NULL;
+
+    return &(socket->__palette_history[(unsigned int) layer->index
+            % GUAC_SOCKET_PALETTE_HISTORY]);
+
+}
+
+/* Returns whether a palette should be attempted for the given surface, which
+ * is to be drawn to the given layer */
+int __guac_socket_should_try_palette(guac_socket* socket,
+        const guac_layer* layer, cairo_surface_t* surface) {
+
+    __guac_socket_palette_history* history =
+        __guac_socket_get_palette_history(socket, layer);
+
+    /* Skip sampling if the last image of this layer had a palette */
+    if (history != NULL && history->__valid
+            && history->__layer == layer->index && !history->__truecolor)
+        return 1;
+
+    /* Otherwise, sample first, skipping palette only if certain to fail */
+    if (guac_palette_sample_overflows(surface)) {
+        __GUAC_STAT_ADD_SHARED(socket->__stats.palette_skipped, 1);
+        return 0;
+    }
+
+    return 1;
+
+}
+
+/* Records the outcome of a palette attempt for the given layer */
+void __guac_socket_record_palette(guac_socket* socket,
+        const guac_layer* layer, int truecolor) {
+
+    __guac_socket_palette_history* history =
+        __guac_socket_get_palette_history(socket, layer);
+
+    if (history != NULL) {
+        history->__valid = 1;
+        history->__layer = layer->index;
+        history->__truecolor = truecolor;
+    }
+
+    if (truecolor)
+        __GUAC_STAT_ADD_SHARED(socket->__stats.palette_misses, 1);
+    else
+        __GUAC_STAT_ADD_SHARED(socket->__stats.palette_hits, 1);
+
+}
+
+int __guac_socket_write_length_png(guac_socket* socket,
+        const guac_layer* layer, cairo_surface_t* surface) {
+
+    __guac_encoder* encoder;
+    png_byte** png_rows;
+    int retval;
 
     /* Get image surface properties and data */
     cairo_format_t format = cairo_image_surface_get_format(surface);
     int width = cairo_image_surface_get_width(surface);
     int height = cairo_image_surface_get_height(surface);
-    int stride = cairo_image_surface_get_stride(surface);
     unsigned char* data = cairo_image_surface_get_data(surface);
 
+    encoder = __guac_socket_get_encoder(socket);
+    if (encoder == NULL) {
+        guac_error = GUAC_STATUS_NO_MEMORY;
+        guac_error_message = "Could not allocate memory for PNG encoder";
+        return -1;
+    }
+
     /* If not RGB24, use Cairo PNG writer */
     if (format != CAIRO_FORMAT_RGB24 || data == NULL)
-        return __guac_socket_write_length_png_cairo(socket, surface);
+        return __guac_socket_write_length_png_encoded(socket, encoder,
+                surface, NULL, NULL);
 
     /* Flush pending operations to surface */
     cairo_surface_flush(surface);
 
-    /* Attempt to build palette */
-    guac_palette* palette = guac_palette_alloc(surface);
+    /* Resort to Cairo PNG writer if palette is certain to fail */
+    if (!__guac_socket_should_try_palette(socket, layer, surface))
+        return __guac_socket_write_length_png_encoded(socket, encoder,
+                surface, NULL, NULL);
 
-    /* If not possible, resort to Cairo PNG writer */
-    if (palette == NULL)
-        return __guac_socket_write_length_png_cairo(socket, surface);
+    /* Get PNG rows to receive palette indices */
+    png_rows = __guac_encoder_get_rows(encoder, width, height);
+    if (png_rows == NULL) {
+        guac_error = GUAC_STATUS_NO_MEMORY;
+        guac_error_message = "Could not allocate memory for PNG rows";
+        return -1;
+    }
 
-    /* Calculate BPP from palette size */
-    if      (palette->size <= 2)  bpp = 1;
-    else if (palette->size <= 4)  bpp = 2;
-    else if (palette->size <= 16) bpp = 4;
-    else                          bpp = 8;
+    /* Build palette and rows together, resorting to Cairo PNG writer if
+     * there are too many colors */
+    if (guac_palette_build(encoder->palette, surface, png_rows)) {
+        __guac_socket_record_palette(socket, layer, 1);
+        retval = __guac_socket_write_length_png_encoded(socket, encoder,
+                surface, NULL, NULL);
+    }
+
+    /* Otherwise, encode and write image */
+    else {
+        __guac_socket_record_palette(socket, layer, 0);
+        retval = __guac_socket_write_length_png_encoded(socket, encoder,
+                surface, png_rows, encoder->palette);
+    }
+
+    /* Keep workspace, but leave palette empty for next image */
+    guac_palette_reset(encoder->palette);
+
+    return retval;
+
+}
+
+void guac_protocol_set_png_mode(guac_socket* socket,
+        guac_protocol_png_mode mode) {
+    socket->__png_mode = mode;
+}
+
+void guac_protocol_set_png_profile(guac_socket* socket,
+        guac_protocol_png_profile profile) {
+
+    switch (profile) {
+
+        /* Fastest: run-length encoding only, no filtering */
+        case GUAC_PROTOCOL_PNG_FAST:
+            guac_protocol_set_png_compression(socket, 1, Z_RLE,
+                    PNG_FILTER_NONE);
+            break;
+
+        /* Smallest: maximum level, filters left to libpng */
+        case GUAC_PROTOCOL_PNG_SMALL:
+            guac_protocol_set_png_compression(socket, 9,
+                    GUAC_PROTOCOL_PNG_DEFAULT, GUAC_PROTOCOL_PNG_DEFAULT);
+            break;
+
+        /* Otherwise, leave everything to libpng */
+        default:
+            guac_protocol_set_png_compression(socket,
+                    GUAC_PROTOCOL_PNG_DEFAULT, GUAC_PROTOCOL_PNG_DEFAULT,
+                    GUAC_PROTOCOL_PNG_DEFAULT);
+
+    }
+
+}
+
+int guac_protocol_set_png_compression(guac_socket* socket,
+        int level, int strategy, int filters) {
+
+    /* Validate all settings before changing any */
+    if ((level != GUAC_PROTOCOL_PNG_DEFAULT
+                && (level < 0 || level > 9))
+        || (strategy != GUAC_PROTOCOL_PNG_DEFAULT
+                && (strategy < Z_DEFAULT_STRATEGY || strategy > Z_FIXED))
+        || (filters != GUAC_PROTOCOL_PNG_DEFAULT
+                && (filters & ~PNG_ALL_FILTERS) != 0)) {
+        guac_error = GUAC_STATUS_BAD_ARGUMENT;
+        guac_error_message = "Invalid PNG compression setting";
+        return -1;
+    }
+
+    socket->__png_level = level;
+    socket->__png_strategy = strategy;
+    socket->__png_filters = filters;
+
+    return 0;
+
+}
+
+
+/* Argument types of the instruction schema */
+#define __GUAC_ARG_INT       'i' /* int */
+#define __GUAC_ARG_BOOL      'b' /* int, sent as 0 or 1 */
+#define __GUAC_ARG_LAYER     'l' /* const guac_layer*, sent as its index */
+#define __GUAC_ARG_TIMESTAMP 't' /* guac_timestamp */
+#define __GUAC_ARG_DOUBLE    'd' /* double */
+#define __GUAC_ARG_STRING    's' /* const char* */
+#define __GUAC_ARG_STRINGS   'v' /* NULL-terminated const char**, one per arg */
+#define __GUAC_ARG_BASE64    'B' /* const char* and ssize_t, sent as base64 */
+#define __GUAC_ARG_PNG       'P' /* cairo_surface_t*, sent as base64 PNG */
+
+/**
+ * The definition of the instructions having a particular opcode, as used to
+ * encode and decode those instructions.
+ */
+typedef struct __guac_instruction_schema {
+
+    /**
+     * The opcode, as it appears within an instruction.
+     */
+    const char* opcode;
+
+    /**
+     * The opcode, encoded as the first element of an instruction.
+     */
+    const char* prefix;
+
+    /**
+     * The length of prefix, in bytes.
+     */
+    int prefix_length;
+
+    /**
+     * The type of each argument, in order, one __GUAC_ARG_* character per
+     * argument.
+     */
+    const char* args;
+
+} __guac_instruction_schema;
+
+#define __GUAC_SCHEMA(opcode, prefix, args) \
+    { opcode, prefix, sizeof(prefix) - 1, args }
+
+/* Schema of all opcodes, indexed by guac_opcode */
+static const __guac_instruction_schema
+    __guac_instruction_schemas[GUAC_OPCODE_COUNT] = {
+
+    [GUAC_OPCODE_UNKNOWN]    = __GUAC_SCHEMA("",           "",             ""),
+    [GUAC_OPCODE_ARC]        = __GUAC_SCHEMA("arc",        "3.arc",        "liiiddb"),
+    [GUAC_OPCODE_ARGS]       = __GUAC_SCHEMA("args",       "4.args",       "v"),
+    [GUAC_OPCODE_CFILL]      = __GUAC_SCHEMA("cfill",      "5.cfill",      "iliiii"),
+    [GUAC_OPCODE_CLIP]       = __GUAC_SCHEMA("clip",       "4.clip",       "l"),
+    [GUAC_OPCODE_CLIPBOARD]  = __GUAC_SCHEMA("clipboard",  "9.clipboard",  "B"),
+    [GUAC_OPCODE_CLOSE]      = __GUAC_SCHEMA("close",      "5.close",      "l"),
+    [GUAC_OPCODE_CONNECT]    = __GUAC_SCHEMA("connect",    "7.connect",    "v"),
+    [GUAC_OPCODE_COPY]       = __GUAC_SCHEMA("copy",       "4.copy",       "liiiiilii"),
+    [GUAC_OPCODE_CSTROKE]    = __GUAC_SCHEMA("cstroke",    "7.cstroke",    "iliiiiiii"),
+    [GUAC_OPCODE_CURSOR]     = __GUAC_SCHEMA("cursor",     "6.cursor",     "iiliiii"),
+    [GUAC_OPCODE_CURVE]      = __GUAC_SCHEMA("curve",      "5.curve",      "liiiiii"),
+    [GUAC_OPCODE_DISCONNECT] = __GUAC_SCHEMA("disconnect", "10.disconnect", ""),
+    [GUAC_OPCODE_DISPOSE]    = __GUAC_SCHEMA("dispose",    "7.dispose",    "l"),
+    [GUAC_OPCODE_DISTORT]    = __GUAC_SCHEMA("distort",    "7.distort",    "ldddddd"),
+    [GUAC_OPCODE_ERROR]      = __GUAC_SCHEMA("error",      "5.error",      "s"),
+    [GUAC_OPCODE_IDENTITY]   = __GUAC_SCHEMA("identity",   "8.identity",   "l"),
+    [GUAC_OPCODE_IMESTATE]   = __GUAC_SCHEMA("imestate",   "8.imestate",   "ii"),
+    [GUAC_OPCODE_KEY]        = __GUAC_SCHEMA("key",        "3.key",        "ib"),
+    [GUAC_OPCODE_LFILL]      = __GUAC_SCHEMA("lfill",      "5.lfill",      "ill"),
+    [GUAC_OPCODE_LINE]       = __GUAC_SCHEMA("line",       "4.line",       "lii"),
+    [GUAC_OPCODE_LSTROKE]    = __GUAC_SCHEMA("lstroke",    "7.lstroke",    "iliiil"),
+    [GUAC_OPCODE_MOUSE]      = __GUAC_SCHEMA("mouse",      "5.mouse",      "iii"),
+    [GUAC_OPCODE_MOVE]       = __GUAC_SCHEMA("move",       "4.move",       "lliii"),
+    [GUAC_OPCODE_NAME]       = __GUAC_SCHEMA("name",       "4.name",       "s"),
+    [GUAC_OPCODE_OVDAPP]     = __GUAC_SCHEMA("ovdapp",     "6.ovdapp",     "s"),
+    [GUAC_OPCODE_PNG]        = __GUAC_SCHEMA("png",        "3.png",        "iliiP"),
+    [GUAC_OPCODE_POP]        = __GUAC_SCHEMA("pop",        "3.pop",        "l"),
+    [GUAC_OPCODE_PRINTJOB]   = __GUAC_SCHEMA("printjob",   "8.printjob",   "s"),
+    [GUAC_OPCODE_PUSH]       = __GUAC_SCHEMA("push",       "4.push",       "l"),
+    [GUAC_OPCODE_RECT]       = __GUAC_SCHEMA("rect",       "4.rect",       "liiii"),
+    [GUAC_OPCODE_RESET]      = __GUAC_SCHEMA("reset",      "5.reset",      "l"),
+    [GUAC_OPCODE_SEAMRDP]    = __GUAC_SCHEMA("seamrdp",    "7.seamrdp",    "s"),
+    [GUAC_OPCODE_SELECT]     = __GUAC_SCHEMA("select",     "6.select",     "s"),
+    [GUAC_OPCODE_SET]        = __GUAC_SCHEMA("set",        "3.set",        "lss"),
+    [GUAC_OPCODE_SHADE]      = __GUAC_SCHEMA("shade",      "5.shade",      "li"),
+    [GUAC_OPCODE_SIZE]       = __GUAC_SCHEMA("size",       "4.size",       "lii"),
+    [GUAC_OPCODE_START]      = __GUAC_SCHEMA("start",      "5.start",      "lii"),
+    [GUAC_OPCODE_SYNC]       = __GUAC_SCHEMA("sync",       "4.sync",       "t"),
+    [GUAC_OPCODE_TRANSFER]   = __GUAC_SCHEMA("transfer",   "8.transfer",   "liiiiilii"),
+    [GUAC_OPCODE_TRANSFORM]  = __GUAC_SCHEMA("transform",  "9.transform",  "ldddddd"),
+    [GUAC_OPCODE_UKBRDR]     = __GUAC_SCHEMA("ukbrdr",     "6.ukbrdr",     "s")
+
+};
+
+/* Perfect hash table of all opcodes, indexed by __GUAC_OPCODE_HASH() of the
+ * opcode. No two opcodes share the same hash, thus any opcode whose hash
+ * does not lead to an identical opcode is unknown. This table must be
+ * regenerated if opcodes are added. */
+#define __GUAC_OPCODE_HASH(opcode, length)                                   \
+    (((length) + 5 * (opcode)[0] + 3 * (opcode)[(length) - 1]               \
+        + 8 * (opcode)[1]) & 0x7F)
+
+static const unsigned char __guac_opcode_hash_table[128] = {
+    [  3] = GUAC_OPCODE_CLOSE,
+    [  4] = GUAC_OPCODE_CLIPBOARD,
+    [ 20] = GUAC_OPCODE_PUSH,
+    [ 21] = GUAC_OPCODE_LFILL,
+    [ 23] = GUAC_OPCODE_LINE,
+    [ 31] = GUAC_OPCODE_DISTORT,
+    [ 32] = GUAC_OPCODE_IDENTITY,
+    [ 33] = GUAC_OPCODE_ARC,
+    [ 34] = GUAC_OPCODE_DISCONNECT,
+    [ 35] = GUAC_OPCODE_CLIP,
+    [ 36] = GUAC_OPCODE_TRANSFORM,
+    [ 44] = GUAC_OPCODE_IMESTATE,
+    [ 45] = GUAC_OPCODE_KEY,
+    [ 49] = GUAC_OPCODE_OVDAPP,
+    [ 50] = GUAC_OPCODE_TRANSFER,
+    [ 51] = GUAC_OPCODE_SHADE,
+    [ 52] = GUAC_OPCODE_SYNC,
+    [ 58] = GUAC_OPCODE_SIZE,
+    [ 61] = GUAC_OPCODE_CSTROKE,
+    [ 62] = GUAC_OPCODE_SEAMRDP,
+    [ 64] = GUAC_OPCODE_START,
+    [ 66] = GUAC_OPCODE_RECT,
+    [ 67] = GUAC_OPCODE_RESET,
+    [ 70] = GUAC_OPCODE_SET,
+    [ 73] = GUAC_OPCODE_SELECT,
+    [ 74] = GUAC_OPCODE_CONNECT,
+    [ 75] = GUAC_OPCODE_CURVE,
+    [ 76] = GUAC_OPCODE_MOVE,
+    [ 77] = GUAC_OPCODE_MOUSE,
+    [ 82] = GUAC_OPCODE_ARGS,
+    [ 86] = GUAC_OPCODE_COPY,
+    [ 88] = GUAC_OPCODE_PNG,
+    [ 97] = GUAC_OPCODE_NAME,
+    [100] = GUAC_OPCODE_ERROR,
+    [104] = GUAC_OPCODE_CFILL,
+    [106] = GUAC_OPCODE_LSTROKE,
+    [110] = GUAC_OPCODE_PRINTJOB,
+    [114] = GUAC_OPCODE_DISPOSE,
+    [115] = GUAC_OPCODE_CURSOR,
+    [123] = GUAC_OPCODE_POP,
+    [125] = GUAC_OPCODE_UKBRDR
+};
+
+guac_opcode guac_protocol_opcode_lookup(const char* opcode, int length) {
+
+    guac_opcode candidate;
+
+    /* All opcodes are at least two characters long */
+    if (length < 2)
+        return GUAC_OPCODE_UNKNOWN;
+
+    /* Verify the only opcode with the same hash is identical */
+    candidate = __guac_opcode_hash_table[
+        __GUAC_OPCODE_HASH((const unsigned char*) opcode, length)];
+
+    if (candidate != GUAC_OPCODE_UNKNOWN
+            && strncmp(__guac_instruction_schemas[candidate].opcode, opcode, length) == 0
+            && __guac_instruction_schemas[candidate].opcode[length] == '\0')
+        return candidate;
+
+    return GUAC_OPCODE_UNKNOWN;
+
+}
+
+const char* guac_protocol_opcode_name(guac_opcode opcode) {
+
+    if (opcode < 0 || opcode >= GUAC_OPCODE_COUNT)
+        return __guac_instruction_schemas[GUAC_OPCODE_UNKNOWN].opcode;
+
+    return __guac_instruction_schemas[opcode].opcode;
+
+}
+
+guac_opcode guac_instruction_get_opcode(const guac_instruction* instruction) {
+
+    guac_opcode opcode = instruction->opcode_id;
+
+    /* Trust opcode_id only if it matches the opcode */
+    if (opcode > GUAC_OPCODE_UNKNOWN && opcode < GUAC_OPCODE_COUNT
+            && strcmp(__guac_instruction_schemas[opcode].opcode,
+                instruction->opcode) == 0)
+        return opcode;
+
+    return guac_protocol_opcode_lookup(instruction->opcode,
+            strlen(instruction->opcode));
+
+}
 
-    /* Set up PNG writer */
-    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png) {
-        guac_error = GUAC_STATUS_OUTPUT_ERROR;
-        guac_error_message = "libpng failed to create write structure";
-        return -1;
-    }
+/* Parses the given integer argument, returning non-zero if invalid */
+int __guac_parse_arg_int(const char* str, int64_t* value) {
 
-    png_info = png_create_info_struct(png);
-    if (!png_info) {
-        png_destroy_write_struct(&png, NULL);
-        guac_error = GUAC_STATUS_OUTPUT_ERROR;
-        guac_error_message = "libpng failed to create info structure";
-        return -1;
-    }
+    int negative = 0;
+    uint64_t magnitude = 0;
 
-    /* Set error handler */
-    if (setjmp(png_jmpbuf(png))) {
-        png_destroy_write_struct(&png, &png_info);
-        guac_error = GUAC_STATUS_OUTPUT_ERROR;
-        guac_error_message = "libpng output error";
-        return -1;
+    if (*str == '-') {
+        negative = 1;
+        str++;
     }
 
-    /* Set up buffer structure */
-    png_data.socket = socket;
-    png_data.buffer_size = 8192;
-    png_data.buffer = malloc(png_data.buffer_size);
-    png_data.data_size = 0;
+    /* At least one digit is required */
+    if (*str == '\0')
+        return -1;
 
-    /* Set up writer */
-    png_set_write_fn(png, &png_data,
-            __guac_socket_write_png,
-            __guac_socket_flush_png);
+    for (; *str != '\0'; str++) {
 
-    /* Copy data from surface into PNG data */
-    png_rows = (png_byte**) malloc(sizeof(png_byte*) * height);
-    for (y=0; y<height; y++) {
+        if (*str < '0' || *str > '9')
+            return -1;
 
-        /* Allocate new PNG row */
-        png_byte* row = (png_byte*) malloc(sizeof(png_byte) * width);
-        png_rows[y] = row;
+        magnitude = magnitude * 10 + (*str - '0');
 
-        /* Copy data from surface into current row */
-        for (x=0; x<width; x++) {
+    }
 
-            /* Get pixel color */
-            int color = ((uint32_t*) data)[x] & 0xFFFFFF;
+    *value = negative ? -((int64_t) magnitude) : (int64_t) magnitude;
+    return 0;
 
-            /* Set index in row */
-            row[x] = guac_palette_find(palette, color);
+}
 
-        }
+int guac_instruction_decode(const guac_instruction* instruction,
+        guac_instruction_arg* args) {
 
-        /* Advance to next data row */
-        data += stride;
+    const char* type;
+    int i = 0;
 
+    /* Only opcodes having a schema can be decoded */
+    guac_opcode opcode = guac_instruction_get_opcode(instruction);
+    if (opcode == GUAC_OPCODE_UNKNOWN) {
+        guac_error = GUAC_STATUS_BAD_ARGUMENT;
+        guac_error_message = "Instruction opcode has no defined arguments";
+        return -1;
     }
 
-    /* Write image info */
-    png_set_IHDR(
-        png,
-        png_info,
-        width,
-        height,
-        bpp,
-        PNG_COLOR_TYPE_PALETTE,
-        PNG_INTERLACE_NONE,
-        PNG_COMPRESSION_TYPE_DEFAULT,
-        PNG_FILTER_TYPE_DEFAULT
-    );
-
-    /* Write palette */
-    png_set_PLTE(png, png_info, palette->colors, palette->size);
+    for (type = __guac_instruction_schemas[opcode].args;
+            *type != '\0'; type++, i++) {
 
-    /* Write image */
-    png_set_rows(png, png_info, png_rows);
-    png_write_png(png, png_info, PNG_TRANSFORM_PACKING, NULL);
+        const char* value;
+        char* end;
 
-    /* Finish write */
-    png_destroy_write_struct(&png, &png_info);
+        /* Remaining arguments are all strings, if any */
+        if (*type == __GUAC_ARG_STRINGS) {
+            for (; i < instruction->argc; i++)
+                args[i].string = instruction->argv[i];
+            return 0;
+        }
 
-    /* Free palette */
-    guac_palette_free(palette);
+        if (i >= instruction->argc) {
+            guac_error = GUAC_STATUS_BAD_ARGUMENT;
+            guac_error_message = "Instruction has too few arguments";
+            return -1;
+        }
 
-    /* Free PNG data */
-    for (y=0; y<height; y++)
-        free(png_rows[y]);
-    free(png_rows);
+        value = instruction->argv[i];
+
+        switch (*type) {
+
+            case __GUAC_ARG_INT:
+            case __GUAC_ARG_BOOL:
+            case __GUAC_ARG_LAYER:
+            case __GUAC_ARG_TIMESTAMP:
+                if (__guac_parse_arg_int(value, &(args[i].integer))) {
+                    guac_error = GUAC_STATUS_BAD_ARGUMENT;
+                    guac_error_message = "Invalid integer argument";
+                    return -1;
+                }
+                break;
+
+            case __GUAC_ARG_DOUBLE:
+                args[i].number = strtod(value, &end);
+                if (end == value || *end != '\0') {
+                    guac_error = GUAC_STATUS_BAD_ARGUMENT;
+                    guac_error_message = "Invalid numeric argument";
+                    return -1;
+                }
+                break;
+
+            /* Strings, including base64 data, are passed through */
+            default:
+                args[i].string = value;
 
-    base64_length = (png_data.data_size + 2) / 3 * 4;
+        }
 
-    /* Write length and data */
-    if (
-           guac_socket_write_int(socket, base64_length)
-        || guac_socket_write_string(socket, ".")
-        || guac_socket_write_base64(socket, png_data.buffer, png_data.data_size)
-        || guac_socket_flush_base64(socket)) {
-        free(png_data.buffer);
-        return -1;
     }
 
-    free(png_data.buffer);
     return 0;
 
 }
@@ -372,232 +1158,319 @@ int __guac_socket_write_length_png(guac_socket* socket, cairo_surface_t* surface
 int __guac_fill_instructionbuf(guac_socket* socket) {
 
     int retval;
-    
-    /* Attempt to fill buffer */
-    retval = recv(
-        socket->fd,
-        socket->__instructionbuf + socket->__instructionbuf_used_length,
-        socket->__instructionbuf_size - socket->__instructionbuf_used_length,
-        0
-    );
+    char* buffer;
+
+    /* Make room for data, discarding instructions already read */
+    int available = guac_parser_reserve(socket->__parser,
+            GUAC_SOCKET_INPUT_MIN_READ, &buffer);
+
+    /* Error, guac_error already set */
+    if (available < 0)
+        return -1;
+
+    /* Read as much as the buffer can hold */
+    retval = socket->read_handler(socket, buffer, available);
 
-    /* Set guac_error if recv() unsuccessful */
+    __GUAC_STAT_ADD(socket->__stats.read_calls, 1);
+
+    /* Set guac_error if read unsuccessful */
     if (retval < 0) {
-        guac_error = GUAC_STATUS_SEE_ERRNO;
-        guac_error_message = "Error filling instruction buffer";
-        return retval;
-    }
 
-    socket->__instructionbuf_used_length += retval;
+        /* Non-blocking sockets may have no data despite select() */
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            guac_error = GUAC_STATUS_INPUT_TIMEOUT;
+            guac_error_message = "No data available on non-blocking socket";
+        }
 
-    /* Expand buffer if necessary */
-    if (socket->__instructionbuf_used_length >
-            socket->__instructionbuf_size / 2) {
+        else {
+            guac_error = GUAC_STATUS_SEE_ERRNO;
+            guac_error_message = "Error filling instruction buffer";
+        }
 
-        socket->__instructionbuf_size *= 2;
-        socket->__instructionbuf = realloc(socket->__instructionbuf,
-                socket->__instructionbuf_size);
+        return retval;
     }
 
+    guac_parser_commit(socket->__parser, retval);
+    __GUAC_STAT_ADD(socket->__stats.bytes_read, retval);
+
     return retval;
 
 }
 
 
-/* Returns new instruction if one exists, or NULL if no more instructions. */
-guac_instruction* guac_protocol_read_instruction(guac_socket* socket,
-        int usec_timeout) {
+/* Waits for and reads more data into the instruction buffer, returning
+ * positive if data was read, zero if the timeout elapsed, or negative on
+ * error (including end of stream). */
+int __guac_read_instructionbuf(guac_socket* socket, int usec_timeout) {
 
     int retval;
-   
-    /* Loop until a instruction is read */
-    for (;;) {
 
-        /* Length of element */
-        int element_length = 0;
+    /* Wait for data */
+    retval = guac_socket_select(socket, usec_timeout);
+    if (retval <= 0)
+        return retval;
 
-        /* Position within buffer */
-        int i = socket->__instructionbuf_parse_start;
+    /* If more data is available, fill into buffer */
+    retval = __guac_fill_instructionbuf(socket);
 
-        /* Parse instruction in buffer */
-        while (i < socket->__instructionbuf_used_length) {
+    /* Error, guac_error already set */
+    if (retval < 0)
+        return -1;
 
-            /* Read character from buffer */
-            char c = socket->__instructionbuf[i++];
+    /* EOF */
+    if (retval == 0) {
+        guac_error = GUAC_STATUS_NO_INPUT;
+        guac_error_message = "End of stream reached while reading instruction";
+        return -1;
+    }
 
-            /* If digit, calculate element length */
-            if (c >= '0' && c <= '9')
-                element_length = element_length * 10 + c - '0';
+    return retval;
 
-            /* Otherwise, if end of length */
-            else if (c == '.') {
-
-                /* Verify element is fully read */
-                if (i + element_length < socket->__instructionbuf_used_length) {
+}
 
-                    /* Get element value */
-                    char* elementv = &(socket->__instructionbuf[i]);
-                   
-                    /* Get terminator, set null terminator of elementv */ 
-                    char terminator = elementv[element_length];
-                    elementv[element_length] = '\0';
+/* Parses the next instruction from data already read, as with
+ * guac_parser_next(), updating the statistics of the socket */
+int __guac_parse_instruction(guac_socket* socket,
+        guac_instruction* instruction) {
 
-                    /* Move to char after terminator of element */
-                    i += element_length+1;
+    int retval = guac_parser_next(socket->__parser, instruction);
 
-                    /* Reset element length */
-                    element_length = 0;
+    if (retval > 0)
+        __GUAC_STAT_ADD(socket->__stats.instructions_read, 1);
 
-                    /* As element has been read successfully, update
-                     * parse start */
-                    socket->__instructionbuf_parse_start = i;
+    return retval;
 
-                    /* Save element */
-                    socket->__instructionbuf_elementv[socket->__instructionbuf_elementc++] = elementv;
+}
 
-                    /* Finish parse if terminator is a semicolon */
-                    if (terminator == ';') {
+int guac_protocol_read_instruction_view(guac_socket* socket,
+        int usec_timeout, guac_instruction* instruction) {
 
-                        guac_instruction* parsed_instruction;
-                        int j;
+    int retval;
 
-                        /* Allocate instruction */
-                        parsed_instruction = malloc(sizeof(guac_instruction));
-                        if (parsed_instruction == NULL) {
-                            guac_error = GUAC_STATUS_NO_MEMORY;
-                            guac_error_message = "Could not allocate memory for parsed instruction";
-                            return NULL;
-                        }
+    /* Loop until a instruction is read */
+    for (;;) {
 
-                        /* Init parsed instruction */
-                        parsed_instruction->argc = socket->__instructionbuf_elementc - 1;
-                        parsed_instruction->argv = malloc(sizeof(char*) * parsed_instruction->argc);
+        retval = __guac_parse_instruction(socket, instruction);
+        if (retval > 0)
+            return 0;
 
-                        /* Fail if memory could not be alloc'd for argv */
-                        if (parsed_instruction->argv == NULL) {
-                            guac_error = GUAC_STATUS_NO_MEMORY;
-                            guac_error_message = "Could not allocate memory for arguments of parsed instruction";
-                            free(parsed_instruction);
-                            return NULL;
-                        }
+        if (retval < 0)
+            return -1;
 
-                        /* Set opcode */
-                        parsed_instruction->opcode = strdup(socket->__instructionbuf_elementv[0]);
+        /* No instruction yet? Get more data ... */
+        if (__guac_read_instructionbuf(socket, usec_timeout) <= 0)
+            return -1;
 
-                        /* Fail if memory could not be alloc'd for opcode */
-                        if (parsed_instruction->opcode == NULL) {
-                            guac_error = GUAC_STATUS_NO_MEMORY;
-                            guac_error_message = "Could not allocate memory for opcode of parsed instruction";
-                            free(parsed_instruction->argv);
-                            free(parsed_instruction);
-                            return NULL;
-                        }
+    }
 
+}
 
-                        /* Copy element values to parsed instruction */
-                        for (j=0; j<parsed_instruction->argc; j++) {
-                            parsed_instruction->argv[j] = strdup(socket->__instructionbuf_elementv[j+1]);
+/* Parses as many as the given number of instructions from data already in the
+ * instruction buffer, returning the number of instructions parsed, or
+ * negative if an error occurs before any instruction is parsed. */
+int __guac_parse_instructions(guac_socket* socket,
+        guac_instruction* instructions, int max) {
 
-                            /* Free memory and fail if out of mem */
-                            if (parsed_instruction->argv[j] == NULL) {
-                                guac_error = GUAC_STATUS_NO_MEMORY;
-                                guac_error_message = "Could not allocate memory for single argument of parsed instruction";
+    int count = 0;
+    int argc = 0;
+    int i;
 
-                                /* Free all alloc'd argv values */
-                                while (--j >= 0)
-                                    free(parsed_instruction->argv[j]);
+    while (count < max) {
 
-                                free(parsed_instruction->opcode);
-                                free(parsed_instruction->argv);
-                                free(parsed_instruction);
-                                return NULL;
-                            }
+        guac_instruction* instruction = &(instructions[count]);
+        int retval;
 
-                        }
+        /* Grow argument pool before parsing, such that an instruction is
+         * never consumed without room for its arguments */
+        int required = argc + GUAC_INSTRUCTION_MAX_ELEMENTS - 1;
+        if (required > socket->__instructionbuf_argv_size) {
 
-                        /* Reset buffer */
-                        memmove(socket->__instructionbuf, socket->__instructionbuf + i, socket->__instructionbuf_used_length - i);
-                        socket->__instructionbuf_used_length -= i;
-                        socket->__instructionbuf_parse_start = 0;
-                        socket->__instructionbuf_elementc = 0;
-
-                        /* Done */
-                        return parsed_instruction;
-
-                    } /* end if terminator */
-
-                    /* Error if expected comma is not present */
-                    else if (terminator != ',') {
-                        guac_error = GUAC_STATUS_BAD_ARGUMENT;
-                        guac_error_message = "Element terminator of instructioni was not ';' nor ','";
-                        return NULL;
-                    }
-
-                } /* end if element fully read */
-
-                /* Otherwise, read more data */
-                else
-                    break;
+            int size = socket->__instructionbuf_argv_size * 2;
+            char** argv;
 
-            }
+            if (size < required)
+                size = required;
 
-            /* Error if length is non-numeric or does not end in a period */
-            else {
-                guac_error = GUAC_STATUS_BAD_ARGUMENT;
-                guac_error_message = "Non-numeric character in element length";
-                return NULL;
+            argv = realloc(socket->__instructionbuf_argv,
+                    sizeof(char*) * size);
+
+            /* Return instructions already parsed, if any, leaving the
+             * error to recur upon the next read */
+            if (argv == NULL) {
+                guac_error = GUAC_STATUS_NO_MEMORY;
+                guac_error_message = "Could not allocate memory for arguments of instructions";
+                if (count == 0)
+                    return -1;
+                break;
             }
 
+            socket->__instructionbuf_argv = argv;
+            socket->__instructionbuf_argv_size = size;
+
         }
 
-        /* No instruction yet? Get more data ... */
-        retval = guac_socket_select(socket, usec_timeout);
+        /* Parse next instruction. If parsing fails after other
+         * instructions were parsed, those are returned first, with the
+         * error recurring upon the next read */
+        retval = __guac_parse_instruction(socket, instruction);
+        if (retval < 0 && count == 0)
+            return -1;
+
         if (retval <= 0)
-            return NULL;
+            break;
 
-        /* If more data is available, fill into buffer */
-        retval = __guac_fill_instructionbuf(socket);
+        /* Copy arguments into pool, as elements are reused by next parse */
+        memcpy(socket->__instructionbuf_argv + argc, instruction->argv,
+                sizeof(char*) * instruction->argc);
 
-        /* Error, guac_error already set */
-        if (retval < 0)
-            return NULL;
+        argc += instruction->argc;
+        count++;
 
-        /* EOF */
-        if (retval == 0) {
-            guac_error = GUAC_STATUS_NO_INPUT;
-            guac_error_message = "End of stream reached while reading instruction";
-            return NULL;
-        }
+    }
+
+    /* Point each instruction at its arguments only now that the pool can no
+     * longer move */
+    argc = 0;
+    for (i=0; i<count; i++) {
+        instructions[i].argv = socket->__instructionbuf_argv + argc;
+        argc += instructions[i].argc;
+    }
+
+    return count;
+
+}
 
+int guac_protocol_read_instructions(guac_socket* socket,
+        guac_instruction* instructions, int max, int usec_timeout) {
+
+    int count;
+    int retval;
+
+    /* Return everything already buffered without waiting */
+    count = __guac_parse_instructions(socket, instructions, max);
+    if (count != 0)
+        return count;
+
+    /* Otherwise, wait for and read whatever is available, once */
+    retval = __guac_read_instructionbuf(socket, usec_timeout);
+    if (retval <= 0)
+        return retval;
+
+    count = __guac_parse_instructions(socket, instructions, max);
+
+    /* Data read may not have completed any instruction */
+    if (count == 0) {
+        guac_error = GUAC_STATUS_INPUT_TIMEOUT;
+        guac_error_message = "Instruction not yet completely read";
     }
 
+    return count;
+
+}
+
+
+/* Returns new instruction if one exists, or NULL if no more instructions. */
+guac_instruction* guac_protocol_read_instruction(guac_socket* socket,
+        int usec_timeout) {
+
+    guac_instruction view;
+
+    /* Read instruction, copying only once complete */
+    if (guac_protocol_read_instruction_view(socket, usec_timeout, &view))
+        return NULL;
+
+    return guac_instruction_copy(&view);
+
 }
 
 
 guac_instruction* guac_protocol_expect_instruction(guac_socket* socket, int usec_timeout,
         const char* opcode) {
 
-    guac_instruction* instruction;
+    guac_instruction view;
 
     /* Wait for data until timeout */
     if (guac_protocol_instructions_waiting(socket, usec_timeout) <= 0)
         return NULL;
 
     /* Read available instruction */
-    instruction = guac_protocol_read_instruction(socket, usec_timeout);
-    if (instruction == NULL)
-        return NULL;            
+    if (guac_protocol_read_instruction_view(socket, usec_timeout, &view))
+        return NULL;
 
     /* Validate instruction */
-    if (strcmp(instruction->opcode, opcode) != 0) {
+    if (strcmp(view.opcode, opcode) != 0) {
         guac_error = GUAC_STATUS_BAD_STATE;
         guac_error_message = "Instruction read did not have expected opcode";
-        guac_instruction_free(instruction);
         return NULL;
     }
 
-    /* Return instruction if valid */
-    return instruction;
+    /* Return copy of instruction if valid */
+    return guac_instruction_copy(&view);
+
+}
+
+
+guac_instruction* guac_instruction_copy(const guac_instruction* instruction) {
+
+    guac_instruction* copy;
+    int i;
+
+    /* Allocate instruction */
+    copy = malloc(sizeof(guac_instruction));
+    if (copy == NULL) {
+        guac_error = GUAC_STATUS_NO_MEMORY;
+        guac_error_message = "Could not allocate memory for copy of instruction";
+        return NULL;
+    }
+
+    /* Init copy */
+    copy->opcode_id = instruction->opcode_id;
+    copy->argc = instruction->argc;
+    copy->argv = malloc(sizeof(char*) * copy->argc);
+
+    /* Fail if memory could not be alloc'd for argv */
+    if (copy->argv == NULL && copy->argc > 0) {
+        guac_error = GUAC_STATUS_NO_MEMORY;
+        guac_error_message = "Could not allocate memory for arguments of copy of instruction";
+        free(copy);
+        return NULL;
+    }
+
+    /* Copy opcode */
+    copy->opcode = strdup(instruction->opcode);
+
+    /* Fail if memory could not be alloc'd for opcode */
+    if (copy->opcode == NULL) {
+        guac_error = GUAC_STATUS_NO_MEMORY;
+        guac_error_message = "Could not allocate memory for opcode of copy of instruction";
+        free(copy->argv);
+        free(copy);
+        return NULL;
+    }
+
+    /* Copy argument values */
+    for (i=0; i<copy->argc; i++) {
+
+        copy->argv[i] = strdup(instruction->argv[i]);
+
+        /* Free memory and fail if out of mem */
+        if (copy->argv[i] == NULL) {
+            guac_error = GUAC_STATUS_NO_MEMORY;
+            guac_error_message = "Could not allocate memory for single argument of copy of instruction";
+
+            /* Free all alloc'd argv values */
+            while (--i >= 0)
+                free(copy->argv[i]);
+
+            free(copy->opcode);
+            free(copy->argv);
+            free(copy);
+            return NULL;
+        }
+
+    }
+
+    return copy;
 
 }
 
@@ -629,7 +1502,8 @@ void guac_instruction_free(guac_instruction* instruction) {
 
 int guac_protocol_instructions_waiting(guac_socket* socket, int usec_timeout) {
 
-    if (socket->__instructionbuf_used_length > 0)
+    /* Data following the last instruction read is already waiting */
+    if (guac_parser_buffered(socket->__parser) > 0)
         return 1;
 
     return guac_socket_select(socket, usec_timeout);
@@ -665,154 +1539,157 @@ guac_timestamp guac_protocol_get_timestamp() {
 
 /* Protocol functions */
 
-int guac_protocol_send_args(guac_socket* socket, const char** args) {
+/* Writes an instruction with the given opcode, with arguments of the types
+ * defined by the schema of that opcode */
+int __guac_protocol_send_instruction(guac_socket* socket,
+        guac_opcode opcode, ...) {
 
-    int i;
+    const __guac_instruction_schema* schema =
+        &(__guac_instruction_schemas[opcode]);
 
-    if (guac_socket_write_string(socket, "4.args")) return -1;
+    const char* type;
+    int retval;
+    va_list args;
 
-    for (i=0; args[i] != NULL; i++) {
+    /* The layer most recently written, which any image is drawn to */
+    const guac_layer* layer = NULL;
 
-        if (guac_socket_write_string(socket, ","))
-            return -1;
+    guac_socket_instruction_begin(socket, opcode);
 
-        if (__guac_socket_write_length_string(socket, args[i]))
-            return -1;
+    va_start(args, opcode);
 
-    }
+    retval = guac_socket_write(socket, schema->prefix, schema->prefix_length);
 
-    return guac_socket_write_string(socket, ";");
+    for (type = schema->args; *type != '\0' && !retval; type++) {
 
-}
+        switch (*type) {
 
+            case __GUAC_ARG_INT:
+                retval = __guac_socket_write_element_int(socket, ',',
+                        va_arg(args, int));
+                break;
 
-int guac_protocol_send_arc(guac_socket* socket, const guac_layer* layer,
-        int x, int y, int radius, double startAngle, double endAngle,
-        int negative) {
+            case __GUAC_ARG_BOOL:
+                retval = guac_socket_write(socket,
+                        va_arg(args, int) ? ",1.1" : ",1.0", 4);
+                break;
 
-    return
-           guac_socket_write_string(socket, "3.arc,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, x)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, y)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, radius)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_double(socket, startAngle)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_double(socket, endAngle)
-        || guac_socket_write_string(socket, ",")
-        || guac_socket_write_string(socket, negative ? "1.1" : "1.0")
-        || guac_socket_write_string(socket, ";");
+            case __GUAC_ARG_LAYER:
+                layer = va_arg(args, const guac_layer*);
+                retval = __guac_socket_write_element_int(socket, ',',
+                        layer->index);
+                break;
 
-}
+            case __GUAC_ARG_TIMESTAMP:
+                retval = __guac_socket_write_element_int(socket, ',',
+                        va_arg(args, guac_timestamp));
+                break;
 
+            case __GUAC_ARG_DOUBLE:
+                retval = __guac_socket_write_element_double(socket, ',',
+                        va_arg(args, double));
+                break;
 
-int guac_protocol_send_cfill(guac_socket* socket,
-        guac_composite_mode mode, const guac_layer* layer,
-        int r, int g, int b, int a) {
+            case __GUAC_ARG_STRING: {
+                const char* value = va_arg(args, const char*);
+                retval = __guac_socket_write_element(socket, ',',
+                        value, strlen(value));
+                break;
+            }
 
-    return
-           guac_socket_write_string(socket, "5.cfill,")
-        || __guac_socket_write_length_int(socket, mode)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, r)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, g)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, b)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, a)
-        || guac_socket_write_string(socket, ";");
+            case __GUAC_ARG_STRINGS: {
+                const char** values = va_arg(args, const char**);
+                for (; *values != NULL && !retval; values++)
+                    retval = __guac_socket_write_element(socket, ',',
+                            *values, strlen(*values));
+                break;
+            }
 
-}
+            case __GUAC_ARG_BASE64: {
+                const char* data = va_arg(args, const char*);
+                ssize_t size = va_arg(args, ssize_t);
+                retval =
+                       guac_socket_write(socket, ",", 1)
+                    || guac_socket_write_int(socket, (size + 2) / 3 * 4)
+                    || guac_socket_write(socket, ".", 1)
+                    || guac_socket_write_base64(socket, data, size)
+                    || guac_socket_flush_base64(socket);
+                break;
+            }
 
+            case __GUAC_ARG_PNG:
+                retval =
+                       guac_socket_write(socket, ",", 1)
+                    || __guac_socket_write_length_png(socket, layer,
+                            va_arg(args, cairo_surface_t*));
+                break;
 
-int guac_protocol_send_close(guac_socket* socket, const guac_layer* layer) {
+        }
 
-    return
-           guac_socket_write_string(socket, "5.close,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ";");
+    }
 
-}
+    va_end(args);
 
+    retval = retval || guac_socket_write(socket, ";", 1);
 
-int guac_protocol_send_connect(guac_socket* socket, const char** args) {
+    /* Submit only complete instructions */
+    if (retval) {
+        guac_socket_instruction_abort(socket);
+        return retval;
+    }
 
-    int i;
+    return guac_socket_instruction_end(socket);
 
-    if (guac_socket_write_string(socket, "7.connect")) return -1;
+}
 
-    for (i=0; args[i] != NULL; i++) {
 
-        if (guac_socket_write_string(socket, ","))
-            return -1;
+int guac_protocol_send_args(guac_socket* socket, const char** args) {
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_ARGS, args);
+}
 
-        if (__guac_socket_write_length_string(socket, args[i]))
-            return -1;
 
-    }
+int guac_protocol_send_arc(guac_socket* socket, const guac_layer* layer,
+        int x, int y, int radius, double startAngle, double endAngle,
+        int negative) {
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_ARC,
+            layer, x, y, radius, startAngle, endAngle, negative);
+}
 
-    return guac_socket_write_string(socket, ";");
 
+int guac_protocol_send_cfill(guac_socket* socket,
+        guac_composite_mode mode, const guac_layer* layer,
+        int r, int g, int b, int a) {
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_CFILL,
+            mode, layer, r, g, b, a);
 }
 
 
-int guac_protocol_send_clip(guac_socket* socket, const guac_layer* layer) {
+int guac_protocol_send_close(guac_socket* socket, const guac_layer* layer) {
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_CLOSE, layer);
+}
 
-    return
-           guac_socket_write_string(socket, "4.clip,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ";");
 
+int guac_protocol_send_connect(guac_socket* socket, const char** args) {
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_CONNECT, args);
 }
 
 
-int guac_protocol_send_clipboard(guac_socket* socket, const char* data, ssize_t size) {
-  
-    int base64_length = (size + 2) / 3 * 4;
+int guac_protocol_send_clip(guac_socket* socket, const guac_layer* layer) {
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_CLIP, layer);
+}
 
-    return
-           guac_socket_write_string(socket, "9.clipboard,")
-        || guac_socket_write_int(socket, base64_length)
-        || guac_socket_write_string(socket, ".")
-        || guac_socket_write_base64(socket, data, size)
-        || guac_socket_flush_base64(socket)
-        || guac_socket_write_string(socket, ";");
 
+int guac_protocol_send_clipboard(guac_socket* socket, const char* data, ssize_t size) {
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_CLIPBOARD,
+            data, size);
 }
 
 
 int guac_protocol_send_copy(guac_socket* socket,
         const guac_layer* srcl, int srcx, int srcy, int w, int h,
         guac_composite_mode mode, const guac_layer* dstl, int dstx, int dsty) {
-
-    return
-           guac_socket_write_string(socket, "4.copy,")
-        || __guac_socket_write_length_int(socket, srcl->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, srcx)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, srcy)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, w)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, h)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, mode)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, dstl->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, dstx)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, dsty)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_COPY,
+            srcl, srcx, srcy, w, h, mode, dstl, dstx, dsty);
 }
 
 
@@ -820,162 +1697,67 @@ int guac_protocol_send_cstroke(guac_socket* socket,
         guac_composite_mode mode, const guac_layer* layer,
         guac_line_cap_style cap, guac_line_join_style join, int thickness,
         int r, int g, int b, int a) {
-
-    return
-           guac_socket_write_string(socket, "7.cstroke,")
-        || __guac_socket_write_length_int(socket, mode)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, cap)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, join)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, thickness)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, r)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, g)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, b)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, a)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_CSTROKE,
+            mode, layer, cap, join, thickness, r, g, b, a);
 }
 
 
 int guac_protocol_send_cursor(guac_socket* socket, int x, int y,
         const guac_layer* srcl, int srcx, int srcy, int w, int h) {
-    return
-           guac_socket_write_string(socket, "6.cursor,")
-        || __guac_socket_write_length_int(socket, x)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, y)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, srcl->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, srcx)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, srcy)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, w)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, h)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_CURSOR,
+            x, y, srcl, srcx, srcy, w, h);
 }
 
 
 int guac_protocol_send_curve(guac_socket* socket, const guac_layer* layer,
         int cp1x, int cp1y, int cp2x, int cp2y, int x, int y) {
-
-    return
-           guac_socket_write_string(socket, "5.curve,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, cp1x)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, cp1y)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, cp2x)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, cp2y)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, x)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, y)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_CURVE,
+            layer, cp1x, cp1y, cp2x, cp2y, x, y);
 }
 
 
 int guac_protocol_send_disconnect(guac_socket* socket) {
-    return guac_socket_write_string(socket, "10.disconnect;");
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_DISCONNECT);
 }
 
 
 int guac_protocol_send_dispose(guac_socket* socket, const guac_layer* layer) {
-
-    return
-           guac_socket_write_string(socket, "7.dispose,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_DISPOSE,
+            layer);
 }
 
 
 int guac_protocol_send_distort(guac_socket* socket, const guac_layer* layer,
         double a, double b, double c,
         double d, double e, double f) {
-
-    return 
-           guac_socket_write_string(socket, "7.distort,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_double(socket, a)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_double(socket, b)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_double(socket, c)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_double(socket, d)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_double(socket, e)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_double(socket, f)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_DISTORT,
+            layer, a, b, c, d, e, f);
 }
 
 
 int guac_protocol_send_error(guac_socket* socket, const char* error) {
-
-    return
-           guac_socket_write_string(socket, "5.error,")
-        || __guac_socket_write_length_string(socket, error)
-        || guac_socket_write_string(socket, ";");
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_ERROR, error);
 }
 
 
 int guac_protocol_send_identity(guac_socket* socket, const guac_layer* layer) {
-
-    return
-           guac_socket_write_string(socket, "8.identity,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_IDENTITY,
+            layer);
 }
 
 
 int guac_protocol_send_lfill(guac_socket* socket,
         guac_composite_mode mode, const guac_layer* layer,
         const guac_layer* srcl) {
-
-    return
-           guac_socket_write_string(socket, "5.lfill,")
-        || __guac_socket_write_length_int(socket, mode)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, srcl->index)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_LFILL,
+            mode, layer, srcl);
 }
 
 
 int guac_protocol_send_line(guac_socket* socket, const guac_layer* layer,
         int x, int y) {
-
-    return
-           guac_socket_write_string(socket, "4.line,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, x)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, y)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_LINE,
+            layer, x, y);
 }
 
 
@@ -983,196 +1765,92 @@ int guac_protocol_send_lstroke(guac_socket* socket,
         guac_composite_mode mode, const guac_layer* layer,
         guac_line_cap_style cap, guac_line_join_style join, int thickness,
         const guac_layer* srcl) {
-
-    return
-           guac_socket_write_string(socket, "7.lstroke,")
-        || __guac_socket_write_length_int(socket, mode)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, cap)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, join)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, thickness)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, srcl->index)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_LSTROKE,
+            mode, layer, cap, join, thickness, srcl);
 }
 
 
 int guac_protocol_send_move(guac_socket* socket, const guac_layer* layer,
         const guac_layer* parent, int x, int y, int z) {
-
-    return
-           guac_socket_write_string(socket, "4.move,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, parent->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, x)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, y)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, z)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_MOVE,
+            layer, parent, x, y, z);
 }
 
 
 int guac_protocol_send_name(guac_socket* socket, const char* name) {
-
-    return
-           guac_socket_write_string(socket, "4.name,")
-        || __guac_socket_write_length_string(socket, name)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_NAME, name);
 }
 
 
 int guac_protocol_send_png(guac_socket* socket, guac_composite_mode mode,
         const guac_layer* layer, int x, int y, cairo_surface_t* surface) {
-
-    return
-           guac_socket_write_string(socket, "3.png,")
-        || __guac_socket_write_length_int(socket, mode)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, x)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, y)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_png(socket, surface)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_PNG,
+            mode, layer, x, y, surface);
 }
 
 
 int guac_protocol_send_pop(guac_socket* socket, const guac_layer* layer) {
-
-    return
-           guac_socket_write_string(socket, "3.pop,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_POP, layer);
 }
 
 
 int guac_protocol_send_push(guac_socket* socket, const guac_layer* layer) {
-
-    return
-           guac_socket_write_string(socket, "4.push,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_PUSH, layer);
 }
 
 
 int guac_protocol_send_rect(guac_socket* socket,
         const guac_layer* layer, int x, int y, int width, int height) {
-
-    return
-           guac_socket_write_string(socket, "4.rect,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, x)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, y)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, width)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, height)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_RECT,
+            layer, x, y, width, height);
 }
 
 
 int guac_protocol_send_reset(guac_socket* socket, const guac_layer* layer) {
-
-    return
-           guac_socket_write_string(socket, "5.reset,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_RESET, layer);
 }
 
 
 int guac_protocol_send_set(guac_socket* socket, const guac_layer* layer,
         const char* name, const char* value) {
-
-    return
-           guac_socket_write_string(socket, "3.set,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_string(socket, name)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_string(socket, value)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_SET,
+            layer, name, value);
 }
 
 
 int guac_protocol_send_select(guac_socket* socket, const char* protocol) {
-
-    return
-           guac_socket_write_string(socket, "6.select,")
-        || __guac_socket_write_length_string(socket, protocol)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_SELECT,
+            protocol);
 }
 
 
 int guac_protocol_send_shade(guac_socket* socket, const guac_layer* layer,
         int a) {
-
-    return
-           guac_socket_write_string(socket, "5.shade,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, a)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_SHADE,
+            layer, a);
 }
 
 
 int guac_protocol_send_size(guac_socket* socket, const guac_layer* layer,
         int w, int h) {
-
-    return
-           guac_socket_write_string(socket, "4.size,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, w)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, h)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_SIZE,
+            layer, w, h);
 }
 
 
 int guac_protocol_send_start(guac_socket* socket, const guac_layer* layer,
         int x, int y) {
-
-    return
-           guac_socket_write_string(socket, "5.start,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, x)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, y)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_START,
+            layer, x, y);
 }
 
 
 int guac_protocol_send_sync(guac_socket* socket, guac_timestamp timestamp) {
 
-    return 
-           guac_socket_write_string(socket, "4.sync,")
-        || __guac_socket_write_length_int(socket, timestamp)
-        || guac_socket_write_string(socket, ";");
+    /* Each sync ends a frame */
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_SYNC,
+            timestamp)
+        || guac_socket_end_frame(socket);
 
 }
 
@@ -1180,69 +1858,25 @@ int guac_protocol_send_sync(guac_socket* socket, guac_timestamp timestamp) {
 int guac_protocol_send_transfer(guac_socket* socket,
         const guac_layer* srcl, int srcx, int srcy, int w, int h,
         guac_transfer_function fn, const guac_layer* dstl, int dstx, int dsty) {
-
-    return
-           guac_socket_write_string(socket, "8.transfer,")
-        || __guac_socket_write_length_int(socket, srcl->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, srcx)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, srcy)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, w)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, h)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, fn)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, dstl->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, dstx)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, dsty)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_TRANSFER,
+            srcl, srcx, srcy, w, h, fn, dstl, dstx, dsty);
 }
 
 
 int guac_protocol_send_transform(guac_socket* socket, const guac_layer* layer,
         double a, double b, double c,
         double d, double e, double f) {
-
-    return 
-           guac_socket_write_string(socket, "9.transform,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_double(socket, a)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_double(socket, b)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_double(socket, c)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_double(socket, d)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_double(socket, e)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_double(socket, f)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_TRANSFORM,
+            layer, a, b, c, d, e, f);
 }
 
 
 int guac_protocol_send_pdf_printjob_notif(guac_socket* socket, const char* name) {
-    return
-           guac_socket_write_string(socket, "8.printjob,")
-        || __guac_socket_write_length_string(socket, name)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_PRINTJOB,
+            name);
 }
 
 int guac_protocol_send_keyboard_ime_state(guac_socket* socket, int imeState, int imeConvMode) {
-    return
-           guac_socket_write_string(socket, "8.imestate,")
-        || __guac_socket_write_length_int(socket, imeState)
-        || guac_socket_write_string(socket, ",")
-        || __guac_socket_write_length_int(socket, imeConvMode)
-        || guac_socket_write_string(socket, ";");
-
+    return __guac_protocol_send_instruction(socket, GUAC_OPCODE_IMESTATE,
+            imeState, imeConvMode);
 }
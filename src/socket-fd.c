@@ -0,0 +1,170 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#ifdef HAVE_PPOLL
+/* ppoll() is a GNU extension */
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#ifdef __MINGW32__
+#include <winsock2.h>
+#else
+#include <poll.h>
+#include <sys/uio.h>
+#endif
+
+#include <time.h>
+#include <sys/time.h>
+
+#include "socket.h"
+
+/* File descriptor transport, used by guac_socket_open() */
+
+ssize_t __guac_socket_fd_read_handler(guac_socket* socket,
+        void* buf, size_t count) {
+
+#ifdef __MINGW32__
+    /* MINGW32 WINSOCK only works with recv() */
+    return recv(socket->fd, buf, count, 0);
+#else
+    return read(socket->fd, buf, count);
+#endif
+
+}
+
+ssize_t __guac_socket_fd_write_handler(guac_socket* socket,
+        const void* buf, size_t count) {
+
+#ifdef __MINGW32__
+    /* MINGW32 WINSOCK only works with send() */
+    return send(socket->fd, buf, count, 0);
+#else
+    /* Use write() for all other platforms */
+    return write(socket->fd, buf, count);
+#endif
+
+}
+
+#ifndef __MINGW32__
+ssize_t __guac_socket_fd_writev_handler(guac_socket* socket,
+        const struct iovec* iov, int iovcnt) {
+    return writev(socket->fd, iov, iovcnt);
+}
+#endif
+
+int __guac_socket_fd_wait_handler(guac_socket* socket, int event,
+        int usec_timeout) {
+
+#ifdef __MINGW32__
+    /* WINSOCK provides only select() */
+    fd_set fds;
+    struct timeval timeout;
+
+    FD_ZERO(&fds);
+    FD_SET(socket->fd, &fds);
+
+    /* No timeout if usec_timeout is negative */
+    if (usec_timeout < 0) {
+        if (event == GUAC_SOCKET_WAIT_WRITABLE)
+            return select(socket->fd + 1, NULL, &fds, NULL, NULL);
+        return select(socket->fd + 1, &fds, NULL, NULL, NULL);
+    }
+
+    /* Handle timeout if specified */
+    timeout.tv_sec = usec_timeout/1000000;
+    timeout.tv_usec = usec_timeout%1000000;
+
+    if (event == GUAC_SOCKET_WAIT_WRITABLE)
+        return select(socket->fd + 1, NULL, &fds, NULL, &timeout);
+
+    return select(socket->fd + 1, &fds, NULL, NULL, &timeout);
+#else
+    /* Unlike select(), poll() is not limited to FD_SETSIZE */
+    struct pollfd fds;
+
+    fds.fd = socket->fd;
+    fds.events = (event == GUAC_SOCKET_WAIT_WRITABLE) ? POLLOUT : POLLIN;
+    fds.revents = 0;
+
+#ifdef HAVE_PPOLL
+    /* No timeout if usec_timeout is negative */
+    if (usec_timeout < 0)
+        return ppoll(&fds, 1, NULL, NULL);
+
+    /* Otherwise, wait with nanosecond resolution */
+    {
+        struct timespec timeout;
+        timeout.tv_sec  = usec_timeout / 1000000;
+        timeout.tv_nsec = (usec_timeout % 1000000) * 1000;
+        return ppoll(&fds, 1, &timeout, NULL);
+    }
+#else
+    /* No timeout if usec_timeout is negative */
+    if (usec_timeout < 0)
+        return poll(&fds, 1, -1);
+
+    /* Round timeout up to the millisecond resolution of poll() */
+    return poll(&fds, 1, (usec_timeout + 999) / 1000);
+#endif
+#endif
+
+}
+
+guac_socket* guac_socket_open(int fd) {
+
+    /* Allocate socket, return with error if allocation fails */
+    guac_socket* socket = guac_socket_alloc();
+    if (socket == NULL)
+        return NULL;
+
+    socket->fd = fd;
+    socket->read_handler  = __guac_socket_fd_read_handler;
+    socket->write_handler = __guac_socket_fd_write_handler;
+    socket->wait_handler  = __guac_socket_fd_wait_handler;
+
+#ifndef __MINGW32__
+    socket->writev_handler = __guac_socket_fd_writev_handler;
+#endif
+
+    return socket;
+
+}
+
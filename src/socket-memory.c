@@ -0,0 +1,460 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#ifndef __MINGW32__
+#include <sys/uio.h>
+#endif
+
+#include <time.h>
+#include <sys/time.h>
+
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "socket.h"
+#include "error.h"
+
+/**
+ * The initial size of the buffer of each direction of a memory pair, in
+ * bytes.
+ */
+#define __GUAC_SOCKET_MEMORY_BUFFER_SIZE 65536
+
+/**
+ * The data flowing in one direction of a memory pair.
+ */
+typedef struct __guac_socket_memory_buffer {
+
+    /**
+     * The data written and not yet read, starting at offset.
+     */
+    char* data;
+
+    /**
+     * The offset of the first unread byte within data.
+     */
+    size_t offset;
+
+    /**
+     * The offset just after the last byte written within data.
+     */
+    size_t length;
+
+    /**
+     * The number of bytes allocated for data.
+     */
+    size_t size;
+
+} __guac_socket_memory_buffer;
+
+/**
+ * The state shared by both guac_socket objects of a memory pair.
+ */
+typedef struct __guac_socket_memory_pair {
+
+#ifdef HAVE_LIBPTHREAD
+    /**
+     * Lock guarding all other members of this structure.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Condition signalled whenever data is written or a guac_socket is
+     * closed.
+     */
+    pthread_cond_t changed;
+#endif
+
+    /**
+     * The data written by each guac_socket of the pair, indexed by the side
+     * of the writing guac_socket.
+     */
+    __guac_socket_memory_buffer buffers[2];
+
+    /**
+     * The number of guac_socket objects of the pair not yet closed.
+     */
+    int open;
+
+} __guac_socket_memory_pair;
+
+/**
+ * The transport data of each guac_socket of a memory pair.
+ */
+typedef struct __guac_socket_memory {
+
+    /**
+     * The state shared with the other guac_socket of the pair.
+     */
+    __guac_socket_memory_pair* pair;
+
+    /**
+     * The side of the pair that the guac_socket occupies, either 0 or 1.
+     */
+    int side;
+
+} __guac_socket_memory;
+
+static void __guac_socket_memory_lock(__guac_socket_memory_pair* pair) {
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_lock(&(pair->lock));
+#endif
+}
+
+static void __guac_socket_memory_unlock(__guac_socket_memory_pair* pair) {
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_unlock(&(pair->lock));
+#endif
+}
+
+/* Appends the given data to the given buffer, returning non-zero if memory
+ * could not be allocated */
+int __guac_socket_memory_append(__guac_socket_memory_buffer* buffer,
+        const void* buf, size_t count) {
+
+    /* Reclaim space already read */
+    if (buffer->offset > 0 && buffer->length + count > buffer->size) {
+        memmove(buffer->data, buffer->data + buffer->offset,
+                buffer->length - buffer->offset);
+        buffer->length -= buffer->offset;
+        buffer->offset = 0;
+    }
+
+    /* Grow if still insufficient */
+    if (buffer->length + count > buffer->size) {
+
+        size_t size = buffer->size;
+        char* data;
+
+        while (buffer->length + count > size)
+            size *= 2;
+
+        data = realloc(buffer->data, size);
+        if (data == NULL)
+            return -1;
+
+        buffer->data = data;
+        buffer->size = size;
+
+    }
+
+    memcpy(buffer->data + buffer->length, buf, count);
+    buffer->length += count;
+    return 0;
+
+}
+
+ssize_t __guac_socket_memory_read_handler(guac_socket* socket,
+        void* buf, size_t count) {
+
+    __guac_socket_memory* memory = (__guac_socket_memory*) socket->data;
+    __guac_socket_memory_pair* pair = memory->pair;
+
+    /* Read data written by other side */
+    __guac_socket_memory_buffer* buffer = &(pair->buffers[!memory->side]);
+    size_t available;
+
+    __guac_socket_memory_lock(pair);
+
+    available = buffer->length - buffer->offset;
+    if (count > available)
+        count = available;
+
+    memcpy(buf, buffer->data + buffer->offset, count);
+    buffer->offset += count;
+
+    /* Restart at beginning once everything is read */
+    if (buffer->offset == buffer->length)
+        buffer->offset = buffer->length = 0;
+
+    /* Without data, fail as a non-blocking read would, unless other side is
+     * closed (end of stream) */
+    if (count == 0 && pair->open == 2) {
+        __guac_socket_memory_unlock(pair);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    __guac_socket_memory_unlock(pair);
+    return count;
+
+}
+
+ssize_t __guac_socket_memory_write_handler(guac_socket* socket,
+        const void* buf, size_t count) {
+
+    __guac_socket_memory* memory = (__guac_socket_memory*) socket->data;
+    __guac_socket_memory_pair* pair = memory->pair;
+    int retval;
+
+    __guac_socket_memory_lock(pair);
+
+    /* Writing to a closed pair fails as a closed pipe would */
+    if (pair->open < 2) {
+        __guac_socket_memory_unlock(pair);
+        errno = EPIPE;
+        return -1;
+    }
+
+    retval = __guac_socket_memory_append(&(pair->buffers[memory->side]),
+            buf, count);
+
+#ifdef HAVE_LIBPTHREAD
+    pthread_cond_broadcast(&(pair->changed));
+#endif
+
+    __guac_socket_memory_unlock(pair);
+
+    if (retval) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return count;
+
+}
+
+#ifndef __MINGW32__
+ssize_t __guac_socket_memory_writev_handler(guac_socket* socket,
+        const struct iovec* iov, int iovcnt) {
+
+    ssize_t written = 0;
+    int i;
+
+    for (i=0; i<iovcnt; i++) {
+
+        ssize_t retval = __guac_socket_memory_write_handler(socket,
+                iov[i].iov_base, iov[i].iov_len);
+
+        if (retval < 0)
+            return retval;
+
+        written += retval;
+
+    }
+
+    return written;
+
+}
+#endif
+
+int __guac_socket_memory_wait_handler(guac_socket* socket, int event,
+        int usec_timeout) {
+
+    __guac_socket_memory* memory = (__guac_socket_memory*) socket->data;
+    __guac_socket_memory_pair* pair = memory->pair;
+    __guac_socket_memory_buffer* buffer = &(pair->buffers[!memory->side]);
+    int ready;
+
+    /* Writes never block */
+    if (event == GUAC_SOCKET_WAIT_WRITABLE)
+        return 1;
+
+    __guac_socket_memory_lock(pair);
+
+#ifdef HAVE_LIBPTHREAD
+    {
+        struct timespec deadline;
+
+        /* Calculate absolute deadline, if any */
+        if (usec_timeout >= 0) {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            deadline.tv_sec  = now.tv_sec + usec_timeout / 1000000;
+            deadline.tv_nsec = (now.tv_usec + usec_timeout % 1000000) * 1000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+        }
+
+        /* Wait for data or end of stream */
+        while (buffer->length == buffer->offset && pair->open == 2) {
+
+            if (usec_timeout < 0)
+                pthread_cond_wait(&(pair->changed), &(pair->lock));
+
+            else if (pthread_cond_timedwait(&(pair->changed), &(pair->lock),
+                        &deadline) == ETIMEDOUT)
+                break;
+
+        }
+    }
+#endif
+
+    /* Ready if data can be read, or if end of stream can be read */
+    ready = buffer->length > buffer->offset || pair->open < 2;
+
+    __guac_socket_memory_unlock(pair);
+    return ready;
+
+}
+
+int __guac_socket_memory_close_handler(guac_socket* socket) {
+
+    __guac_socket_memory* memory = (__guac_socket_memory*) socket->data;
+    __guac_socket_memory_pair* pair = memory->pair;
+    int open;
+
+    __guac_socket_memory_lock(pair);
+
+    open = --pair->open;
+
+#ifdef HAVE_LIBPTHREAD
+    pthread_cond_broadcast(&(pair->changed));
+#endif
+
+    __guac_socket_memory_unlock(pair);
+
+    /* Free shared state once both sides are closed */
+    if (open == 0) {
+
+#ifdef HAVE_LIBPTHREAD
+        pthread_cond_destroy(&(pair->changed));
+        pthread_mutex_destroy(&(pair->lock));
+#endif
+
+        free(pair->buffers[0].data);
+        free(pair->buffers[1].data);
+        free(pair);
+
+    }
+
+    free(memory);
+    return 0;
+
+}
+
+/* Sets up the given guac_socket as the given side of the given pair, using
+ * the given transport data */
+void __guac_socket_memory_init(guac_socket* socket,
+        __guac_socket_memory_pair* pair, __guac_socket_memory* memory,
+        int side) {
+
+    memory->pair = pair;
+    memory->side = side;
+
+    socket->data = memory;
+    socket->read_handler   = __guac_socket_memory_read_handler;
+    socket->write_handler  = __guac_socket_memory_write_handler;
+    socket->wait_handler   = __guac_socket_memory_wait_handler;
+    socket->close_handler  = __guac_socket_memory_close_handler;
+
+#ifndef __MINGW32__
+    socket->writev_handler = __guac_socket_memory_writev_handler;
+#endif
+
+}
+
+/* Frees the given pair and transport data, any of which may be NULL */
+void __guac_socket_memory_free(__guac_socket_memory_pair* pair,
+        __guac_socket_memory* first, __guac_socket_memory* second) {
+
+    if (pair != NULL) {
+        free(pair->buffers[0].data);
+        free(pair->buffers[1].data);
+        free(pair);
+    }
+
+    free(first);
+    free(second);
+
+}
+
+int guac_socket_open_memory_pair(guac_socket** first, guac_socket** second) {
+
+    __guac_socket_memory* first_memory;
+    __guac_socket_memory* second_memory;
+    __guac_socket_memory_pair* pair;
+
+    /* Allocate shared state and transport data */
+    pair = calloc(1, sizeof(__guac_socket_memory_pair));
+    first_memory = malloc(sizeof(__guac_socket_memory));
+    second_memory = malloc(sizeof(__guac_socket_memory));
+
+    if (pair != NULL) {
+        pair->buffers[0].data = malloc(__GUAC_SOCKET_MEMORY_BUFFER_SIZE);
+        pair->buffers[1].data = malloc(__GUAC_SOCKET_MEMORY_BUFFER_SIZE);
+    }
+
+    /* If no memory available, return with error */
+    if (pair == NULL || first_memory == NULL || second_memory == NULL
+            || pair->buffers[0].data == NULL
+            || pair->buffers[1].data == NULL) {
+        __guac_socket_memory_free(pair, first_memory, second_memory);
+        guac_error = GUAC_STATUS_NO_MEMORY;
+        guac_error_message = "Could not allocate memory for socket pair";
+        return -1;
+    }
+
+    pair->buffers[0].size = __GUAC_SOCKET_MEMORY_BUFFER_SIZE;
+    pair->buffers[1].size = __GUAC_SOCKET_MEMORY_BUFFER_SIZE;
+
+    /* Allocate both sockets (guac_error already set on failure) */
+    *first = guac_socket_alloc();
+    if (*first == NULL) {
+        __guac_socket_memory_free(pair, first_memory, second_memory);
+        return -1;
+    }
+
+    *second = guac_socket_alloc();
+    if (*second == NULL) {
+        guac_socket_close(*first);
+        __guac_socket_memory_free(pair, first_memory, second_memory);
+        return -1;
+    }
+
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_init(&(pair->lock), NULL);
+    pthread_cond_init(&(pair->changed), NULL);
+#endif
+
+    /* Connect sockets */
+    pair->open = 2;
+    __guac_socket_memory_init(*first, pair, first_memory, 0);
+    __guac_socket_memory_init(*second, pair, second_memory, 1);
+
+    return 0;
+
+}
+
@@ -0,0 +1,389 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+#define __GUAC_SOCKET_SET_EPOLL
+#include <sys/epoll.h>
+#elif defined(__MINGW32__)
+#include <winsock2.h>
+#define poll WSAPoll
+#else
+#include <poll.h>
+#endif
+
+#include "socket.h"
+#include "error.h"
+
+/**
+ * The initial number of entries allocated for the guac_sockets of a
+ * guac_socket_set, or for the events returned by a single wait.
+ */
+#define __GUAC_SOCKET_SET_INITIAL_SIZE 16
+
+/* Defined within socket-fd.c */
+ssize_t __guac_socket_fd_read_handler(guac_socket* socket,
+        void* buf, size_t count);
+
+/* Returns whether the given socket may be added to a set, setting guac_error
+ * appropriately if not. Only sockets read directly from their file
+ * descriptor qualify, as other transports (such as io_uring) may consume
+ * data from the file descriptor before it is reported as readable. */
+int __guac_socket_set_check(guac_socket* socket) {
+
+    if (socket->fd < 0) {
+        guac_error = GUAC_STATUS_BAD_ARGUMENT;
+        guac_error_message = "Socket has no file descriptor to wait on";
+        return -1;
+    }
+
+    if (socket->read_handler != __guac_socket_fd_read_handler) {
+        guac_error = GUAC_STATUS_BAD_ARGUMENT;
+        guac_error_message = "Socket is not read directly from its file descriptor";
+        return -1;
+    }
+
+    return 0;
+
+}
+
+/* Sets guac_error appropriately for the given result of a wait, returning
+ * that same result */
+int __guac_socket_set_wait_result(int retval) {
+
+    /* Properly set guac_error */
+    if (retval <  0) {
+        guac_error = GUAC_STATUS_SEE_ERRNO;
+        guac_error_message = "Error while waiting for data on socket set";
+    }
+
+    if (retval == 0) {
+        guac_error = GUAC_STATUS_INPUT_TIMEOUT;
+        guac_error_message = "Timeout while waiting for data on socket set";
+    }
+
+    return retval;
+
+}
+
+#ifdef __GUAC_SOCKET_SET_EPOLL
+
+struct guac_socket_set {
+
+    /**
+     * The epoll instance watching the file descriptors of all guac_sockets
+     * within this set.
+     */
+    int epoll_fd;
+
+    /**
+     * Buffer receiving the events returned by epoll_wait().
+     */
+    struct epoll_event* events;
+
+    /**
+     * The number of entries allocated within events.
+     */
+    int events_size;
+
+};
+
+guac_socket_set* guac_socket_set_alloc() {
+
+    guac_socket_set* set = malloc(sizeof(guac_socket_set));
+    if (set == NULL) {
+        guac_error = GUAC_STATUS_NO_MEMORY;
+        guac_error_message = "Could not allocate memory for socket set";
+        return NULL;
+    }
+
+    set->events_size = __GUAC_SOCKET_SET_INITIAL_SIZE;
+    set->events = malloc(sizeof(struct epoll_event) * set->events_size);
+    if (set->events == NULL) {
+        guac_error = GUAC_STATUS_NO_MEMORY;
+        guac_error_message = "Could not allocate memory for socket set";
+        free(set);
+        return NULL;
+    }
+
+    set->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (set->epoll_fd < 0) {
+        guac_error = GUAC_STATUS_SEE_ERRNO;
+        guac_error_message = "Could not create epoll instance for socket set";
+        free(set->events);
+        free(set);
+        return NULL;
+    }
+
+    return set;
+
+}
+
+void guac_socket_set_free(guac_socket_set* set) {
+    close(set->epoll_fd);
+    free(set->events);
+    free(set);
+}
+
+int guac_socket_set_add(guac_socket_set* set, guac_socket* socket) {
+
+    struct epoll_event event;
+
+    if (__guac_socket_set_check(socket))
+        return -1;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = socket;
+
+    if (epoll_ctl(set->epoll_fd, EPOLL_CTL_ADD, socket->fd, &event)) {
+        guac_error = GUAC_STATUS_SEE_ERRNO;
+        guac_error_message = "Could not add socket to socket set";
+        return -1;
+    }
+
+    return 0;
+
+}
+
+int guac_socket_set_remove(guac_socket_set* set, guac_socket* socket) {
+
+    /* Event is ignored, but must be non-NULL for kernels before 2.6.9 */
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+
+    if (epoll_ctl(set->epoll_fd, EPOLL_CTL_DEL, socket->fd, &event)) {
+        guac_error = GUAC_STATUS_SEE_ERRNO;
+        guac_error_message = "Could not remove socket from socket set";
+        return -1;
+    }
+
+    return 0;
+
+}
+
+int guac_socket_set_wait(guac_socket_set* set, guac_socket** ready, int max,
+        int usec_timeout) {
+
+    int i;
+    int retval;
+
+    /* Grow event buffer if necessary */
+    if (max > set->events_size) {
+
+        struct epoll_event* events = realloc(set->events,
+                sizeof(struct epoll_event) * max);
+
+        if (events == NULL) {
+            guac_error = GUAC_STATUS_NO_MEMORY;
+            guac_error_message = "Could not allocate memory for socket set";
+            return -1;
+        }
+
+        set->events = events;
+        set->events_size = max;
+
+    }
+
+    /* Round timeout up to the millisecond resolution of epoll_wait() */
+    retval = epoll_wait(set->epoll_fd, set->events, max,
+            usec_timeout < 0 ? -1 : (usec_timeout + 999) / 1000);
+
+    /* Only ready guac_sockets are visited */
+    for (i = 0; i < retval; i++)
+        ready[i] = (guac_socket*) set->events[i].data.ptr;
+
+    return __guac_socket_set_wait_result(retval);
+
+}
+
+#else
+
+struct guac_socket_set {
+
+    /**
+     * All guac_sockets within this set.
+     */
+    guac_socket** sockets;
+
+    /**
+     * The poll() entry of each guac_socket within this set, in the same
+     * order as sockets.
+     */
+    struct pollfd* fds;
+
+    /**
+     * The number of guac_sockets within this set.
+     */
+    int count;
+
+    /**
+     * The number of entries allocated within sockets and fds.
+     */
+    int size;
+
+};
+
+guac_socket_set* guac_socket_set_alloc() {
+
+    guac_socket_set* set = malloc(sizeof(guac_socket_set));
+    if (set == NULL) {
+        guac_error = GUAC_STATUS_NO_MEMORY;
+        guac_error_message = "Could not allocate memory for socket set";
+        return NULL;
+    }
+
+    set->count = 0;
+    set->size = __GUAC_SOCKET_SET_INITIAL_SIZE;
+    set->sockets = malloc(sizeof(guac_socket*) * set->size);
+    set->fds = malloc(sizeof(struct pollfd) * set->size);
+
+    if (set->sockets == NULL || set->fds == NULL) {
+        guac_error = GUAC_STATUS_NO_MEMORY;
+        guac_error_message = "Could not allocate memory for socket set";
+        free(set->sockets);
+        free(set->fds);
+        free(set);
+        return NULL;
+    }
+
+    return set;
+
+}
+
+void guac_socket_set_free(guac_socket_set* set) {
+    free(set->sockets);
+    free(set->fds);
+    free(set);
+}
+
+int guac_socket_set_add(guac_socket_set* set, guac_socket* socket) {
+
+    if (__guac_socket_set_check(socket))
+        return -1;
+
+    /* Grow set if necessary */
+    if (set->count == set->size) {
+
+        int size = set->size * 2;
+        guac_socket** sockets;
+        struct pollfd* fds;
+
+        sockets = realloc(set->sockets, sizeof(guac_socket*) * size);
+        if (sockets == NULL) {
+            guac_error = GUAC_STATUS_NO_MEMORY;
+            guac_error_message = "Could not allocate memory for socket set";
+            return -1;
+        }
+        set->sockets = sockets;
+
+        fds = realloc(set->fds, sizeof(struct pollfd) * size);
+        if (fds == NULL) {
+            guac_error = GUAC_STATUS_NO_MEMORY;
+            guac_error_message = "Could not allocate memory for socket set";
+            return -1;
+        }
+        set->fds = fds;
+
+        set->size = size;
+
+    }
+
+    set->sockets[set->count] = socket;
+    set->fds[set->count].fd = socket->fd;
+    set->fds[set->count].events = POLLIN;
+    set->fds[set->count].revents = 0;
+    set->count++;
+
+    return 0;
+
+}
+
+int guac_socket_set_remove(guac_socket_set* set, guac_socket* socket) {
+
+    int i;
+
+    for (i = 0; i < set->count; i++) {
+
+        /* Replace removed entry with last entry */
+        if (set->sockets[i] == socket) {
+            set->count--;
+            set->sockets[i] = set->sockets[set->count];
+            set->fds[i] = set->fds[set->count];
+            return 0;
+        }
+
+    }
+
+    guac_error = GUAC_STATUS_BAD_ARGUMENT;
+    guac_error_message = "Socket is not within socket set";
+    return -1;
+
+}
+
+int guac_socket_set_wait(guac_socket_set* set, guac_socket** ready, int max,
+        int usec_timeout) {
+
+    int i;
+    int retval;
+
+    /* Round timeout up to the millisecond resolution of poll() */
+    retval = poll(set->fds, set->count,
+            usec_timeout < 0 ? -1 : (usec_timeout + 999) / 1000);
+
+    /* Without epoll, all guac_sockets must be visited */
+    if (retval > 0) {
+
+        int found = 0;
+        for (i = 0; i < set->count && found < max; i++) {
+            if (set->fds[i].revents)
+                ready[found++] = set->sockets[i];
+        }
+
+        retval = found;
+
+    }
+
+    return __guac_socket_set_wait_result(retval);
+
+}
+
+#endif
+
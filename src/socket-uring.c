@@ -0,0 +1,523 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include "socket.h"
+
+#if defined(HAVE_LIBURING) && defined(HAVE_LIBURING_H)
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <liburing.h>
+
+/**
+ * The number of entries in the submission queue of each io_uring. At most
+ * two operations are ever in flight at once within either io_uring: a
+ * receive started while waiting for input, and the operation being waited
+ * on.
+ */
+#define __GUAC_SOCKET_URING_ENTRIES 8
+
+/**
+ * The size of the buffer receiving input while waiting for input to become
+ * available, in bytes.
+ */
+#define __GUAC_SOCKET_URING_RECV_SIZE 65536
+
+/**
+ * An io_uring used for I/O in one direction only, such that input and output
+ * may be performed by different threads at once without sharing a ring.
+ */
+typedef struct __guac_socket_uring_queue {
+
+    /**
+     * The io_uring through which all I/O in this direction is submitted.
+     */
+    struct io_uring ring;
+
+    /**
+     * The result of the last operation submitted through ring other than a
+     * receive into recv_buffer or a poll for input.
+     */
+    int result;
+
+} __guac_socket_uring_queue;
+
+/**
+ * The transport data of a guac_socket using io_uring.
+ */
+typedef struct __guac_socket_uring {
+
+    /**
+     * The io_uring used for reading and for waiting for input. Only the
+     * thread reading from the guac_socket uses this io_uring.
+     */
+    __guac_socket_uring_queue input;
+
+    /**
+     * The io_uring used for writing and for waiting for the socket to be
+     * writable. Only the thread writing to the guac_socket uses this
+     * io_uring.
+     */
+    __guac_socket_uring_queue output;
+
+    /**
+     * Buffer receiving input while waiting for input. Receiving while
+     * waiting allows waiting and reading to be performed with a single
+     * submission.
+     */
+    char recv_buffer[__GUAC_SOCKET_URING_RECV_SIZE];
+
+    /**
+     * The offset of the first byte within recv_buffer not yet read.
+     */
+    int recv_offset;
+
+    /**
+     * The number of bytes received within recv_buffer.
+     */
+    int recv_length;
+
+    /**
+     * Whether a receive into recv_buffer is in flight.
+     */
+    int recv_pending;
+
+    /**
+     * Whether a poll for input is in flight. Input is polled for, rather
+     * than received while waiting, if the file descriptor is non-blocking.
+     */
+    int poll_pending;
+
+    /**
+     * The result of the last receive into recv_buffer which did not
+     * receive data: zero at end of stream, or a negative errno value.
+     */
+    int recv_status;
+
+    /**
+     * Whether recv_status holds a result not yet returned.
+     */
+    int recv_status_pending;
+
+} __guac_socket_uring;
+
+/* Completion tags, stored as the user data of each submission */
+static char __guac_socket_uring_recv_tag;
+static char __guac_socket_uring_poll_tag;
+static char __guac_socket_uring_op_tag;
+static char __guac_socket_uring_cancel_tag;
+
+/* Records the given completion from the given queue, returning non-zero if
+ * it is a completion of the given tag */
+int __guac_socket_uring_complete(__guac_socket_uring* uring,
+        __guac_socket_uring_queue* queue, struct io_uring_cqe* cqe,
+        void* tag) {
+
+    void* completed = io_uring_cqe_get_data(cqe);
+    int res = cqe->res;
+
+    io_uring_cqe_seen(&(queue->ring), cqe);
+
+    /* Data (or end of stream, or error) received while waiting */
+    if (completed == &__guac_socket_uring_recv_tag) {
+
+        uring->recv_pending = 0;
+
+        if (res > 0) {
+            uring->recv_offset = 0;
+            uring->recv_length = res;
+        }
+        else {
+            uring->recv_status = res;
+            uring->recv_status_pending = 1;
+        }
+
+    }
+
+    /* Input available (or error, which the next read will report) */
+    else if (completed == &__guac_socket_uring_poll_tag)
+        uring->poll_pending = 0;
+
+    /* Any other operation */
+    else if (completed == &__guac_socket_uring_op_tag)
+        queue->result = res;
+
+    return completed == tag;
+
+}
+
+/* Waits until the operation with the given tag completes within the given
+ * queue, or until the given timeout elapses. Returns 1 on completion, 0 on
+ * timeout, or a negative errno value on error. */
+int __guac_socket_uring_wait(__guac_socket_uring* uring,
+        __guac_socket_uring_queue* queue, void* tag, int usec_timeout) {
+
+    struct io_uring_cqe* cqe;
+    int retval;
+
+    for (;;) {
+
+        /* Wait forever if no timeout */
+        if (usec_timeout < 0)
+            retval = io_uring_wait_cqe(&(queue->ring), &cqe);
+
+        else {
+            struct __kernel_timespec timeout;
+            timeout.tv_sec  = usec_timeout / 1000000;
+            timeout.tv_nsec = (usec_timeout % 1000000) * 1000;
+            retval = io_uring_wait_cqe_timeout(&(queue->ring), &cqe,
+                    &timeout);
+        }
+
+        if (retval == -ETIME)
+            return 0;
+
+        if (retval < 0)
+            return retval;
+
+        if (__guac_socket_uring_complete(uring, queue, cqe, tag))
+            return 1;
+
+    }
+
+}
+
+/* Submits the operation prepared within the given submission of the given
+ * queue and waits for its result, returning the result with errno set if
+ * negative */
+ssize_t __guac_socket_uring_run(__guac_socket_uring* uring,
+        __guac_socket_uring_queue* queue, struct io_uring_sqe* sqe) {
+
+    int retval;
+
+    io_uring_sqe_set_data(sqe, &__guac_socket_uring_op_tag);
+
+    retval = io_uring_submit(&(queue->ring));
+    if (retval >= 0)
+        retval = __guac_socket_uring_wait(uring, queue,
+                &__guac_socket_uring_op_tag, -1);
+
+    if (retval < 0) {
+        errno = -retval;
+        return -1;
+    }
+
+    if (queue->result < 0) {
+        errno = -queue->result;
+        return -1;
+    }
+
+    return queue->result;
+
+}
+
+/* Returns a free submission of the given queue, or NULL with errno set if
+ * none is free */
+struct io_uring_sqe* __guac_socket_uring_get_sqe(
+        __guac_socket_uring_queue* queue) {
+
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&(queue->ring));
+
+    if (sqe == NULL)
+        errno = EBUSY;
+
+    return sqe;
+
+}
+
+/* Submits the operation prepared within the given submission of the given
+ * queue without waiting for its result, returning non-zero with errno set on
+ * error */
+int __guac_socket_uring_start(__guac_socket_uring_queue* queue,
+        struct io_uring_sqe* sqe, void* tag) {
+
+    int retval;
+
+    io_uring_sqe_set_data(sqe, tag);
+
+    retval = io_uring_submit(&(queue->ring));
+    if (retval < 0) {
+        errno = -retval;
+        return -1;
+    }
+
+    return 0;
+
+}
+
+/* Cancels the operation with the given tag within the given queue, waiting
+ * until it completes */
+void __guac_socket_uring_cancel(__guac_socket_uring* uring,
+        __guac_socket_uring_queue* queue, void* tag) {
+
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&(queue->ring));
+    if (sqe != NULL) {
+        io_uring_prep_cancel(sqe, tag, 0);
+        io_uring_sqe_set_data(sqe, &__guac_socket_uring_cancel_tag);
+        io_uring_submit(&(queue->ring));
+    }
+
+    __guac_socket_uring_wait(uring, queue, tag, -1);
+
+}
+
+ssize_t __guac_socket_uring_read_handler(guac_socket* socket,
+        void* buf, size_t count) {
+
+    __guac_socket_uring* uring = (__guac_socket_uring*) socket->data;
+    struct io_uring_sqe* sqe;
+    int available;
+
+    /* Wait for any receive already in flight */
+    if (uring->recv_pending) {
+        int retval = __guac_socket_uring_wait(uring, &(uring->input),
+                &__guac_socket_uring_recv_tag, -1);
+        if (retval < 0) {
+            errno = -retval;
+            return -1;
+        }
+    }
+
+    /* Return data received while waiting, if any */
+    available = uring->recv_length - uring->recv_offset;
+    if (available > 0) {
+
+        if (count > (size_t) available)
+            count = available;
+
+        memcpy(buf, uring->recv_buffer + uring->recv_offset, count);
+        uring->recv_offset += count;
+        return count;
+
+    }
+
+    /* Return end of stream or error received while waiting, if any */
+    if (uring->recv_status_pending) {
+
+        uring->recv_status_pending = 0;
+        if (uring->recv_status == 0)
+            return 0;
+
+        errno = -uring->recv_status;
+        return -1;
+
+    }
+
+    /* Otherwise, receive directly */
+    sqe = __guac_socket_uring_get_sqe(&(uring->input));
+    if (sqe == NULL)
+        return -1;
+
+    io_uring_prep_recv(sqe, socket->fd, buf, count, 0);
+    return __guac_socket_uring_run(uring, &(uring->input), sqe);
+
+}
+
+ssize_t __guac_socket_uring_write_handler(guac_socket* socket,
+        const void* buf, size_t count) {
+
+    __guac_socket_uring* uring = (__guac_socket_uring*) socket->data;
+
+    struct io_uring_sqe* sqe = __guac_socket_uring_get_sqe(&(uring->output));
+    if (sqe == NULL)
+        return -1;
+
+    io_uring_prep_write(sqe, socket->fd, buf, count, 0);
+    return __guac_socket_uring_run(uring, &(uring->output), sqe);
+
+}
+
+ssize_t __guac_socket_uring_writev_handler(guac_socket* socket,
+        const struct iovec* iov, int iovcnt) {
+
+    __guac_socket_uring* uring = (__guac_socket_uring*) socket->data;
+
+    struct io_uring_sqe* sqe = __guac_socket_uring_get_sqe(&(uring->output));
+    if (sqe == NULL)
+        return -1;
+
+    /* The offset is ignored for sockets and pipes */
+    io_uring_prep_writev(sqe, socket->fd, iov, iovcnt, 0);
+    return __guac_socket_uring_run(uring, &(uring->output), sqe);
+
+}
+
+int __guac_socket_uring_wait_handler(guac_socket* socket, int event,
+        int usec_timeout) {
+
+    __guac_socket_uring* uring = (__guac_socket_uring*) socket->data;
+    int retval;
+
+    /* Wait for writability with a single poll */
+    if (event == GUAC_SOCKET_WAIT_WRITABLE) {
+
+        struct io_uring_sqe* sqe =
+            __guac_socket_uring_get_sqe(&(uring->output));
+        if (sqe == NULL)
+            return -1;
+
+        io_uring_prep_poll_add(sqe, socket->fd, POLLOUT);
+        return __guac_socket_uring_run(uring, &(uring->output), sqe) < 0
+            ? -1 : 1;
+
+    }
+
+    /* Input is available if already received */
+    if (uring->recv_length > uring->recv_offset
+            || uring->recv_status_pending)
+        return 1;
+
+    /* Receive while waiting, unless the receive would not wait */
+    if (!uring->recv_pending && !uring->poll_pending) {
+
+        struct io_uring_sqe* sqe =
+            __guac_socket_uring_get_sqe(&(uring->input));
+        if (sqe == NULL)
+            return -1;
+
+        if (socket->__nonblocking) {
+            io_uring_prep_poll_add(sqe, socket->fd, POLLIN);
+            if (__guac_socket_uring_start(&(uring->input), sqe,
+                        &__guac_socket_uring_poll_tag))
+                return -1;
+            uring->poll_pending = 1;
+        }
+
+        else {
+            io_uring_prep_recv(sqe, socket->fd, uring->recv_buffer,
+                    sizeof(uring->recv_buffer), 0);
+            if (__guac_socket_uring_start(&(uring->input), sqe,
+                        &__guac_socket_uring_recv_tag))
+                return -1;
+            uring->recv_pending = 1;
+        }
+
+    }
+
+    retval = __guac_socket_uring_wait(uring, &(uring->input),
+            uring->recv_pending
+            ? (void*) &__guac_socket_uring_recv_tag
+            : (void*) &__guac_socket_uring_poll_tag, usec_timeout);
+
+    if (retval < 0) {
+        errno = -retval;
+        return -1;
+    }
+
+    return retval;
+
+}
+
+int __guac_socket_uring_close_handler(guac_socket* socket) {
+
+    __guac_socket_uring* uring = (__guac_socket_uring*) socket->data;
+
+    /* The receive buffer must not be freed while a receive is in flight */
+    if (uring->recv_pending)
+        __guac_socket_uring_cancel(uring, &(uring->input),
+                &__guac_socket_uring_recv_tag);
+
+    if (uring->poll_pending)
+        __guac_socket_uring_cancel(uring, &(uring->input),
+                &__guac_socket_uring_poll_tag);
+
+    io_uring_queue_exit(&(uring->input.ring));
+    io_uring_queue_exit(&(uring->output.ring));
+    free(uring);
+    return 0;
+
+}
+
+guac_socket* guac_socket_open_uring(int fd) {
+
+    guac_socket* socket;
+    __guac_socket_uring* uring = calloc(1, sizeof(__guac_socket_uring));
+
+    /* Fall back to plain file descriptor if io_uring is unavailable */
+    if (uring == NULL)
+        return guac_socket_open(fd);
+
+    if (io_uring_queue_init(__GUAC_SOCKET_URING_ENTRIES,
+                &(uring->input.ring), 0) < 0) {
+        free(uring);
+        return guac_socket_open(fd);
+    }
+
+    if (io_uring_queue_init(__GUAC_SOCKET_URING_ENTRIES,
+                &(uring->output.ring), 0) < 0) {
+        io_uring_queue_exit(&(uring->input.ring));
+        free(uring);
+        return guac_socket_open(fd);
+    }
+
+    /* Allocate socket, return with error if allocation fails */
+    socket = guac_socket_alloc();
+    if (socket == NULL) {
+        io_uring_queue_exit(&(uring->input.ring));
+        io_uring_queue_exit(&(uring->output.ring));
+        free(uring);
+        return NULL;
+    }
+
+    socket->fd = fd;
+    socket->data = uring;
+    socket->read_handler   = __guac_socket_uring_read_handler;
+    socket->write_handler  = __guac_socket_uring_write_handler;
+    socket->writev_handler = __guac_socket_uring_writev_handler;
+    socket->wait_handler   = __guac_socket_uring_wait_handler;
+    socket->close_handler  = __guac_socket_uring_close_handler;
+
+    return socket;
+
+}
+
+#else
+
+guac_socket* guac_socket_open_uring(int fd) {
+
+    /* Without io_uring support, use plain file descriptor */
+    return guac_socket_open(fd);
+
+}
+
+#endif
+
@@ -37,6 +37,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -46,14 +47,55 @@
 #ifdef __MINGW32__
 #include <winsock2.h>
 #else
-#include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #endif
 
 #include <time.h>
 #include <sys/time.h>
 
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
 #include "socket.h"
+#include "parser.h"
 #include "error.h"
+#include "base64.h"
+#include "format.h"
+#include "encoder.h"
+#include "stats.h"
+
+/* Flushes the output chain, blocking until all output is written only if
+ * requested */
+ssize_t __guac_socket_flush(guac_socket* socket, int block);
+
+/* Flushes the output chain, ending the current frame */
+ssize_t __guac_socket_flush_frame(guac_socket* socket);
+
+/* Returns the current time in microseconds, relative to an arbitrary point */
+int64_t __guac_socket_time_usec();
+
+/* Socket option holding back partial packets, if any */
+#if defined(TCP_CORK)
+#define __GUAC_SOCKET_CORK TCP_CORK
+#elif defined(TCP_NOPUSH)
+#define __GUAC_SOCKET_CORK TCP_NOPUSH
+#endif
+
+/* Thread-safe mode requires threads and atomic operations */
+#if defined(HAVE_LIBPTHREAD) && defined(__GNUC__)
+#define __GUAC_SOCKET_THREADSAFE
+#endif
+
+/* Token bucket shared by all sockets */
+static __guac_socket_bucket __guac_socket_global_bucket;
+
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t __guac_socket_global_bucket_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 char __guac_socket_BASE64_CHARACTERS[64] = {
     'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
@@ -62,7 +104,7 @@ char __guac_socket_BASE64_CHARACTERS[64] = {
     'w', 'x', 'y', 'z', '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '+', '/', 
 };
 
-guac_socket* guac_socket_open(int fd) {
+guac_socket* guac_socket_alloc() {
 
     guac_socket* socket = malloc(sizeof(guac_socket));
 
@@ -74,48 +116,145 @@ guac_socket* guac_socket_open(int fd) {
     }
 
     socket->__ready = 0;
-    socket->__written = 0;
-    socket->fd = fd;
 
-    /* Allocate instruction buffer */
-    socket->__instructionbuf_size = 1024;
-    socket->__instructionbuf = malloc(socket->__instructionbuf_size);
-
-    /* If no memory available, return with error */
-    if (socket->__instructionbuf == NULL) {
-        guac_error = GUAC_STATUS_NO_MEMORY;
-        guac_error_message = "Could not allocate memory for instruction buffer";
+    /* No transport yet */
+    socket->fd = -1;
+    socket->data = NULL;
+    socket->read_handler = NULL;
+    socket->write_handler = NULL;
+    socket->writev_handler = NULL;
+    socket->wait_handler = NULL;
+    socket->close_handler = NULL;
+
+    /* No output buffered yet */
+    socket->__out_head = NULL;
+    socket->__out_tail = NULL;
+    socket->__out_segments = 0;
+    socket->__out_offset = 0;
+    socket->__out_free = NULL;
+    socket->__nonblocking = 0;
+
+    /* No rate limit by default */
+    socket->__bucket.__rate = 0;
+
+    /* No I/O performed yet */
+    memset(&socket->__stats, 0, sizeof(socket->__stats));
+    socket->__opcode = 0;
+    socket->__opcode_start = 0;
+
+    /* Allocate parser for input */
+    socket->__parser = guac_parser_alloc();
+
+    /* If no memory available, return with error (guac_error already set) */
+    if (socket->__parser == NULL) {
         free(socket);
         return NULL;
     }
 
-    /* Init members */
-    socket->__instructionbuf_used_length = 0;
-    socket->__instructionbuf_parse_start = 0;
-    socket->__instructionbuf_elementc = 0;
+    /* No arguments pooled for batched reads yet */
+    socket->__instructionbuf_argv = NULL;
+    socket->__instructionbuf_argv_size = 0;
+
+    /* Buffer PNG data by default (GUAC_PROTOCOL_PNG_BUFFERED) */
+    socket->__png_mode = 0;
+
+    /* Leave PNG compression to libpng (GUAC_PROTOCOL_PNG_DEFAULT) */
+    socket->__png_level = -1;
+    socket->__png_strategy = -1;
+    socket->__png_filters = -1;
+    socket->__encoder = NULL;
+    memset(socket->__palette_history, 0, sizeof(socket->__palette_history));
+
+    /* Flush only when requested by default */
+    socket->__flush_policy = GUAC_SOCKET_FLUSH_MANUAL;
+    socket->__flush_deadline = 0;
+    socket->__frame_start = 0;
+    socket->__corked = 0;
+
+    /* Single-threaded by default */
+    socket->__threadsafe = 0;
+    socket->__queue = NULL;
+    socket->__queued = 0;
+    socket->__writing = 0;
+    socket->__backlog_waiters = 0;
+    socket->__end_frame = 0;
+    socket->__shared_free = NULL;
 
     return socket;
 
 }
 
+void __guac_socket_free_segments(__guac_socket_segment* segment) {
+
+    /* Free all segments in list */
+    while (segment != NULL) {
+        __guac_socket_segment* next = segment->__next;
+        free(segment);
+        segment = next;
+    }
+
+}
+
+/* Corks or uncorks the transport, if possible */
+void __guac_socket_cork(guac_socket* socket, int cork) {
+
+    /* Ignore if already in requested state, or if corking is unsupported */
+    if (socket->__corked == cork || socket->__corked < 0)
+        return;
+
+#ifdef __GUAC_SOCKET_CORK
+    /* Only TCP sockets can be corked */
+    if (socket->fd >= 0 && setsockopt(socket->fd, IPPROTO_TCP,
+                __GUAC_SOCKET_CORK, &cork, sizeof(cork)) == 0) {
+        socket->__corked = cork;
+        return;
+    }
+#endif
+
+    /* Do not try again */
+    socket->__corked = -1;
+
+}
+
 void guac_socket_close(guac_socket* socket) {
-    guac_socket_flush(socket);
-    free(socket->__instructionbuf);
+
+#ifdef __GUAC_SOCKET_THREADSAFE
+    /* Write all submitted instructions along with the output chain */
+    guac_socket_set_threadsafe(socket, 0);
+#endif
+
+    /* Write everything, even if non-blocking */
+    __guac_socket_flush(socket, 1);
+    __guac_socket_cork(socket, 0);
+
+    /* Free output chain and segment pool */
+    __guac_socket_free_segments(socket->__out_head);
+    __guac_socket_free_segments(socket->__out_free);
+
+    free(socket->__instructionbuf_argv);
+    guac_parser_free(socket->__parser);
+
+    if (socket->__encoder != NULL)
+        __guac_encoder_free(socket->__encoder);
+
+    /* Free transport */
+    if (socket->close_handler)
+        socket->close_handler(socket);
     free(socket);
+
 }
 
 /* Write bytes, limit rate */
 ssize_t __guac_socket_write(guac_socket* socket, const char* buf, int count) {
 
     int retval;
+    int64_t start = __guac_socket_time_usec();
 
-#ifdef __MINGW32__
-    /* MINGW32 WINSOCK only works with send() */
-    retval = send(socket->fd, buf, count, 0);
-#else
-    /* Use write() for all other platforms */
-    retval = write(socket->fd, buf, count);
-#endif
+    retval = socket->write_handler(socket, buf, count);
+
+    __GUAC_STAT_ADD(socket->__stats.write_calls, 1);
+    __GUAC_STAT_ADD(socket->__stats.write_usec,
+            __guac_socket_time_usec() - start);
 
     /* Record errors in guac_error */
     if (retval < 0) {
@@ -126,34 +265,571 @@ ssize_t __guac_socket_write(guac_socket* socket, const char* buf, int count) {
     return retval;
 }
 
-ssize_t guac_socket_write_int(guac_socket* socket, int64_t i) {
+#ifndef __MINGW32__
+/* Write segments with a single call to the transport */
+ssize_t __guac_socket_writev(guac_socket* socket, const struct iovec* iov,
+        int iovcnt) {
+
+    int64_t start = __guac_socket_time_usec();
+    int retval = socket->writev_handler(socket, iov, iovcnt);
+
+    __GUAC_STAT_ADD(socket->__stats.write_calls, 1);
+    __GUAC_STAT_ADD(socket->__stats.write_usec,
+            __guac_socket_time_usec() - start);
 
-    char buffer[128];
-    snprintf(buffer, sizeof(buffer), "%"PRIi64, i);
-    return guac_socket_write_string(socket, buffer);
+    /* Record errors in guac_error */
+    if (retval < 0) {
+        guac_error = GUAC_STATUS_SEE_ERRNO;
+        guac_error_message = "Error writing data to socket";
+    }
 
+    return retval;
 }
+#endif
 
-ssize_t guac_socket_write_string(guac_socket* socket, const char* str) {
+/* Returns the tail of the output chain, first adding a new segment if the
+ * tail has fewer than the given number of bytes available. */
+__guac_socket_segment* __guac_socket_chain_reserve(guac_socket* socket,
+        int length) {
 
-    char* __out_buf = socket->__out_buf;
+    __guac_socket_segment* segment = socket->__out_tail;
 
-    int retval;
+    /* Use current tail if sufficient space remains */
+    if (segment != NULL
+            && GUAC_SOCKET_SEGMENT_SIZE - segment->__length >= length)
+        return segment;
 
-    for (; *str != '\0'; str++) {
+    /* Flush when chain is full, blocking if the backlog is too large */
+    if (socket->__out_segments >= GUAC_SOCKET_MAX_SEGMENTS) {
 
-        __out_buf[socket->__written++] = *str; 
+        /* Send only full packets if more of the frame will follow */
+        if (socket->__flush_policy == GUAC_SOCKET_FLUSH_FRAME)
+            __guac_socket_cork(socket, 1);
 
-        /* Flush when necessary, return on error */
-        if (socket->__written > 8188 /* sizeof(__out_buf) - 4 */) {
+        if (__guac_socket_flush(socket, !socket->__nonblocking
+                || socket->__out_segments >= GUAC_SOCKET_MAX_BACKLOG_SEGMENTS))
+            return NULL;
 
-            retval = __guac_socket_write(socket, __out_buf, socket->__written);
+    }
 
-            if (retval < 0)
-                return retval;
+    /* Reuse pooled segment if available */
+    segment = socket->__out_free;
+    if (segment != NULL)
+        socket->__out_free = segment->__next;
 
-            socket->__written = 0;
+    /* Otherwise, allocate new segment */
+    else {
+        segment = malloc(sizeof(__guac_socket_segment));
+        if (segment == NULL) {
+            guac_error = GUAC_STATUS_NO_MEMORY;
+            guac_error_message = "Could not allocate memory for output segment";
+            return NULL;
         }
+    }
+
+    segment->__next = NULL;
+    segment->__length = 0;
+
+    /* Append to output chain */
+    if (socket->__out_tail != NULL)
+        socket->__out_tail->__next = segment;
+    else
+        socket->__out_head = segment;
+
+    socket->__out_tail = segment;
+    socket->__out_segments++;
+
+    return segment;
+
+}
+
+#ifdef __GUAC_SOCKET_THREADSAFE
+
+/* The instruction currently being written by a single thread to a
+ * thread-safe socket */
+typedef struct __guac_socket_builder {
+
+    /* The socket being written to, or NULL if no instruction is begun */
+    guac_socket* socket;
+
+    /* The segments of the instruction being written */
+    __guac_socket_segment* head;
+    __guac_socket_segment* tail;
+    int segments;
+
+    /* Unused segments owned by this thread */
+    __guac_socket_segment* free;
+
+    /* Base64 bytes not yet written as part of a complete triplet */
+    int ready;
+    int ready_buf[3];
+
+    /* The opcode of the instruction being written */
+    int opcode;
+
+} __guac_socket_builder;
+
+/* Key of the builder of each thread */
+static pthread_key_t __guac_socket_builder_key;
+static pthread_once_t __guac_socket_builder_key_init = PTHREAD_ONCE_INIT;
+
+/* Condition signalled by writing threads of all sockets whenever threads may
+ * be waiting for the backlog of a socket to be written */
+static pthread_mutex_t __guac_socket_backlog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t __guac_socket_backlog_cond = PTHREAD_COND_INITIALIZER;
+
+/* Frees the builder of an exiting thread */
+void __guac_socket_builder_free(void* data) {
+
+    __guac_socket_builder* builder = (__guac_socket_builder*) data;
+
+    __guac_socket_free_segments(builder->head);
+    __guac_socket_free_segments(builder->free);
+    free(builder);
+
+}
+
+void __guac_socket_builder_key_alloc() {
+    pthread_key_create(&__guac_socket_builder_key, __guac_socket_builder_free);
+}
+
+/* Returns the builder of the current thread, allocating it if necessary */
+__guac_socket_builder* __guac_socket_get_builder() {
+
+    __guac_socket_builder* builder;
+
+    pthread_once(&__guac_socket_builder_key_init,
+            __guac_socket_builder_key_alloc);
+
+    builder = pthread_getspecific(__guac_socket_builder_key);
+    if (builder != NULL)
+        return builder;
+
+    builder = calloc(1, sizeof(__guac_socket_builder));
+    if (builder == NULL) {
+        guac_error = GUAC_STATUS_NO_MEMORY;
+        guac_error_message = "Could not allocate memory for instruction";
+        return NULL;
+    }
+
+    pthread_setspecific(__guac_socket_builder_key, builder);
+    return builder;
+
+}
+
+/* Returns the tail of the instruction being written by the current thread,
+ * first adding a new segment if the tail has fewer than the given number of
+ * bytes available */
+__guac_socket_segment* __guac_socket_builder_reserve(guac_socket* socket,
+        int length) {
+
+    __guac_socket_segment* segment;
+    __guac_socket_builder* builder = __guac_socket_get_builder();
+    if (builder == NULL)
+        return NULL;
+
+    /* Output written outside an instruction is part of the next */
+    if (builder->socket == NULL) {
+        builder->socket = socket;
+        builder->opcode = 0;
+    }
+
+    /* Each thread may write only one instruction at a time */
+    else if (builder->socket != socket) {
+        guac_error = GUAC_STATUS_BAD_STATE;
+        guac_error_message = "Thread is already writing an instruction to another socket";
+        return NULL;
+    }
+
+    /* Use current tail if sufficient space remains */
+    segment = builder->tail;
+    if (segment != NULL
+            && GUAC_SOCKET_SEGMENT_SIZE - segment->__length >= length)
+        return segment;
+
+    /* Take all segments returned by the writing thread if none are left */
+    if (builder->free == NULL)
+        builder->free = __atomic_exchange_n(&socket->__shared_free, NULL,
+                __ATOMIC_ACQUIRE);
+
+    /* Reuse unused segment if available */
+    segment = builder->free;
+    if (segment != NULL)
+        builder->free = segment->__next;
+
+    /* Otherwise, allocate new segment */
+    else {
+        segment = malloc(sizeof(__guac_socket_segment));
+        if (segment == NULL) {
+            guac_error = GUAC_STATUS_NO_MEMORY;
+            guac_error_message = "Could not allocate memory for output segment";
+            return NULL;
+        }
+    }
+
+    segment->__next = NULL;
+    segment->__length = 0;
+
+    /* Append to instruction */
+    if (builder->tail != NULL)
+        builder->tail->__next = segment;
+    else
+        builder->head = segment;
+
+    builder->tail = segment;
+    builder->segments++;
+
+    return segment;
+
+}
+
+/* Abandons any instruction being written to the given socket by the current
+ * thread */
+void __guac_socket_builder_discard(guac_socket* socket) {
+
+    __guac_socket_builder* builder;
+
+    pthread_once(&__guac_socket_builder_key_init,
+            __guac_socket_builder_key_alloc);
+
+    builder = pthread_getspecific(__guac_socket_builder_key);
+
+    if (builder == NULL || builder->socket != socket)
+        return;
+
+    /* Keep segments for later instructions */
+    if (builder->tail != NULL) {
+        builder->tail->__next = builder->free;
+        builder->free = builder->head;
+    }
+
+    builder->socket = NULL;
+    builder->head = NULL;
+    builder->tail = NULL;
+    builder->segments = 0;
+    builder->ready = 0;
+
+}
+
+/* Moves all submitted instructions into the output chain, in the order they
+ * were submitted. Only the writing thread may do this. */
+void __guac_socket_drain(guac_socket* socket) {
+
+    __guac_socket_segment* ordered = NULL;
+    int count = 0;
+
+    __guac_socket_segment* segment = __atomic_exchange_n(&socket->__queue,
+            NULL, __ATOMIC_SEQ_CST);
+
+    /* Restore order of instructions, keeping segments of each in order */
+    while (segment != NULL) {
+        __guac_socket_segment* last = segment->__last;
+        __guac_socket_segment* next = last->__next;
+        last->__next = ordered;
+        ordered = segment;
+        segment = next;
+    }
+
+    while ((segment = ordered) != NULL) {
+
+        __guac_socket_segment* tail = socket->__out_tail;
+
+        ordered = segment->__next;
+        count++;
+
+        /* Copy small segments into the tail, such that many short
+         * instructions are still written as a few full segments */
+        if (tail != NULL && GUAC_SOCKET_SEGMENT_SIZE - tail->__length
+                >= segment->__length) {
+
+            memcpy(tail->__data + tail->__length, segment->__data,
+                    segment->__length);
+            tail->__length += segment->__length;
+
+            segment->__next = socket->__out_free;
+            socket->__out_free = segment;
+
+        }
+
+        /* Append others directly */
+        else {
+
+            segment->__next = NULL;
+
+            if (tail != NULL)
+                tail->__next = segment;
+            else
+                socket->__out_head = segment;
+
+            socket->__out_tail = segment;
+            socket->__out_segments++;
+
+        }
+
+    }
+
+    __atomic_sub_fetch(&socket->__queued, count, __ATOMIC_SEQ_CST);
+
+}
+
+/* Blocks until the given socket has no writing thread, or until fewer than
+ * GUAC_SOCKET_MAX_BACKLOG_SEGMENTS segments are waiting to be written */
+void __guac_socket_backlog_wait(guac_socket* socket) {
+
+    pthread_mutex_lock(&__guac_socket_backlog_lock);
+    __atomic_add_fetch(&socket->__backlog_waiters, 1, __ATOMIC_SEQ_CST);
+
+    while (__atomic_load_n(&socket->__writing, __ATOMIC_SEQ_CST)
+            && __atomic_load_n(&socket->__queued, __ATOMIC_SEQ_CST)
+                >= GUAC_SOCKET_MAX_BACKLOG_SEGMENTS)
+        pthread_cond_wait(&__guac_socket_backlog_cond,
+                &__guac_socket_backlog_lock);
+
+    __atomic_sub_fetch(&socket->__backlog_waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&__guac_socket_backlog_lock);
+
+}
+
+/* Wakes all threads waiting within __guac_socket_backlog_wait(), if any.
+ * Only the writing thread may do this, after reducing the backlog or
+ * ceasing to write. */
+void __guac_socket_backlog_signal(guac_socket* socket) {
+
+    /* Avoid locking unless a thread may be waiting */
+    if (__atomic_load_n(&socket->__backlog_waiters, __ATOMIC_SEQ_CST) == 0)
+        return;
+
+    pthread_mutex_lock(&__guac_socket_backlog_lock);
+    pthread_cond_broadcast(&__guac_socket_backlog_cond);
+    pthread_mutex_unlock(&__guac_socket_backlog_lock);
+
+}
+
+/* Returns all pooled segments to the threads submitting instructions. Only
+ * the writing thread may do this. */
+void __guac_socket_share_free(guac_socket* socket) {
+
+    __guac_socket_segment* first = socket->__out_free;
+    __guac_socket_segment* last = first;
+    __guac_socket_segment* shared;
+
+    if (first == NULL)
+        return;
+
+    while (last->__next != NULL)
+        last = last->__next;
+
+    /* Segments are only ever taken all at once, thus pushing is safe */
+    shared = __atomic_load_n(&socket->__shared_free, __ATOMIC_RELAXED);
+    do {
+        last->__next = shared;
+    } while (!__atomic_compare_exchange_n(&socket->__shared_free, &shared,
+                first, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    socket->__out_free = NULL;
+
+}
+
+/* Writes all submitted instructions if no other thread is writing, ending
+ * the current frame only if requested. An end of frame requested while
+ * another thread is writing is left to that thread. */
+ssize_t __guac_socket_flush_threadsafe(guac_socket* socket, int end_frame) {
+
+    ssize_t retval;
+
+    /* Request end of frame before possibly leaving output to another
+     * thread, which must then end the frame itself */
+    if (end_frame)
+        __atomic_store_n(&socket->__end_frame, 1, __ATOMIC_SEQ_CST);
+
+    for (;;) {
+
+        int writing = 0;
+
+        /* Leave output to the thread already writing, unless that thread
+         * has fallen too far behind */
+        if (!__atomic_compare_exchange_n(&socket->__writing, &writing, 1,
+                    0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+
+            if (__atomic_load_n(&socket->__queued, __ATOMIC_RELAXED)
+                    < GUAC_SOCKET_MAX_BACKLOG_SEGMENTS)
+                return 0;
+
+            __guac_socket_backlog_wait(socket);
+            continue;
+
+        }
+
+        /* Take any request to end the frame before draining, such that
+         * the instructions preceding the request are part of the frame */
+        end_frame = __atomic_exchange_n(&socket->__end_frame, 0,
+                __ATOMIC_SEQ_CST);
+
+        __guac_socket_drain(socket);
+        __guac_socket_backlog_signal(socket);
+
+        if (end_frame)
+            retval = __guac_socket_flush_frame(socket);
+
+        /* Send only full packets if more of the frame will follow */
+        else {
+            if (socket->__flush_policy == GUAC_SOCKET_FLUSH_FRAME)
+                __guac_socket_cork(socket, 1);
+            retval = __guac_socket_flush(socket, !socket->__nonblocking);
+        }
+
+        __guac_socket_share_free(socket);
+        __atomic_store_n(&socket->__writing, 0, __ATOMIC_SEQ_CST);
+        __guac_socket_backlog_signal(socket);
+
+        /* Write anything submitted and end any frame ended while writing,
+         * as the threads which did so have left it to this thread */
+        if (retval || (__atomic_load_n(&socket->__queue, __ATOMIC_SEQ_CST)
+                    == NULL && !__atomic_load_n(&socket->__end_frame,
+                        __ATOMIC_SEQ_CST)))
+            return retval;
+
+    }
+
+}
+
+/* Submits the instruction written by the current thread */
+int __guac_socket_builder_submit(guac_socket* socket) {
+
+    __guac_socket_segment* head;
+    __guac_socket_segment* tail;
+    __guac_socket_segment* segment;
+    __guac_socket_segment* queue;
+    int64_t length = 0;
+    int segments;
+
+    __guac_socket_builder* builder = __guac_socket_get_builder();
+    if (builder == NULL)
+        return -1;
+
+    /* Nothing to submit if nothing was written */
+    if (builder->socket != socket)
+        return 0;
+
+    head = builder->head;
+    tail = builder->tail;
+    segments = builder->segments;
+
+    for (segment = head; segment != NULL; segment = segment->__next)
+        length += segment->__length;
+
+    __GUAC_STAT_ADD_SHARED(socket->__stats.bytes_buffered, length);
+    __GUAC_STAT_ADD_SHARED(
+            socket->__stats.instructions_written[builder->opcode], 1);
+    __GUAC_STAT_ADD_SHARED(
+            socket->__stats.opcode_bytes[builder->opcode], length);
+
+    builder->socket = NULL;
+    builder->head = NULL;
+    builder->tail = NULL;
+    builder->segments = 0;
+
+    if (head == NULL)
+        return 0;
+
+    /* Push complete instruction */
+    head->__last = tail;
+    queue = __atomic_load_n(&socket->__queue, __ATOMIC_RELAXED);
+    do {
+        tail->__next = queue;
+    } while (!__atomic_compare_exchange_n(&socket->__queue, &queue, head,
+                1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    /* Write once a full chain is waiting */
+    if (__atomic_add_fetch(&socket->__queued, segments, __ATOMIC_RELAXED)
+            >= GUAC_SOCKET_MAX_SEGMENTS)
+        return __guac_socket_flush_threadsafe(socket, 0) != 0;
+
+    return 0;
+
+}
+
+#endif
+
+/* Returns the segment to which the given number of bytes of output should be
+ * written, first adding a new segment if necessary */
+__guac_socket_segment* __guac_socket_reserve(guac_socket* socket,
+        int length) {
+
+#ifdef __GUAC_SOCKET_THREADSAFE
+    /* Each thread writes its own instruction */
+    if (socket->__threadsafe)
+        return __guac_socket_builder_reserve(socket, length);
+#endif
+
+    return __guac_socket_chain_reserve(socket, length);
+
+}
+
+/* Records the given number of bytes as written to the given segment, which
+ * was returned by __guac_socket_reserve() */
+void __guac_socket_commit(guac_socket* socket, __guac_socket_segment* segment,
+        int length) {
+
+    segment->__length += length;
+
+    /* Thread-safe sockets count output as each instruction is submitted */
+    if (!socket->__threadsafe)
+        __GUAC_STAT_ADD(socket->__stats.bytes_buffered, length);
+
+}
+
+/* Returns the number of bytes buffered for the next base64 triplet written
+ * by the current thread, storing a pointer to those bytes in ready_buf */
+int* __guac_socket_get_ready(guac_socket* socket, int** ready_buf) {
+
+#ifdef __GUAC_SOCKET_THREADSAFE
+    /* Each thread writes its own base64 data */
+    if (socket->__threadsafe) {
+        __guac_socket_builder* builder = __guac_socket_get_builder();
+        if (builder != NULL) {
+            *ready_buf = builder->ready_buf;
+            return &builder->ready;
+        }
+    }
+#endif
+
+    *ready_buf = socket->__ready_buf;
+    return &socket->__ready;
+
+}
+
+ssize_t guac_socket_write_int(guac_socket* socket, int64_t i) {
+
+    char buffer[__GUAC_FORMAT_INT_LENGTH];
+    int length = __guac_format_int(buffer, i);
+    return guac_socket_write(socket, buffer, length);
+
+}
+
+ssize_t guac_socket_write(guac_socket* socket, const void* buf, size_t count) {
+
+    const char* char_buf = (const char*) buf;
+
+    while (count > 0) {
+
+        size_t available;
+
+        /* Get segment with space available, return on error */
+        __guac_socket_segment* segment = __guac_socket_reserve(socket, 1);
+        if (segment == NULL)
+            return -1;
+
+        /* Copy as much as fits */
+        available = GUAC_SOCKET_SEGMENT_SIZE - segment->__length;
+        if (available > count)
+            available = count;
+
+        memcpy(segment->__data + segment->__length, char_buf, available);
+        __guac_socket_commit(socket, segment, available);
+
+        char_buf += available;
+        count -= available;
 
     }
 
@@ -161,43 +837,44 @@ ssize_t guac_socket_write_string(guac_socket* socket, const char* str) {
 
 }
 
+ssize_t guac_socket_write_string(guac_socket* socket, const char* str) {
+    return guac_socket_write(socket, str, strlen(str));
+}
+
 ssize_t __guac_socket_write_base64_triplet(guac_socket* socket, int a, int b, int c) {
 
-    char* __out_buf = socket->__out_buf;
+    char* __out_buf;
 
-    int retval;
+    /* Get segment with room for all four characters, return on error */
+    __guac_socket_segment* segment = __guac_socket_reserve(socket, 4);
+    if (segment == NULL)
+        return -1;
+
+    __out_buf = segment->__data + segment->__length;
 
     /* Byte 1 */
-    __out_buf[socket->__written++] = __guac_socket_BASE64_CHARACTERS[(a & 0xFC) >> 2]; /* [AAAAAA]AABBBB BBBBCC CCCCCC */
+    __out_buf[0] = __guac_socket_BASE64_CHARACTERS[(a & 0xFC) >> 2]; /* [AAAAAA]AABBBB BBBBCC CCCCCC */
 
     if (b >= 0) {
-        __out_buf[socket->__written++] = __guac_socket_BASE64_CHARACTERS[((a & 0x03) << 4) | ((b & 0xF0) >> 4)]; /* AAAAAA[AABBBB]BBBBCC CCCCCC */
+        __out_buf[1] = __guac_socket_BASE64_CHARACTERS[((a & 0x03) << 4) | ((b & 0xF0) >> 4)]; /* AAAAAA[AABBBB]BBBBCC CCCCCC */
 
         if (c >= 0) {
-            __out_buf[socket->__written++] = __guac_socket_BASE64_CHARACTERS[((b & 0x0F) << 2) | ((c & 0xC0) >> 6)]; /* AAAAAA AABBBB[BBBBCC]CCCCCC */
-            __out_buf[socket->__written++] = __guac_socket_BASE64_CHARACTERS[c & 0x3F]; /* AAAAAA AABBBB BBBBCC[CCCCCC] */
+            __out_buf[2] = __guac_socket_BASE64_CHARACTERS[((b & 0x0F) << 2) | ((c & 0xC0) >> 6)]; /* AAAAAA AABBBB[BBBBCC]CCCCCC */
+            __out_buf[3] = __guac_socket_BASE64_CHARACTERS[c & 0x3F]; /* AAAAAA AABBBB BBBBCC[CCCCCC] */
         }
         else { 
-            __out_buf[socket->__written++] = __guac_socket_BASE64_CHARACTERS[((b & 0x0F) << 2)]; /* AAAAAA AABBBB[BBBB--]------ */
-            __out_buf[socket->__written++] = '='; /* AAAAAA AABBBB BBBB--[------] */
+            __out_buf[2] = __guac_socket_BASE64_CHARACTERS[((b & 0x0F) << 2)]; /* AAAAAA AABBBB[BBBB--]------ */
+            __out_buf[3] = '='; /* AAAAAA AABBBB BBBB--[------] */
         }
     }
     else {
-        __out_buf[socket->__written++] = __guac_socket_BASE64_CHARACTERS[((a & 0x03) << 4)]; /* AAAAAA[AA----]------ ------ */
-        __out_buf[socket->__written++] = '='; /* AAAAAA AA----[------]------ */
-        __out_buf[socket->__written++] = '='; /* AAAAAA AA---- ------[------] */
+        __out_buf[1] = __guac_socket_BASE64_CHARACTERS[((a & 0x03) << 4)]; /* AAAAAA[AA----]------ ------ */
+        __out_buf[2] = '='; /* AAAAAA AA----[------]------ */
+        __out_buf[3] = '='; /* AAAAAA AA---- ------[------] */
     }
 
-    /* At this point, 4 bytes have been socket->__written */
-
-    /* Flush when necessary, return on error */
-    if (socket->__written > 8188 /* sizeof(__out_buf) - 4 */) {
-        retval = __guac_socket_write(socket, __out_buf, socket->__written);
-        if (retval < 0)
-            return retval;
-
-        socket->__written = 0;
-    }
+    /* At this point, 4 bytes have been written */
+    __guac_socket_commit(socket, segment, 4);
 
     if (b < 0)
         return 1;
@@ -211,19 +888,20 @@ ssize_t __guac_socket_write_base64_triplet(guac_socket* socket, int a, int b, in
 
 ssize_t __guac_socket_write_base64_byte(guac_socket* socket, int buf) {
 
-    int* __ready_buf = socket->__ready_buf;
+    int* __ready_buf;
+    int* __ready = __guac_socket_get_ready(socket, &__ready_buf);
 
     int retval;
 
-    __ready_buf[socket->__ready++] = buf;
+    __ready_buf[(*__ready)++] = buf;
 
     /* Flush triplet */
-    if (socket->__ready == 3) {
+    if (*__ready == 3) {
         retval = __guac_socket_write_base64_triplet(socket, __ready_buf[0], __ready_buf[1], __ready_buf[2]);
         if (retval < 0)
             return retval;
 
-        socket->__ready = 0;
+        *__ready = 0;
     }
 
     return 1;
@@ -236,6 +914,43 @@ ssize_t guac_socket_write_base64(guac_socket* socket, const void* buf, size_t co
     const unsigned char* char_buf = (const unsigned char*) buf;
     const unsigned char* end = char_buf + count;
 
+    int* ready_buf;
+    int* ready = __guac_socket_get_ready(socket, &ready_buf);
+
+    /* Complete any partially-buffered triplet first */
+    while (*ready > 0 && char_buf < end) {
+
+        retval = __guac_socket_write_base64_byte(socket, *(char_buf++));
+        if (retval < 0)
+            return retval;
+
+    }
+
+    /* Encode all complete triplets directly into the output chain */
+    while (end - char_buf >= 3) {
+
+        size_t triplets = (end - char_buf) / 3;
+        size_t available;
+
+        /* Get segment with room for at least one triplet, return on error */
+        __guac_socket_segment* segment = __guac_socket_reserve(socket, 4);
+        if (segment == NULL)
+            return -1;
+
+        /* Encode as many triplets as will fit */
+        available = (GUAC_SOCKET_SEGMENT_SIZE - segment->__length) / 4;
+        if (triplets > available)
+            triplets = available;
+
+        __guac_base64_encode_triplets(char_buf, triplets,
+                segment->__data + segment->__length);
+
+        __guac_socket_commit(socket, segment, triplets * 4);
+        char_buf += triplets * 3;
+
+    }
+
+    /* Buffer any remaining bytes until more data or a flush */
     while (char_buf < end) {
 
         retval = __guac_socket_write_base64_byte(socket, *(char_buf++));
@@ -248,19 +963,618 @@ ssize_t guac_socket_write_base64(guac_socket* socket, const void* buf, size_t co
 
 }
 
-ssize_t guac_socket_flush(guac_socket* socket) {
+/* Returns whether the last failed write failed only because it would block */
+int __guac_socket_would_block() {
+#ifdef __MINGW32__
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+/* Waits until the transport can be written to without blocking */
+int __guac_socket_wait_writable(guac_socket* socket) {
 
     int retval;
+    int64_t start = __guac_socket_time_usec();
 
-    /* Flush remaining bytes in buffer */
-    if (socket->__written > 0) {
-        retval = __guac_socket_write(socket, socket->__out_buf, socket->__written);
-        if (retval < 0)
+    /* Wait forever, retrying if interrupted */
+    do {
+        retval = socket->wait_handler(socket, GUAC_SOCKET_WAIT_WRITABLE, -1);
+    } while (retval < 0 && errno == EINTR);
+
+    __GUAC_STAT_ADD(socket->__stats.write_usec,
+            __guac_socket_time_usec() - start);
+
+    if (retval < 0) {
+        guac_error = GUAC_STATUS_SEE_ERRNO;
+        guac_error_message = "Error while waiting to write to socket";
+    }
+
+    return retval;
+
+}
+
+/* Writes as much of the output chain as possible, up to the given limit,
+ * with a single call to the transport, returning the number of bytes
+ * written, or negative on error */
+ssize_t __guac_socket_write_chain(guac_socket* socket, int64_t limit) {
+
+    __guac_socket_segment* segment = socket->__out_head;
+    int offset = socket->__out_offset;
+    int64_t length;
+
+#ifndef __MINGW32__
+    /* Gather as many segments as possible if the transport can write
+     * several at once, skipping written data */
+    if (socket->writev_handler != NULL) {
+
+        struct iovec iov[GUAC_SOCKET_MAX_SEGMENTS];
+        int iovcnt = 0;
+
+        for (; segment != NULL && iovcnt < GUAC_SOCKET_MAX_SEGMENTS
+                && limit > 0; segment = segment->__next) {
+
+            length = segment->__length - offset;
+            if (length > limit)
+                length = limit;
+
+            iov[iovcnt].iov_base = segment->__data + offset;
+            iov[iovcnt].iov_len  = length;
+            iovcnt++;
+
+            limit -= length;
+            offset = 0;
+
+        }
+
+        return __guac_socket_writev(socket, iov, iovcnt);
+
+    }
+#endif
+
+    /* Otherwise, write only first segment */
+    length = segment->__length - offset;
+    if (length > limit)
+        length = limit;
+
+    return __guac_socket_write(socket, segment->__data + offset, length);
+
+}
+
+/* Returns the current time in microseconds, relative to an arbitrary point */
+int64_t __guac_socket_time_usec() {
+
+#ifdef HAVE_CLOCK_GETTIME
+    struct timespec current;
+    clock_gettime(CLOCK_MONOTONIC, &current);
+    return (int64_t) current.tv_sec * 1000000 + current.tv_nsec / 1000;
+#else
+    struct timeval current;
+    gettimeofday(&current, NULL);
+    return (int64_t) current.tv_sec * 1000000 + current.tv_usec;
+#endif
+
+}
+
+/* Sleeps for the given number of microseconds */
+void __guac_socket_sleep_usec(int64_t usec) {
+
+#ifdef HAVE_NANOSLEEP
+    struct timespec duration;
+    duration.tv_sec  = usec / 1000000;
+    duration.tv_nsec = (usec % 1000000) * 1000;
+    nanosleep(&duration, NULL);
+#else
+    usleep(usec);
+#endif
+
+}
+
+void __guac_socket_bucket_init(__guac_socket_bucket* bucket,
+        int64_t bytes_per_second, int64_t burst) {
+
+    /* Default to one second of output */
+    if (burst <= 0)
+        burst = bytes_per_second;
+
+    bucket->__rate = bytes_per_second;
+    bucket->__burst = burst;
+    bucket->__tokens = burst;
+    bucket->__last_refill = __guac_socket_time_usec();
+
+}
+
+/* Adds any tokens accumulated since the last refill, returning the number of
+ * tokens now available, or INT64_MAX if the bucket is unlimited */
+int64_t __guac_socket_bucket_refill(__guac_socket_bucket* bucket,
+        int64_t now) {
+
+    int64_t elapsed;
+    int64_t added;
+
+    if (bucket->__rate <= 0)
+        return INT64_MAX;
+
+    /* Consider no more time than needed to fill the bucket, such that the
+     * number of tokens added cannot overflow after a long idle period */
+    elapsed = now - bucket->__last_refill;
+    if (elapsed > (bucket->__burst - bucket->__tokens) * 1000000
+            / bucket->__rate + 1)
+        elapsed = (bucket->__burst - bucket->__tokens) * 1000000
+            / bucket->__rate + 1;
+
+    /* Add tokens for elapsed time, advancing refill time only by the time
+     * accounted for to avoid losing fractional tokens */
+    added = elapsed * bucket->__rate / 1000000;
+    if (added > 0) {
+        bucket->__tokens += added;
+        bucket->__last_refill += added * 1000000 / bucket->__rate;
+    }
+
+    /* Do not exceed burst size */
+    if (bucket->__tokens >= bucket->__burst) {
+        bucket->__tokens = bucket->__burst;
+        bucket->__last_refill = now;
+    }
+
+    return bucket->__tokens;
+
+}
+
+/* Returns the number of microseconds until the given number of tokens will
+ * be available */
+int64_t __guac_socket_bucket_delay(__guac_socket_bucket* bucket,
+        int64_t tokens) {
+
+    /* Never wait for more than can accumulate */
+    if (tokens > bucket->__burst)
+        tokens = bucket->__burst;
+
+    if (bucket->__rate <= 0 || bucket->__tokens >= tokens)
+        return 0;
+
+    return (tokens - bucket->__tokens) * 1000000 / bucket->__rate + 1;
+
+}
+
+/* Returns the number of bytes which may currently be written, waiting if
+ * necessary and allowed. Zero is returned only if no bytes may be written
+ * and waiting is not allowed. */
+int64_t __guac_socket_acquire(guac_socket* socket, int block) {
+
+    for (;;) {
+
+        int64_t available, global_available, delay, global_delay;
+        int64_t now = __guac_socket_time_usec();
+        int64_t pending = guac_socket_pending(socket);
+
+        /* Check socket and process limits */
+        available = __guac_socket_bucket_refill(&socket->__bucket, now);
+        delay = __guac_socket_bucket_delay(&socket->__bucket, pending);
+
+#ifdef HAVE_LIBPTHREAD
+        pthread_mutex_lock(&__guac_socket_global_bucket_lock);
+#endif
+        global_available = __guac_socket_bucket_refill(
+                &__guac_socket_global_bucket, now);
+        global_delay = __guac_socket_bucket_delay(
+                &__guac_socket_global_bucket, pending);
+#ifdef HAVE_LIBPTHREAD
+        pthread_mutex_unlock(&__guac_socket_global_bucket_lock);
+#endif
+
+        if (global_available < available)
+            available = global_available;
+
+        /* Write immediately if anything is allowed */
+        if (available > 0)
+            return available;
+
+        /* Leave output for later if waiting is not allowed */
+        if (!block)
+            return 0;
+
+        /* Otherwise, wait for whichever limit is further away */
+        if (global_delay > delay)
+            delay = global_delay;
+
+        __guac_socket_sleep_usec(delay);
+        __GUAC_STAT_ADD(socket->__stats.throttled_usec,
+                __guac_socket_time_usec() - now);
+
+    }
+
+}
+
+/* Removes tokens for the given number of bytes written */
+void __guac_socket_release(guac_socket* socket, int64_t written) {
+
+    if (socket->__bucket.__rate > 0)
+        socket->__bucket.__tokens -= written;
+
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_lock(&__guac_socket_global_bucket_lock);
+#endif
+
+    if (__guac_socket_global_bucket.__rate > 0)
+        __guac_socket_global_bucket.__tokens -= written;
+
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_unlock(&__guac_socket_global_bucket_lock);
+#endif
+
+}
+
+void guac_socket_set_rate_limit(guac_socket* socket, int64_t bytes_per_second,
+        int64_t burst) {
+    __guac_socket_bucket_init(&socket->__bucket, bytes_per_second, burst);
+}
+
+void guac_socket_set_global_rate_limit(int64_t bytes_per_second,
+        int64_t burst) {
+
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_lock(&__guac_socket_global_bucket_lock);
+#endif
+
+    __guac_socket_bucket_init(&__guac_socket_global_bucket,
+            bytes_per_second, burst);
+
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_unlock(&__guac_socket_global_bucket_lock);
+#endif
+
+}
+
+void guac_socket_set_input_limits(guac_socket* socket,
+        int max_instruction_size, int max_buffer_size) {
+    guac_parser_set_limits(socket->__parser, max_instruction_size,
+            max_buffer_size);
+}
+
+int64_t guac_socket_get_throttled_usec(guac_socket* socket) {
+    return __GUAC_STAT_LOAD(socket->__stats.throttled_usec);
+}
+
+void guac_socket_get_stats(guac_socket* socket, guac_socket_stats* stats) {
+
+    guac_socket_stats* current = &socket->__stats;
+    int i;
+
+    stats->bytes_written     = __GUAC_STAT_LOAD(current->bytes_written);
+    stats->bytes_read        = __GUAC_STAT_LOAD(current->bytes_read);
+    stats->bytes_buffered    = __GUAC_STAT_LOAD(current->bytes_buffered);
+    stats->write_calls       = __GUAC_STAT_LOAD(current->write_calls);
+    stats->read_calls        = __GUAC_STAT_LOAD(current->read_calls);
+    stats->flushes           = __GUAC_STAT_LOAD(current->flushes);
+    stats->wait_usec         = __GUAC_STAT_LOAD(current->wait_usec);
+    stats->write_usec        = __GUAC_STAT_LOAD(current->write_usec);
+    stats->throttled_usec    = __GUAC_STAT_LOAD(current->throttled_usec);
+    stats->instructions_read = __GUAC_STAT_LOAD(current->instructions_read);
+    stats->palette_hits      = __GUAC_STAT_LOAD(current->palette_hits);
+    stats->palette_misses    = __GUAC_STAT_LOAD(current->palette_misses);
+    stats->palette_skipped   = __GUAC_STAT_LOAD(current->palette_skipped);
+
+    for (i=0; i<GUAC_SOCKET_STATS_OPCODES; i++) {
+        stats->instructions_written[i] =
+            __GUAC_STAT_LOAD(current->instructions_written[i]);
+        stats->opcode_bytes[i] =
+            __GUAC_STAT_LOAD(current->opcode_bytes[i]);
+    }
+
+}
+
+void guac_socket_instruction_begin(guac_socket* socket, int opcode) {
+
+    /* Attribute unknown opcodes to opcode zero */
+    if (opcode < 0 || opcode >= GUAC_SOCKET_STATS_OPCODES)
+        opcode = 0;
+
+#ifdef __GUAC_SOCKET_THREADSAFE
+    /* Each thread writes its own instruction */
+    if (socket->__threadsafe) {
+
+        __guac_socket_builder* builder = __guac_socket_get_builder();
+
+        /* Any other instruction of this thread will fail when written */
+        if (builder != NULL && (builder->socket == NULL
+                    || builder->socket == socket)) {
+            builder->socket = socket;
+            builder->opcode = opcode;
+        }
+
+        /* Start latency deadline with first instruction of frame */
+        if (socket->__flush_policy == GUAC_SOCKET_FLUSH_FRAME
+                && __atomic_load_n(&socket->__frame_start,
+                    __ATOMIC_RELAXED) == 0) {
+            int64_t frame_start = 0;
+            __atomic_compare_exchange_n(&socket->__frame_start, &frame_start,
+                    __guac_socket_time_usec(), 0, __ATOMIC_RELAXED,
+                    __ATOMIC_RELAXED);
+        }
+
+        return;
+
+    }
+#endif
+
+    socket->__opcode = opcode;
+    socket->__opcode_start = socket->__stats.bytes_buffered;
+
+    /* Start latency deadline with first instruction of frame */
+    if (socket->__flush_policy == GUAC_SOCKET_FLUSH_FRAME
+            && socket->__frame_start == 0)
+        socket->__frame_start = __guac_socket_time_usec();
+
+}
+
+int guac_socket_instruction_end(guac_socket* socket) {
+
+    int opcode = socket->__opcode;
+
+#ifdef __GUAC_SOCKET_THREADSAFE
+    /* Submit instruction as a whole */
+    if (socket->__threadsafe) {
+
+        int64_t frame_start;
+
+        if (__guac_socket_builder_submit(socket))
+            return -1;
+
+        /* Flush frame early if its latency deadline has elapsed */
+        frame_start = __atomic_load_n(&socket->__frame_start,
+                __ATOMIC_RELAXED);
+        if (frame_start != 0 && __guac_socket_time_usec()
+                - frame_start >= socket->__flush_deadline)
+            return __guac_socket_flush_threadsafe(socket, 1) != 0;
+
+        return 0;
+
+    }
+#endif
+
+    __GUAC_STAT_ADD(socket->__stats.instructions_written[opcode], 1);
+    __GUAC_STAT_ADD(socket->__stats.opcode_bytes[opcode],
+            socket->__stats.bytes_buffered - socket->__opcode_start);
+
+    /* Flush frame early if its latency deadline has elapsed */
+    if (socket->__frame_start != 0 && __guac_socket_time_usec()
+            - socket->__frame_start >= socket->__flush_deadline)
+        return guac_socket_flush(socket);
+
+    return 0;
+
+}
+
+void guac_socket_instruction_abort(guac_socket* socket) {
+
+#ifdef __GUAC_SOCKET_THREADSAFE
+    /* Never submit an incomplete instruction */
+    if (socket->__threadsafe)
+        __guac_socket_builder_discard(socket);
+#endif
+
+    /* Otherwise, output is already buffered and nothing is counted */
+
+}
+
+/* Removes the given number of written bytes from the output chain, returning
+ * any segments written completely to the pool */
+void __guac_socket_consume(guac_socket* socket, size_t length) {
+
+    __guac_socket_segment* segment;
+
+    while ((segment = socket->__out_head) != NULL) {
+
+        size_t remaining = segment->__length - socket->__out_offset;
+
+        /* Stop within partially-written segment, unless it is the tail and
+         * may still be written to */
+        if (length < remaining
+                || (length == remaining && segment == socket->__out_tail)) {
+            socket->__out_offset += length;
+            break;
+        }
+
+        /* Return completely-written segment to pool */
+        socket->__out_head = segment->__next;
+        socket->__out_offset = 0;
+        socket->__out_segments--;
+
+        segment->__next = socket->__out_free;
+        socket->__out_free = segment;
+
+        length -= remaining;
+
+    }
+
+    /* Reset tail if chain is now empty */
+    if (socket->__out_head == NULL)
+        socket->__out_tail = NULL;
+
+}
+
+ssize_t __guac_socket_flush(guac_socket* socket, int block) {
+
+    __GUAC_STAT_ADD(socket->__stats.flushes, 1);
+
+    /* Write until nothing remains */
+    while (socket->__out_head != NULL) {
+
+        ssize_t retval;
+        int64_t limit;
+
+        /* Done if only the (empty) tail remains */
+        if (socket->__out_head == socket->__out_tail
+                && socket->__out_offset == socket->__out_tail->__length)
+            break;
+
+        /* Limit output to rate, waiting if necessary and allowed */
+        limit = __guac_socket_acquire(socket, block);
+        if (limit == 0)
+            return 0;
+
+        retval = __guac_socket_write_chain(socket, limit);
+
+        if (retval < 0) {
+
+            /* Retry if interrupted */
+            if (errno == EINTR)
+                continue;
+
+            /* If blocking would be required, leave backlog or wait */
+            if (__guac_socket_would_block()) {
+
+                if (!block)
+                    return 0;
+
+                if (__guac_socket_wait_writable(socket) < 0)
+                    return -1;
+
+                continue;
+
+            }
+
+            /* Otherwise, fail (guac_error already set) */
             return retval;
 
-        socket->__written = 0;
+        }
+
+        /* Remove everything written, keeping anything that remains */
+        __GUAC_STAT_ADD(socket->__stats.bytes_written, retval);
+        __guac_socket_consume(socket, retval);
+        __guac_socket_release(socket, retval);
+
+    }
+
+    return 0;
+
+}
+
+ssize_t __guac_socket_flush_frame(guac_socket* socket) {
+
+    ssize_t retval = __guac_socket_flush(socket, !socket->__nonblocking);
+
+    /* Any explicit flush ends the current frame, which threads of a
+     * thread-safe socket may be starting at the same time */
+#ifdef __GUAC_SOCKET_THREADSAFE
+    __atomic_store_n(&socket->__frame_start, 0, __ATOMIC_RELAXED);
+#else
+    socket->__frame_start = 0;
+#endif
+    __guac_socket_cork(socket, 0);
+
+    return retval;
+
+}
+
+ssize_t guac_socket_flush(guac_socket* socket) {
+
+#ifdef __GUAC_SOCKET_THREADSAFE
+    /* Only one thread may write the output chain at a time */
+    if (socket->__threadsafe)
+        return __guac_socket_flush_threadsafe(socket, 1);
+#endif
+
+    return __guac_socket_flush_frame(socket);
+
+}
+
+int guac_socket_set_threadsafe(guac_socket* socket, int threadsafe) {
+
+#ifdef __GUAC_SOCKET_THREADSAFE
+    /* Keep anything submitted but not yet written */
+    if (socket->__threadsafe && !threadsafe) {
+        __guac_socket_builder_discard(socket);
+        __guac_socket_drain(socket);
+        __guac_socket_free_segments(socket->__shared_free);
+        socket->__shared_free = NULL;
     }
 
+    socket->__threadsafe = threadsafe;
+    return 0;
+#else
+    /* Without threads, there is nothing to be safe from */
+    if (!threadsafe)
+        return 0;
+
+    guac_error = GUAC_STATUS_BAD_STATE;
+    guac_error_message = "Thread-safe sockets are not supported by this build";
+    return -1;
+#endif
+
+}
+
+void guac_socket_set_flush_policy(guac_socket* socket,
+        guac_socket_flush_policy policy, int usec_deadline) {
+
+    /* Nothing may remain corked without a frame to end */
+    if (policy == GUAC_SOCKET_FLUSH_MANUAL) {
+        socket->__frame_start = 0;
+        __guac_socket_cork(socket, 0);
+    }
+
+    socket->__flush_policy = policy;
+    socket->__flush_deadline = usec_deadline;
+
+}
+
+int guac_socket_end_frame(guac_socket* socket) {
+
+    /* Frames are flushed only by the frame flush policy */
+    if (socket->__flush_policy != GUAC_SOCKET_FLUSH_FRAME)
+        return 0;
+
+    return guac_socket_flush(socket) != 0;
+
+}
+
+size_t guac_socket_pending(guac_socket* socket) {
+
+    __guac_socket_segment* segment;
+    size_t pending = 0;
+
+    /* Total all segments */
+    for (segment = socket->__out_head; segment != NULL;
+            segment = segment->__next)
+        pending += segment->__length;
+
+    /* Exclude anything already written */
+    return pending - socket->__out_offset;
+
+}
+
+int guac_socket_set_nonblocking(guac_socket* socket, int nonblocking) {
+
+    /* Only file descriptors need a change of mode */
+    if (socket->fd < 0) {
+        socket->__nonblocking = nonblocking;
+        return 0;
+    }
+
+#ifdef __MINGW32__
+    u_long mode = nonblocking ? 1 : 0;
+
+    /* Set mode of socket */
+    if (ioctlsocket(socket->fd, FIONBIO, &mode) != 0) {
+        guac_error = GUAC_STATUS_SEE_ERRNO;
+        guac_error_message = "Unable to change blocking mode of socket";
+        return -1;
+    }
+#else
+    int flags = fcntl(socket->fd, F_GETFL);
+
+    /* Set or clear O_NONBLOCK */
+    if (flags < 0 || fcntl(socket->fd, F_SETFL,
+                nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) < 0) {
+        guac_error = GUAC_STATUS_SEE_ERRNO;
+        guac_error_message = "Unable to change blocking mode of socket";
+        return -1;
+    }
+#endif
+
+    socket->__nonblocking = nonblocking;
     return 0;
 
 }
@@ -269,8 +1583,11 @@ ssize_t guac_socket_flush_base64(guac_socket* socket) {
 
     int retval;
 
+    int* ready_buf;
+    int* ready = __guac_socket_get_ready(socket, &ready_buf);
+
     /* Flush triplet to output buffer */
-    while (socket->__ready > 0) {
+    while (*ready > 0) {
         retval = __guac_socket_write_base64_byte(socket, -1);
         if (retval < 0)
             return retval;
@@ -283,24 +1600,12 @@ ssize_t guac_socket_flush_base64(guac_socket* socket) {
 
 int guac_socket_select(guac_socket* socket, int usec_timeout) {
 
-    fd_set fds;
-    struct timeval timeout;
-    int retval;
-
-    /* No timeout if usec_timeout is negative */
-    if (usec_timeout < 0)
-        retval = select(socket->fd + 1, &fds, NULL, NULL, NULL); 
+    int64_t start = __guac_socket_time_usec();
+    int retval = socket->wait_handler(socket, GUAC_SOCKET_WAIT_READABLE,
+            usec_timeout);
 
-    /* Handle timeout if specified */
-    else {
-        timeout.tv_sec = usec_timeout/1000000;
-        timeout.tv_usec = usec_timeout%1000000;
-
-        FD_ZERO(&fds);
-        FD_SET(socket->fd, &fds);
-
-        retval = select(socket->fd + 1, &fds, NULL, NULL, &timeout);
-    }
+    __GUAC_STAT_ADD(socket->__stats.wait_usec,
+            __guac_socket_time_usec() - start);
 
     /* Properly set guac_error */
     if (retval <  0) {